@@ -1,8 +1,34 @@
 #include <GL/glew.h>
 #include <GLFW/glfw3.h>
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <condition_variable>
+#include <charconv>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <functional>
 #include <iostream>
+#include <limits>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <queue>
 #include <stdexcept>
+#include <string>
+#include <thread>
+#include <unordered_map>
 #include <vector>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+#include <fcntl.h>
+#include <sys/inotify.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 #include <glm/glm.hpp>
 #include <glm/gtc/matrix_transform.hpp>
 #include <glm/gtc/type_ptr.hpp>
@@ -27,370 +53,5052 @@ float nightDuration = 10.0f;
 vec3 spherePosition = vec3(0.0f, 13.5f, 0.0f); 
 float sphereRotationAngle = 0.0f;
 
-const char* vertex_shader_source = R"(
-    #version 330 core
-    layout(location = 0) in vec3 aPos;
-    layout(location = 1) in vec2 aTexCoord;
-    out vec2 TexCoord;
-    uniform mat4 transform;
-    void main() {
-        gl_Position = transform * vec4(aPos, 1.0);
-        TexCoord = aTexCoord;
-    }
-)";
-
-const char* fragment_shader_source_solid = R"(
-    #version 330 core
-    out vec4 fragColor;
-    void main() {
-        fragColor = vec4(1.0, 1.0, 1.0, 1.0);
-    }
-)";
-
-const char* fragment_shader_source_texture = R"(
-    #version 330 core
-    out vec4 fragColor;
-    in vec2 TexCoord;
-    uniform sampler2D texture1;
-    uniform vec3 lightColor;
-    uniform vec3 lightPos; 
-    void main() {
-        vec4 texColor = texture(texture1, TexCoord);
-        fragColor = texColor * vec4(lightColor, 1.0);
-    }
-)";
+void key_callback(GLFWwindow* window, int key, int scancode, int action, int mods) {
+    if (key == GLFW_KEY_ESCAPE && action == GLFW_PRESS) {
+        glfwSetWindowShouldClose(window, true);
+    }
+}
+
+void mouse_callback(GLFWwindow* window, double xposIn, double yposIn) {
+    if (firstMouse) {
+        lastX = xposIn;
+        lastY = yposIn;
+        firstMouse = false;
+    }
+    double xoffset = xposIn - lastX;
+    double yoffset = lastY - yposIn;
+    lastX = xposIn;
+    lastY = yposIn;
+    float sensitivity = 0.1;
+    xoffset *= sensitivity;
+    yoffset *= sensitivity;
+    zalfa -= xoffset; 
+    alfa -= yoffset; 
+    if (alfa > 89.0f) alfa = 89.0f; 
+    if (alfa < -89.0f) alfa = -89.0f;
+}
+
+atomic<size_t> heapAllocations{0};
+
+void* operator new(size_t size) {
+    heapAllocations.fetch_add(1, memory_order_relaxed);
+    if (void* memory = malloc(size ? size : 1)) return memory;
+    throw bad_alloc();
+}
+void operator delete(void* memory) noexcept {
+    free(memory);
+}
+void operator delete(void* memory, size_t) noexcept {
+    free(memory);
+}
+
+class FrameArena {
+public:
+    explicit FrameArena(size_t capacity = 1 << 20) : capacity(capacity), block(new char[capacity]) {}
+    FrameArena(const FrameArena&) = delete;
+    FrameArena& operator=(const FrameArena&) = delete;
+
+    template <typename T>
+    T* allocate(size_t count) {
+        static_assert(is_trivially_destructible<T>::value, "frame arena memory is never destructed");
+        size_t start = (used + alignof(T) - 1) / alignof(T) * alignof(T);
+        used = start + count * sizeof(T);
+        highWater = std::max(highWater, used);
+        void* memory = block.get() + start;
+        if (used > capacity) {
+            size_t space = count * sizeof(T) + alignof(T);
+            overflow.emplace_back(new char[space]);
+            memory = overflow.back().get();
+            memory = align(alignof(T), count * sizeof(T), memory, space);
+        }
+        T* items = static_cast<T*>(memory);
+        for (size_t i = 0; i < count; ++i) {
+            new (items + i) T();
+        }
+        return items;
+    }
+    void reset() {
+        if (highWater > capacity) {
+            capacity = highWater + highWater / 2;
+            block.reset(new char[capacity]);
+        }
+        overflow.clear();
+        used = 0;
+    }
+    size_t getCapacity() const {
+        return capacity;
+    }
+
+private:
+    size_t capacity;
+    size_t used = 0;
+    size_t highWater = 0;
+    unique_ptr<char[]> block;
+    vector<unique_ptr<char[]>> overflow;
+};
+
+class ThreadPool {
+public:
+    explicit ThreadPool(size_t threadCount) {
+        for (size_t i = 1; i < threadCount; ++i) {
+            workers.emplace_back([this, i]() { work(i); });
+        }
+    }
+    ~ThreadPool() {
+        {
+            lock_guard<mutex> lock(jobMutex);
+            stopping = true;
+        }
+        wake.notify_all();
+        for (thread& worker : workers) {
+            worker.join();
+        }
+    }
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+
+    size_t size() const {
+        return workers.size() + 1;
+    }
+    void run(void (*job)(const void*, size_t), const void* context) {
+        {
+            lock_guard<mutex> lock(jobMutex);
+            currentJob = job;
+            currentContext = context;
+            pending = workers.size();
+            generation++;
+        }
+        wake.notify_all();
+        insideJob = true;
+        job(context, 0);
+        insideJob = false;
+        unique_lock<mutex> lock(jobMutex);
+        finished.wait(lock, [this]() { return pending == 0; });
+    }
+    static bool isInsideJob() {
+        return insideJob;
+    }
+
+private:
+    vector<thread> workers;
+    mutex jobMutex;
+    condition_variable wake;
+    condition_variable finished;
+    void (*currentJob)(const void*, size_t) = nullptr;
+    const void* currentContext = nullptr;
+    size_t pending = 0;
+    uint64_t generation = 0;
+    bool stopping = false;
+    inline static thread_local bool insideJob = false;
+
+    void work(size_t index) {
+        insideJob = true;
+        uint64_t seen = 0;
+        unique_lock<mutex> lock(jobMutex);
+        while (true) {
+            wake.wait(lock, [&]() { return stopping || generation != seen; });
+            if (stopping) return;
+            seen = generation;
+            lock.unlock();
+            currentJob(currentContext, index);
+            lock.lock();
+            if (--pending == 0) finished.notify_one();
+        }
+    }
+};
+
+ThreadPool& workerPool() {
+    static ThreadPool pool(std::max(1u, thread::hardware_concurrency()));
+    return pool;
+}
+
+template <typename Body>
+void parallelFor(size_t count, const Body& body) {
+    ThreadPool& pool = workerPool();
+    size_t threadCount = std::min(pool.size(), count);
+    if (threadCount <= 1 || ThreadPool::isInsideJob()) {
+        if (count > 0) body(0, count);
+        return;
+    }
+    struct Range {
+        const Body* body;
+        size_t count;
+        size_t chunk;
+    } range = {&body, count, (count + threadCount - 1) / threadCount};
+    pool.run([](const void* context, size_t index) {
+        const Range& range = *static_cast<const Range*>(context);
+        size_t begin = index * range.chunk;
+        if (begin < range.count) (*range.body)(begin, std::min(begin + range.chunk, range.count));
+    }, &range);
+}
+
+enum GpuResourceType {
+    GPU_BUFFER,
+    GPU_VERTEX_ARRAY,
+    GPU_TEXTURE,
+    GPU_PROGRAM
+};
+
+struct GpuHandle {
+    uint32_t index = 0;
+    uint32_t generation = 0;
+
+    explicit operator bool() const {
+        return generation != 0;
+    }
+};
+
+class GpuResources {
+public:
+    GpuResources(size_t maxPooledBytes = 64 << 20) : maxPooledBytes(maxPooledBytes) {}
+    GpuResources(const GpuResources&) = delete;
+    GpuResources& operator=(const GpuResources&) = delete;
+
+    GpuHandle create(GpuResourceType type) {
+        GLuint name = 0;
+        switch (type) {
+            case GPU_BUFFER: glGenBuffers(1, &name); break;
+            case GPU_VERTEX_ARRAY: glGenVertexArrays(1, &name); break;
+            case GPU_TEXTURE: glGenTextures(1, &name); break;
+            case GPU_PROGRAM: name = glCreateProgram(); break;
+        }
+        return insert(type, name, 0, 0);
+    }
+
+    GpuHandle createBuffer(GLsizeiptr size, const void* data, GLenum usage) {
+        auto pooled = bufferPool.find(poolKey(size, usage));
+        if (pooled != bufferPool.end()) {
+            GLuint name = pooled->second;
+            bufferPool.erase(pooled);
+            pooledBytes -= size;
+            glBindBuffer(GL_COPY_WRITE_BUFFER, name);
+            if (data) {
+                glBufferSubData(GL_COPY_WRITE_BUFFER, 0, size, data);
+            } else {
+                glBufferData(GL_COPY_WRITE_BUFFER, size, nullptr, usage);
+            }
+            glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+            return insert(GPU_BUFFER, name, size, usage);
+        }
+        GLuint name;
+        glGenBuffers(1, &name);
+        glBindBuffer(GL_COPY_WRITE_BUFFER, name);
+        glBufferData(GL_COPY_WRITE_BUFFER, size, data, usage);
+        glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+        return insert(GPU_BUFFER, name, size, usage);
+    }
+
+    GLuint get(GpuHandle handle) const {
+        if (!handle || handle.index >= slots.size() || slots[handle.index].generation != handle.generation) return 0;
+        return slots[handle.index].name;
+    }
+
+    void release(GpuHandle handle) {
+        if (!get(handle)) return;
+        Slot& slot = slots[handle.index];
+        retiring.push_back({slot.type, slot.name, slot.size, slot.usage});
+        slot.name = 0;
+        if (++slot.generation == 0) slot.generation = 1;
+        freeSlots.push_back(handle.index);
+        live--;
+    }
+
+    void endFrame() {
+        if (!retiring.empty()) {
+            batches.push_back({glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0), {}});
+            batches.back().resources.swap(retiring);
+        }
+        while (!batches.empty()) {
+            GLenum status = glClientWaitSync(batches.front().fence, 0, 0);
+            if (status == GL_TIMEOUT_EXPIRED) break;
+            glDeleteSync(batches.front().fence);
+            for (const Retired& resource : batches.front().resources) {
+                destroy(resource);
+            }
+            batches.pop_front();
+        }
+    }
+
+    void shutdown() {
+        for (uint32_t index = 0; index < slots.size(); ++index) {
+            if (slots[index].name) release({index, slots[index].generation});
+        }
+        maxPooledBytes = 0;
+        for (Batch& batch : batches) {
+            glDeleteSync(batch.fence);
+            retiring.insert(retiring.end(), batch.resources.begin(), batch.resources.end());
+        }
+        batches.clear();
+        for (const Retired& resource : retiring) {
+            destroy(resource);
+        }
+        retiring.clear();
+        for (const auto& pooled : bufferPool) {
+            glDeleteBuffers(1, &pooled.second);
+        }
+        bufferPool.clear();
+        pooledBytes = 0;
+    }
+
+    size_t getLiveCount() const {
+        return live;
+    }
+    size_t getPooledBytes() const {
+        return pooledBytes;
+    }
+
+private:
+    struct Slot {
+        GpuResourceType type;
+        GLuint name;
+        uint32_t generation;
+        GLsizeiptr size;
+        GLenum usage;
+    };
+    struct Retired {
+        GpuResourceType type;
+        GLuint name;
+        GLsizeiptr size;
+        GLenum usage;
+    };
+    struct Batch {
+        GLsync fence;
+        vector<Retired> resources;
+    };
+
+    vector<Slot> slots;
+    vector<uint32_t> freeSlots;
+    vector<Retired> retiring;
+    deque<Batch> batches;
+    unordered_multimap<uint64_t, GLuint> bufferPool;
+    size_t maxPooledBytes;
+    size_t pooledBytes = 0;
+    size_t live = 0;
+
+    static uint64_t poolKey(GLsizeiptr size, GLenum usage) {
+        return (uint64_t)size << 16 | (usage & 0xFFFF);
+    }
+
+    GpuHandle insert(GpuResourceType type, GLuint name, GLsizeiptr size, GLenum usage) {
+        uint32_t index;
+        if (!freeSlots.empty()) {
+            index = freeSlots.back();
+            freeSlots.pop_back();
+        } else {
+            index = slots.size();
+            slots.push_back({type, 0, 1, 0, 0});
+        }
+        Slot& slot = slots[index];
+        slot.type = type;
+        slot.name = name;
+        slot.size = size;
+        slot.usage = usage;
+        live++;
+        return {index, slot.generation};
+    }
+
+    void destroy(const Retired& resource) {
+        switch (resource.type) {
+            case GPU_BUFFER:
+                if (resource.size > 0 && pooledBytes + resource.size <= maxPooledBytes) {
+                    bufferPool.emplace(poolKey(resource.size, resource.usage), resource.name);
+                    pooledBytes += resource.size;
+                } else {
+                    glDeleteBuffers(1, &resource.name);
+                }
+                break;
+            case GPU_VERTEX_ARRAY: glDeleteVertexArrays(1, &resource.name); break;
+            case GPU_TEXTURE: glDeleteTextures(1, &resource.name); break;
+            case GPU_PROGRAM: glDeleteProgram(resource.name); break;
+        }
+    }
+};
+
+GpuResources& gpuResources() {
+    static GpuResources resources;
+    return resources;
+}
+
+template <GpuResourceType Type>
+class GpuResource {
+public:
+    GpuResource() = default;
+    explicit GpuResource(GpuHandle handle) : handle(handle) {}
+    ~GpuResource() {
+        reset();
+    }
+    GpuResource(GpuResource&& other) noexcept : handle(other.handle) {
+        other.handle = GpuHandle();
+    }
+    GpuResource& operator=(GpuResource&& other) noexcept {
+        if (this != &other) {
+            reset();
+            handle = other.handle;
+            other.handle = GpuHandle();
+        }
+        return *this;
+    }
+    GpuResource(const GpuResource&) = delete;
+    GpuResource& operator=(const GpuResource&) = delete;
+
+    GLuint get() const {
+        return gpuResources().get(handle);
+    }
+    GpuHandle getHandle() const {
+        return handle;
+    }
+    explicit operator bool() const {
+        return get() != 0;
+    }
+    void reset() {
+        if (handle) gpuResources().release(handle);
+        handle = GpuHandle();
+    }
+
+private:
+    GpuHandle handle;
+};
+
+using BufferResource = GpuResource<GPU_BUFFER>;
+using VertexArrayResource = GpuResource<GPU_VERTEX_ARRAY>;
+using TextureResource = GpuResource<GPU_TEXTURE>;
+using ProgramResource = GpuResource<GPU_PROGRAM>;
+
+BufferResource createBuffer(GLsizeiptr size, const void* data, GLenum usage = GL_STATIC_DRAW) {
+    return BufferResource(gpuResources().createBuffer(size, data, usage));
+}
+VertexArrayResource createVertexArray() {
+    return VertexArrayResource(gpuResources().create(GPU_VERTEX_ARRAY));
+}
+TextureResource createTexture() {
+    return TextureResource(gpuResources().create(GPU_TEXTURE));
+}
+ProgramResource createProgram() {
+    return ProgramResource(gpuResources().create(GPU_PROGRAM));
+}
+
+class ShaderLibrary {
+public:
+    explicit ShaderLibrary(const string& directory = "shader") : directory(directory) {
+        watch = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+        if (watch >= 0 && inotify_add_watch(watch, directory.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO) < 0) {
+            close(watch);
+            watch = -1;
+        }
+    }
+    ~ShaderLibrary() {
+        if (watch >= 0) close(watch);
+    }
+    ShaderLibrary(const ShaderLibrary&) = delete;
+    ShaderLibrary& operator=(const ShaderLibrary&) = delete;
+
+    const char* get(const string& name) {
+        auto found = sources.find(name);
+        if (found == sources.end()) {
+            found = sources.emplace(name, readSource(name)).first;
+        }
+        return found->second.c_str();
+    }
+    void add(const string& name, const string& text) {
+        sources[name] = text;
+    }
+
+    vector<string> poll() {
+        vector<string> changed;
+        if (watch < 0) return changed;
+        alignas(inotify_event) char buffer[4096];
+        ssize_t length;
+        while ((length = read(watch, buffer, sizeof(buffer))) > 0) {
+            for (char* p = buffer; p < buffer + length; p += sizeof(inotify_event) + reinterpret_cast<inotify_event*>(p)->len) {
+                const inotify_event* event = reinterpret_cast<inotify_event*>(p);
+                string file = event->len ? event->name : "";
+                if (file.size() <= 5 || file.compare(file.size() - 5, 5, ".glsl") != 0) continue;
+                string name = file.substr(0, file.size() - 5);
+                auto found = sources.find(name);
+                if (found == sources.end()) continue;
+                try {
+                    found->second = readSource(name);
+                } catch (const runtime_error& e) {
+                    cerr << "shader reload err: " << e.what() << endl;
+                    continue;
+                }
+                if (find(changed.begin(), changed.end(), name) == changed.end()) {
+                    changed.push_back(name);
+                }
+            }
+        }
+        return changed;
+    }
+
+private:
+    string directory;
+    int watch = -1;
+    unordered_map<string, string> sources;
+
+    string readSource(const string& name) const {
+        string path = directory + "/" + name + ".glsl";
+        FILE* file = fopen(path.c_str(), "rb");
+        if (!file) {
+            throw runtime_error("cannot open " + path);
+        }
+        string text;
+        char chunk[4096];
+        size_t count;
+        while ((count = fread(chunk, 1, sizeof(chunk), file)) > 0) {
+            text.append(chunk, count);
+        }
+        fclose(file);
+        return text;
+    }
+};
+
+class Shader {
+public:
+    inline static string cacheDirectory = "shader-cache";
+
+    Shader(ShaderLibrary& library, const vector<string>& vertexPieces, const vector<string>& fragmentPieces)
+        : library(library), stages{{GL_VERTEX_SHADER, vertexPieces}, {GL_FRAGMENT_SHADER, fragmentPieces}} {
+        program = build();
+        finish(program.get());
+    }
+    Shader(ShaderLibrary& library, const vector<string>& computePieces)
+        : library(library), stages{{GL_COMPUTE_SHADER, computePieces}} {
+        program = build();
+        finish(program.get());
+    }
+    ~Shader() {
+        discardPending();
+        release(program);
+    }
+    Shader(const Shader&) = delete;
+    Shader& operator=(const Shader&) = delete;
+    void use() {
+        bindProgram(program.get());
+    }
+    GLuint getProgram() const {
+        return program.get();
+    }
+    bool dependsOn(const string& piece) const {
+        for (const auto& stage : stages) {
+            if (find(stage.second.begin(), stage.second.end(), piece) != stage.second.end()) return true;
+        }
+        return false;
+    }
+    void reload() {
+        discardPending();
+        pendingProgram = build();
+    }
+    bool finishReload() {
+        if (!pendingProgram) return false;
+        if (parallelCompileSupported()) {
+            GLint complete = GL_FALSE;
+            glGetProgramiv(pendingProgram.get(), GL_COMPLETION_STATUS_KHR, &complete);
+            if (!complete) return false;
+        }
+        ProgramResource finished = move(pendingProgram);
+        if (!finish(finished.get())) return false;
+        release(program);
+        program = move(finished);
+        return true;
+    }
+    static bool parallelCompileSupported() {
+        return GLEW_KHR_parallel_shader_compile || GLEW_ARB_parallel_shader_compile;
+    }
+    static void bindProgram(GLuint target) {
+        if (target == boundProgram) return;
+        glUseProgram(target);
+        boundProgram = target;
+    }
+private:
+    inline static GLuint boundProgram = 0;
+    ShaderLibrary& library;
+    vector<pair<GLenum, vector<string>>> stages;
+    ProgramResource program;
+    ProgramResource pendingProgram;
+    vector<GLuint> compiling;
+    string compilingCachePath;
+
+    ProgramResource build() {
+        vector<pair<GLenum, vector<const char*>>> sources;
+        for (const auto& stage : stages) {
+            sources.push_back({stage.first, {}});
+            for (const string& piece : stage.second) {
+                sources.back().second.push_back(library.get(piece));
+            }
+        }
+        ProgramResource created = createProgram();
+        GLuint target = created.get();
+        compiling.clear();
+        compilingCachePath.clear();
+        bool cacheable = !cacheDirectory.empty() && binaryCacheSupported();
+        string cachePath = cacheable ? binaryCachePath(sources) : string();
+        if (cacheable && loadBinary(target, cachePath)) return created;
+        for (const auto& stage : sources) {
+            GLuint shader = glCreateShader(stage.first);
+            glShaderSource(shader, stage.second.size(), stage.second.data(), nullptr);
+            glCompileShader(shader);
+            glAttachShader(target, shader);
+            compiling.push_back(shader);
+        }
+        if (cacheable) {
+            glProgramParameteri(target, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
+        }
+        glLinkProgram(target);
+        compilingCachePath = cachePath;
+        return created;
+    }
+    bool finish(GLuint target) {
+        for (GLuint shader : compiling) {
+            checkShader(shader);
+            glDetachShader(target, shader);
+            glDeleteShader(shader);
+        }
+        compiling.clear();
+        bool linked = checkProgram(target);
+        if (linked && !compilingCachePath.empty()) {
+            saveBinary(target, compilingCachePath);
+        }
+        return linked;
+    }
+    static void release(ProgramResource& target) {
+        if (target.get() == boundProgram) boundProgram = 0;
+        target.reset();
+    }
+    void discardPending() {
+        if (!pendingProgram) return;
+        for (GLuint shader : compiling) {
+            glDeleteShader(shader);
+        }
+        compiling.clear();
+        pendingProgram.reset();
+    }
+    static bool binaryCacheSupported() {
+        if (!GLEW_ARB_get_program_binary) return false;
+        GLint formats = 0;
+        glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS, &formats);
+        return formats > 0;
+    }
+    static string binaryCachePath(const vector<pair<GLenum, vector<const char*>>>& stages) {
+        uint64_t h = 1469598103934665603ull;
+        auto mix = [&](const void* data, size_t size) {
+            const unsigned char* bytes = static_cast<const unsigned char*>(data);
+            for (size_t i = 0; i < size; ++i) h = (h ^ bytes[i]) * 1099511628211ull;
+        };
+        for (const auto& stage : stages) {
+            mix(&stage.first, sizeof(stage.first));
+            for (const char* source : stage.second) {
+                mix(source, strlen(source) + 1);
+            }
+        }
+        for (GLenum name : {GL_VENDOR, GL_RENDERER, GL_VERSION}) {
+            const char* value = reinterpret_cast<const char*>(glGetString(name));
+            if (value) mix(value, strlen(value) + 1);
+        }
+        char file[32];
+        snprintf(file, sizeof(file), "/%016llx.bin", (unsigned long long)h);
+        return cacheDirectory + file;
+    }
+    static bool loadBinary(GLuint target, const string& path) {
+        FILE* file = fopen(path.c_str(), "rb");
+        if (!file) return false;
+        char magic[4];
+        GLenum format;
+        uint32_t size;
+        vector<char> binary;
+        bool ok = fread(magic, 1, 4, file) == 4 && memcmp(magic, "PBIN", 4) == 0
+               && fread(&format, sizeof(format), 1, file) == 1 && fread(&size, sizeof(size), 1, file) == 1 && size > 0;
+        if (ok) {
+            binary.resize(size);
+            ok = fread(binary.data(), 1, size, file) == size;
+        }
+        fclose(file);
+        if (!ok) return false;
+        glProgramBinary(target, format, binary.data(), size);
+        GLint success;
+        glGetProgramiv(target, GL_LINK_STATUS, &success);
+        return success == GL_TRUE;
+    }
+    static void saveBinary(GLuint target, const string& path) {
+        GLint length = 0;
+        glGetProgramiv(target, GL_PROGRAM_BINARY_LENGTH, &length);
+        if (length <= 0) return;
+        vector<char> binary(length);
+        GLenum format;
+        glGetProgramBinary(target, length, &length, &format, binary.data());
+        mkdir(cacheDirectory.c_str(), 0755);
+        string temporary = path + ".tmp";
+        FILE* file = fopen(temporary.c_str(), "wb");
+        if (!file) return;
+        uint32_t size = length;
+        bool ok = fwrite("PBIN", 1, 4, file) == 4 && fwrite(&format, sizeof(format), 1, file) == 1
+               && fwrite(&size, sizeof(size), 1, file) == 1 && fwrite(binary.data(), 1, size, file) == size;
+        ok = fclose(file) == 0 && ok;
+        if (!ok || rename(temporary.c_str(), path.c_str()) != 0) {
+            remove(temporary.c_str());
+        }
+    }
+    void checkShader(GLuint shader) {
+        GLint success;
+        glGetShaderiv(shader, GL_COMPILE_STATUS, &success);
+        if (!success) {
+            GLint logLength;
+            glGetShaderiv(shader, GL_INFO_LOG_LENGTH, &logLength);
+            vector<char> log(logLength);
+            glGetShaderInfoLog(shader, logLength, nullptr, log.data());
+            cerr << "Shader compile error: " << log.data() << endl;
+        }
+    }
+    bool checkProgram(GLuint program) {
+        GLint success;
+        glGetProgramiv(program, GL_LINK_STATUS, &success);
+        if (!success) {
+            GLint logLength;
+            glGetProgramiv(program, GL_INFO_LOG_LENGTH, &logLength);
+            vector<char> log(logLength);
+            glGetProgramInfoLog(program, logLength, nullptr, log.data());
+            cerr << "Program link error: " << log.data() << endl;
+        }
+        return success;
+    }
+};
+
+enum ShaderFeature : uint32_t {
+    SHADER_TEXTURED = 1 << 0,
+    SHADER_BINDLESS = 1 << 1,
+    SHADER_LIT = 1 << 2,
+    SHADER_DEFERRED = 1 << 3,
+    SHADER_INSTANCED = 1 << 4,
+    SHADER_DEPTH_ONLY = 1 << 5
+};
+
+class ShaderPermutations {
+public:
+    explicit ShaderPermutations(ShaderLibrary& library) : library(library) {}
+
+    static constexpr uint32_t normalize(uint32_t key) {
+        if (key & SHADER_DEPTH_ONLY) key &= SHADER_DEPTH_ONLY | SHADER_INSTANCED;
+        if (!(key & SHADER_TEXTURED)) key &= ~(uint32_t)SHADER_BINDLESS;
+        if (!(key & SHADER_LIT)) key &= ~(uint32_t)SHADER_DEFERRED;
+        return key;
+    }
+
+    Shader& get(uint32_t key) {
+        key = normalize(key);
+        auto found = variants.find(key);
+        if (found != variants.end()) return *found->second;
+        string header = "permutation:" + to_string(key);
+        library.add(header, headerSource(key));
+        vector<string> fragmentPieces = {header};
+        if ((key & SHADER_LIT) && !(key & SHADER_DEFERRED)) fragmentPieces.push_back("cluster_lights");
+        fragmentPieces.push_back("surface_fragment");
+        unique_ptr<Shader> shader(new Shader(library, {header, "octahedral", "surface_vertex"}, fragmentPieces));
+        return *variants.emplace(key, move(shader)).first->second;
+    }
+    void reload(const string& piece) {
+        for (auto& variant : variants) {
+            if (variant.second->dependsOn(piece)) variant.second->reload();
+        }
+    }
+    bool finishReload() {
+        bool reloaded = false;
+        for (auto& variant : variants) {
+            reloaded = variant.second->finishReload() || reloaded;
+        }
+        return reloaded;
+    }
+private:
+    ShaderLibrary& library;
+    unordered_map<uint32_t, unique_ptr<Shader>> variants;
+
+    static string headerSource(uint32_t key) {
+        string text = key & SHADER_INSTANCED ? "#version 430 core\n" : "#version 330 core\n";
+        if (key & SHADER_BINDLESS) text += "#extension GL_ARB_bindless_texture : require\n";
+        const pair<ShaderFeature, const char*> defines[] = {
+            {SHADER_TEXTURED, "TEXTURED"}, {SHADER_BINDLESS, "BINDLESS"}, {SHADER_LIT, "LIT"},
+            {SHADER_DEFERRED, "DEFERRED"}, {SHADER_INSTANCED, "INSTANCED"}, {SHADER_DEPTH_ONLY, "DEPTH_ONLY"}};
+        for (const auto& define : defines) {
+            if (key & define.first) text += string("#define ") + define.second + "\n";
+        }
+        return text;
+    }
+};
+
+enum VertexAttribute : uint32_t {
+    ATTRIBUTE_POSITION = 1 << 0,
+    ATTRIBUTE_TEXCOORD = 1 << 1,
+    ATTRIBUTE_NORMAL = 1 << 2,
+    ATTRIBUTE_INSTANCE = 1 << 3,
+    ATTRIBUTE_COLOR = 1 << 4,
+    ATTRIBUTE_LIGHTMAP = 1 << 5,
+    ATTRIBUTES_SURFACE = ATTRIBUTE_POSITION | ATTRIBUTE_TEXCOORD | ATTRIBUTE_NORMAL
+};
+
+struct RenderState {
+    bool depthTest = true;
+    bool depthWrite = true;
+    GLenum depthFunc = GL_LESS;
+    bool colorWrite = true;
+    bool blend = false;
+    GLenum blendSource = GL_SRC_ALPHA;
+    GLenum blendDestination = GL_ONE_MINUS_SRC_ALPHA;
+    bool cullFace = false;
+    float polygonOffsetFactor = 0.0f;
+    float polygonOffsetUnits = 0.0f;
+};
+
+struct TextureSlot {
+    const char* sampler;
+    int unit;
+};
+
+// All raster state changes go through Pipeline::bind, which only touches what differs from the last pipeline.
+// glClear honours the depth and color masks, so clears go through Pipeline::clear.
+class Pipeline {
+public:
+    Pipeline(Shader& shader, uint32_t vertexAttributes, const RenderState& state, const vector<TextureSlot>& textureSlots = {})
+        : shader(shader), vertexAttributes(vertexAttributes), state(state), textureSlots(textureSlots), id(nextId++) {
+        string error = validate();
+        if (!error.empty()) {
+            throw runtime_error("invalid pipeline: " + error);
+        }
+    }
+    Pipeline(const Pipeline&) = delete;
+    Pipeline& operator=(const Pipeline&) = delete;
+
+    void bind() const {
+        shader.use();
+        GLuint program = shader.getProgram();
+        if (program != validatedProgram) {
+            string error = validate();
+            if (!error.empty()) {
+                cerr << "pipeline err: " << error << endl;
+            }
+            for (const TextureSlot& slot : textureSlots) {
+                glUniform1i(glGetUniformLocation(program, slot.sampler), slot.unit);
+            }
+            validatedProgram = program;
+        }
+        if (applied == this) return;
+        const RenderState& next = state;
+        bool force = !applied;
+        const RenderState& last = force ? next : applied->state;
+        auto toggle = [&](GLenum capability, bool enabled, bool previous) {
+            if (!force && enabled == previous) return;
+            if (enabled) glEnable(capability); else glDisable(capability);
+        };
+        toggle(GL_DEPTH_TEST, next.depthTest, last.depthTest);
+        if (force || next.depthWrite != last.depthWrite) glDepthMask(next.depthWrite);
+        if (force || next.depthFunc != last.depthFunc) glDepthFunc(next.depthFunc);
+        if (force || next.colorWrite != last.colorWrite) glColorMask(next.colorWrite, next.colorWrite, next.colorWrite, next.colorWrite);
+        toggle(GL_BLEND, next.blend, last.blend);
+        if (force || next.blendSource != last.blendSource || next.blendDestination != last.blendDestination) {
+            glBlendFunc(next.blendSource, next.blendDestination);
+        }
+        toggle(GL_CULL_FACE, next.cullFace, last.cullFace);
+        bool offset = next.polygonOffsetFactor != 0.0f || next.polygonOffsetUnits != 0.0f;
+        bool lastOffset = last.polygonOffsetFactor != 0.0f || last.polygonOffsetUnits != 0.0f;
+        toggle(GL_POLYGON_OFFSET_FILL, offset, lastOffset);
+        if (offset && (force || next.polygonOffsetFactor != last.polygonOffsetFactor || next.polygonOffsetUnits != last.polygonOffsetUnits)) {
+            glPolygonOffset(next.polygonOffsetFactor, next.polygonOffsetUnits);
+        }
+        applied = this;
+    }
+    static void clear(GLbitfield mask) {
+        bool depthWritten = !(mask & GL_DEPTH_BUFFER_BIT) || (applied && applied->state.depthWrite);
+        bool colorWritten = !(mask & GL_COLOR_BUFFER_BIT) || (applied && applied->state.colorWrite);
+        if (depthWritten && colorWritten) {
+            glClear(mask);
+            return;
+        }
+        glDepthMask(GL_TRUE);
+        glColorMask(GL_TRUE, GL_TRUE, GL_TRUE, GL_TRUE);
+        glClear(mask);
+        applied = nullptr;
+    }
+    Shader& getShader() const {
+        return shader;
+    }
+    const RenderState& getState() const {
+        return state;
+    }
+    int getId() const {
+        return id;
+    }
+
+private:
+    Shader& shader;
+    const uint32_t vertexAttributes;
+    const RenderState state;
+    const vector<TextureSlot> textureSlots;
+    const int id;
+    mutable GLuint validatedProgram = 0;
+    inline static const Pipeline* applied = nullptr;
+    inline static int nextId = 0;
+
+    string validate() const {
+        GLuint program = shader.getProgram();
+        GLint linked = GL_FALSE;
+        glGetProgramiv(program, GL_LINK_STATUS, &linked);
+        if (!linked) return "program is not linked";
+        if (state.blend && !state.colorWrite) return "blending with color writes disabled";
+        GLint maxUnits = 0;
+        glGetIntegerv(GL_MAX_COMBINED_TEXTURE_IMAGE_UNITS, &maxUnits);
+        for (size_t i = 0; i < textureSlots.size(); ++i) {
+            if (textureSlots[i].unit < 0 || textureSlots[i].unit >= maxUnits) {
+                return string("texture unit out of range for ") + textureSlots[i].sampler;
+            }
+            for (size_t j = 0; j < i; ++j) {
+                if (textureSlots[j].unit == textureSlots[i].unit) {
+                    return string("texture unit shared by ") + textureSlots[j].sampler + " and " + textureSlots[i].sampler;
+                }
+            }
+        }
+        GLint attributeCount = 0;
+        glGetProgramiv(program, GL_ACTIVE_ATTRIBUTES, &attributeCount);
+        for (GLint i = 0; i < attributeCount; ++i) {
+            char name[64];
+            GLint size;
+            GLenum type;
+            glGetActiveAttrib(program, i, sizeof(name), nullptr, &size, &type, name);
+            GLint location = glGetAttribLocation(program, name);
+            if (location >= 0 && !(vertexAttributes & (1u << location))) {
+                return string("vertex layout lacks attribute ") + name;
+            }
+        }
+        return "";
+    }
+};
+
+enum VertexFormat {
+    VERTEX_FLOAT,
+    VERTEX_PACKED,
+    VERTEX_PACKED_NORMAL
+};
+
+struct PackedVertexData {
+    vector<unsigned char> bytes;
+    int stride = 0;
+    int vertexCount = 0;
+    bool hasNormals = false;
+    GLenum texCoordType = GL_UNSIGNED_SHORT;
+    vec3 positionScale = vec3(1.0f);
+    vec3 positionOffset = vec3(0.0f);
+};
+
+struct MeshView {
+    const float* vertices;
+    size_t vertexCount;
+    const uint16_t* indices;
+    size_t indexCount;
+};
+
+uint16_t floatToHalf(float value) {
+    uint32_t bits;
+    memcpy(&bits, &value, 4);
+    uint32_t sign = (bits >> 16) & 0x8000;
+    int exponent = ((bits >> 23) & 0xFF) - 127 + 15;
+    uint32_t mantissa = bits & 0x7FFFFF;
+    if (exponent <= 0) {
+        if (exponent < -10) return sign;
+        mantissa |= 0x800000;
+        return sign | ((mantissa >> (14 - exponent)) + ((mantissa >> (13 - exponent)) & 1));
+    }
+    if (exponent >= 31) {
+        return sign | 0x7C00;
+    }
+    uint32_t half = sign | (exponent << 10) | (mantissa >> 13);
+    return half + ((mantissa >> 12) & 1);
+}
+
+int16_t packSnorm16(float value) {
+    return (int16_t)roundf(std::clamp(value, -1.0f, 1.0f) * 32767.0f);
+}
+
+vec2 octEncode(vec3 n) {
+    n /= fabsf(n.x) + fabsf(n.y) + fabsf(n.z);
+    vec2 e(n.x, n.y);
+    if (n.z < 0.0f) {
+        e = vec2((1.0f - fabsf(n.y)) * (n.x >= 0.0f ? 1.0f : -1.0f),
+                 (1.0f - fabsf(n.x)) * (n.y >= 0.0f ? 1.0f : -1.0f));
+    }
+    return e;
+}
+
+PackedVertexData packVertices(const float* vertices, size_t vertexCount, int stride, bool withNormals, const float* normals, int normalStride) {
+    PackedVertexData packed;
+    packed.vertexCount = vertexCount;
+    packed.hasNormals = withNormals;
+    packed.stride = withNormals ? 16 : 12;
+
+    vec3 boundsMin(numeric_limits<float>::max()), boundsMax(-numeric_limits<float>::max());
+    bool unitTexCoords = true;
+    for (int i = 0; i < packed.vertexCount; ++i) {
+        const float* v = &vertices[i * stride];
+        boundsMin = glm::min(boundsMin, vec3(v[0], v[1], v[2]));
+        boundsMax = glm::max(boundsMax, vec3(v[0], v[1], v[2]));
+        unitTexCoords = unitTexCoords && v[3] >= 0.0f && v[3] <= 1.0f && v[4] >= 0.0f && v[4] <= 1.0f;
+    }
+    if (packed.vertexCount == 0) {
+        boundsMin = boundsMax = vec3(0.0f);
+    }
+    vec3 extent = glm::max(boundsMax - boundsMin, vec3(1e-20f));
+    packed.positionScale = extent;
+    packed.positionOffset = boundsMin;
+    packed.texCoordType = unitTexCoords ? GL_UNSIGNED_SHORT : GL_HALF_FLOAT;
+
+    packed.bytes.resize((size_t)packed.vertexCount * packed.stride);
+    parallelFor(packed.vertexCount, [&](size_t first, size_t last) {
+        for (size_t i = first; i < last; ++i) {
+            const float* v = &vertices[i * stride];
+            uint16_t out[8] = {0};
+            for (int c = 0; c < 3; ++c) {
+                out[c] = (uint16_t)roundf(std::clamp((v[c] - boundsMin[c]) / extent[c], 0.0f, 1.0f) * 65535.0f);
+            }
+            for (int c = 0; c < 2; ++c) {
+                out[4 + c] = unitTexCoords ? (uint16_t)roundf(v[3 + c] * 65535.0f) : floatToHalf(v[3 + c]);
+            }
+            if (withNormals) {
+                vec3 n(0.0f);
+                if (normals) {
+                    const float* m = &normals[i * normalStride];
+                    n = vec3(m[0], m[1], m[2]);
+                } else if (i - i % 3 + 2 < (size_t)packed.vertexCount) {
+                    const float* t = &vertices[(i - i % 3) * stride];
+                    vec3 a(t[0], t[1], t[2]), b(t[stride], t[stride + 1], t[stride + 2]), c(t[2 * stride], t[2 * stride + 1], t[2 * stride + 2]);
+                    n = cross(b - a, c - a);
+                }
+                if (dot(n, n) < 1e-30f) {
+                    n = vec3(0.0f, 0.0f, 1.0f);
+                }
+                vec2 e = octEncode(normalize(n));
+                out[6] = (uint16_t)packSnorm16(e.x);
+                out[7] = (uint16_t)packSnorm16(e.y);
+            }
+            memcpy(&packed.bytes[i * packed.stride], out, packed.stride);
+        }
+    });
+    return packed;
+}
+
+PackedVertexData packVertices(const vector<float>& vertices, bool withNormals, const vector<float>* normals = nullptr) {
+    return packVertices(vertices.data(), vertices.size() / 5, 5, withNormals, normals ? normals->data() : nullptr, 3);
+}
+
+PackedVertexData packVertices(const MeshView& mesh, bool withNormals) {
+    return packVertices(mesh.vertices, mesh.vertexCount, 8, withNormals, mesh.vertices + 5, 8);
+}
+
+void setupVertexAttributes(VertexFormat format, GLenum texCoordType, int floatStride = 5) {
+    if (format == VERTEX_FLOAT) {
+        glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, floatStride * sizeof(float), (void*)0);
+        glEnableVertexAttribArray(0);
+        glVertexAttribPointer(1, 2, GL_FLOAT, GL_FALSE, floatStride * sizeof(float), (void*)(3 * sizeof(float)));
+        glEnableVertexAttribArray(1);
+        return;
+    }
+    GLsizei stride = format == VERTEX_PACKED_NORMAL ? 16 : 12;
+    glVertexAttribPointer(0, 3, GL_UNSIGNED_SHORT, GL_TRUE, stride, (void*)0);
+    glEnableVertexAttribArray(0);
+    glVertexAttribPointer(1, 2, texCoordType, texCoordType == GL_UNSIGNED_SHORT, stride, (void*)8);
+    glEnableVertexAttribArray(1);
+    if (format == VERTEX_PACKED_NORMAL) {
+        glVertexAttribPointer(2, 2, GL_SHORT, GL_TRUE, stride, (void*)12);
+        glEnableVertexAttribArray(2);
+    }
+}
+
+void setPositionDecode(Shader& shader, const vec3& positionScale, const vec3& positionOffset) {
+    glUniform3fv(glGetUniformLocation(shader.getProgram(), "positionScale"), 1, value_ptr(positionScale));
+    glUniform3fv(glGetUniformLocation(shader.getProgram(), "positionOffset"), 1, value_ptr(positionOffset));
+}
+
+struct DrawGeometry {
+    GLuint vao;
+    int count;
+    vec3 positionScale;
+    vec3 positionOffset;
+    GLenum indexType = 0;
+};
+
+void drawGeometry(const DrawGeometry& geometry) {
+    if (geometry.indexType) {
+        glDrawElements(GL_TRIANGLES, geometry.count, geometry.indexType, nullptr);
+    } else {
+        glDrawArrays(GL_TRIANGLES, 0, geometry.count);
+    }
+}
+
+class ShapeRenderer {
+public:
+    ShapeRenderer(const vector<float>& vertices)
+        : vao(createVertexArray()), vbo(createBuffer(vertices.size() * sizeof(float), vertices.data())), count(vertices.size() / 5) {
+        glBindVertexArray(vao.get());
+        glBindBuffer(GL_ARRAY_BUFFER, vbo.get());
+        setupVertexAttributes(VERTEX_FLOAT, GL_FLOAT);
+        glBindBuffer(GL_ARRAY_BUFFER, 0);
+        glBindVertexArray(0);
+    }
+    ShapeRenderer(const PackedVertexData& packed)
+        : vao(createVertexArray()), vbo(createBuffer(packed.bytes.size(), packed.bytes.data())), count(packed.vertexCount) {
+        positionScale = packed.positionScale;
+        positionOffset = packed.positionOffset;
+        glBindVertexArray(vao.get());
+        glBindBuffer(GL_ARRAY_BUFFER, vbo.get());
+        setupVertexAttributes(packed.hasNormals ? VERTEX_PACKED_NORMAL : VERTEX_PACKED, packed.texCoordType);
+        glBindBuffer(GL_ARRAY_BUFFER, 0);
+        glBindVertexArray(0);
+    }
+    ShapeRenderer(const MeshView& mesh, VertexFormat format = VERTEX_PACKED_NORMAL, float scale = 1.0f)
+        : vao(createVertexArray()), ibo(createBuffer(mesh.indexCount * sizeof(uint16_t), mesh.indices)),
+          count(mesh.indexCount), indexType(GL_UNSIGNED_SHORT) {
+        glBindVertexArray(vao.get());
+        if (format == VERTEX_FLOAT) {
+            vbo = createBuffer(mesh.vertexCount * 8 * sizeof(float), mesh.vertices);
+            positionScale = vec3(scale);
+            glBindBuffer(GL_ARRAY_BUFFER, vbo.get());
+            setupVertexAttributes(VERTEX_FLOAT, GL_FLOAT, 8);
+        } else {
+            PackedVertexData packed = packVertices(mesh, format == VERTEX_PACKED_NORMAL);
+            vbo = createBuffer(packed.bytes.size(), packed.bytes.data());
+            positionScale = packed.positionScale * scale;
+            positionOffset = packed.positionOffset * scale;
+            glBindBuffer(GL_ARRAY_BUFFER, vbo.get());
+            setupVertexAttributes(format, packed.texCoordType);
+        }
+        glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, ibo.get());
+        glBindVertexArray(0);
+        glBindBuffer(GL_ARRAY_BUFFER, 0);
+    }
+    void setLightmapLayers(const MeshView& mesh, bool twoSided) {
+        int sides = twoSided ? 2 : 1;
+        vector<vec2> layers(mesh.vertexCount, vec2(0.0f));
+        for (size_t i = 0; i < mesh.indexCount; ++i) {
+            float front = (float)(i / 6 * sides);
+            layers[mesh.indices[i]] = vec2(front, front + sides - 1);
+        }
+        layerBuffer = createBuffer(layers.size() * sizeof(vec2), layers.data());
+        glBindVertexArray(vao.get());
+        glBindBuffer(GL_ARRAY_BUFFER, layerBuffer.get());
+        glVertexAttribPointer(5, 2, GL_FLOAT, GL_FALSE, sizeof(vec2), (void*)0);
+        glEnableVertexAttribArray(5);
+        glBindVertexArray(0);
+        glBindBuffer(GL_ARRAY_BUFFER, 0);
+    }
+    void render(Shader& shader, int textureIndex) {
+        shader.use();
+        setPositionDecode(shader, positionScale, positionOffset);
+        glUniform1i(glGetUniformLocation(shader.getProgram(), "textureIndex"), textureIndex);
+        glBindVertexArray(vao.get());
+        drawGeometry(getGeometry());
+    }
+    DrawGeometry getGeometry() const {
+        return {vao.get(), count, positionScale, positionOffset, indexType};
+    }
+private:
+    VertexArrayResource vao;
+    BufferResource vbo;
+    BufferResource ibo;
+    BufferResource layerBuffer;
+    int count;
+    GLenum indexType = 0;
+    vec3 positionScale = vec3(1.0f);
+    vec3 positionOffset = vec3(0.0f);
+};
+
+class StreamBuffer {
+public:
+    StreamBuffer(size_t regionSize, int regionCount = 3)
+        : regionSize(regionSize), regionCount(regionCount), fences(regionCount, nullptr) {
+        GLsizeiptr total = regionSize * regionCount;
+        glGenBuffers(1, &buffer);
+        glBindBuffer(GL_COPY_WRITE_BUFFER, buffer);
+        if (persistentSupported()) {
+            GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+            glBufferStorage(GL_COPY_WRITE_BUFFER, total, nullptr, flags);
+            mapped = static_cast<char*>(glMapBufferRange(GL_COPY_WRITE_BUFFER, 0, total, flags));
+            if (!mapped) {
+                throw runtime_error("cannot map stream buffer");
+            }
+        } else {
+            glBufferData(GL_COPY_WRITE_BUFFER, total, nullptr, GL_STREAM_DRAW);
+            staging.resize(total);
+            mapped = staging.data();
+        }
+        glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+    }
+    ~StreamBuffer() {
+        for (GLsync fence : fences) {
+            if (fence) glDeleteSync(fence);
+        }
+        if (staging.empty()) {
+            glBindBuffer(GL_COPY_WRITE_BUFFER, buffer);
+            glUnmapBuffer(GL_COPY_WRITE_BUFFER);
+            glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+        }
+        glDeleteBuffers(1, &buffer);
+    }
+    StreamBuffer(const StreamBuffer&) = delete;
+    StreamBuffer& operator=(const StreamBuffer&) = delete;
+
+    template <typename T>
+    T* allocate(size_t count) {
+        size_t start = (cursor + alignof(T) - 1) / alignof(T) * alignof(T);
+        if (start + count * sizeof(T) > regionSize) return nullptr;
+        cursor = start + count * sizeof(T);
+        return reinterpret_cast<T*>(mapped + region * regionSize + start);
+    }
+    size_t getOffset(const void* pointer) const {
+        return static_cast<const char*>(pointer) - mapped;
+    }
+    size_t getRegionOffset() const {
+        return region * regionSize;
+    }
+    GLuint getBuffer() const {
+        return buffer;
+    }
+    void flush() {
+        if (staging.empty() || cursor == flushed) return;
+        glBindBuffer(GL_COPY_WRITE_BUFFER, buffer);
+        glBufferSubData(GL_COPY_WRITE_BUFFER, getRegionOffset() + flushed, cursor - flushed, mapped + getRegionOffset() + flushed);
+        glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+        flushed = cursor;
+    }
+    void endFrame() {
+        if (staging.empty()) {
+            fences[region] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+        }
+        region = (region + 1) % regionCount;
+        cursor = flushed = 0;
+        if (fences[region]) {
+            GLenum result;
+            do {
+                result = glClientWaitSync(fences[region], GL_SYNC_FLUSH_COMMANDS_BIT, 1000000);
+            } while (result == GL_TIMEOUT_EXPIRED);
+            glDeleteSync(fences[region]);
+            fences[region] = nullptr;
+        }
+    }
+    static bool persistentSupported() {
+        return GLEW_ARB_buffer_storage;
+    }
+private:
+    size_t regionSize;
+    int regionCount;
+    int region = 0;
+    size_t cursor = 0;
+    size_t flushed = 0;
+    GLuint buffer;
+    char* mapped = nullptr;
+    vector<char> staging;
+    vector<GLsync> fences;
+};
+
+class DebugDraw {
+public:
+    explicit DebugDraw(size_t maxVertices = 1 << 18)
+        : vertices(maxVertices * sizeof(Vertex)), indices(maxVertices * 2 * sizeof(uint32_t)) {
+        vao = createVertexArray();
+        glBindVertexArray(vao.get());
+        glBindBuffer(GL_ARRAY_BUFFER, vertices.getBuffer());
+        glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, sizeof(Vertex), (void*)0);
+        glEnableVertexAttribArray(0);
+        glVertexAttribPointer(4, 4, GL_UNSIGNED_BYTE, GL_TRUE, sizeof(Vertex), (void*)(3 * sizeof(float)));
+        glEnableVertexAttribArray(4);
+        glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, indices.getBuffer());
+        glBindVertexArray(0);
+        glBindBuffer(GL_ARRAY_BUFFER, 0);
+    }
+    DebugDraw(const DebugDraw&) = delete;
+    DebugDraw& operator=(const DebugDraw&) = delete;
+
+    void line(const vec3& a, const vec3& b, const vec3& color) {
+        const vec3 points[2] = {a, b};
+        const uint8_t edges[2] = {0, 1};
+        add(points, 2, edges, 2, color);
+    }
+    void box(const vec3& boundsMin, const vec3& boundsMax, const vec3& color) {
+        vec3 points[8];
+        for (int i = 0; i < 8; ++i) {
+            points[i] = vec3(i & 1 ? boundsMax.x : boundsMin.x, i & 2 ? boundsMax.y : boundsMin.y, i & 4 ? boundsMax.z : boundsMin.z);
+        }
+        add(points, 8, boxEdges, 24, color);
+    }
+    void frustum(const mat4& viewProjection, const vec3& color) {
+        mat4 inverseViewProjection = inverse(viewProjection);
+        vec3 points[8];
+        for (int i = 0; i < 8; ++i) {
+            vec4 corner = inverseViewProjection * vec4(i & 1 ? 1.0f : -1.0f, i & 2 ? 1.0f : -1.0f, i & 4 ? 1.0f : -1.0f, 1.0f);
+            points[i] = vec3(corner) / corner.w;
+        }
+        add(points, 8, boxEdges, 24, color);
+    }
+    void light(const vec3& position, float radius, const vec3& color) {
+        const int segments = 16;
+        vec3 points[segments * 3];
+        uint8_t edges[segments * 6];
+        for (int i = 0; i < segments; ++i) {
+            float angle = i * 2.0f * M_PI / segments;
+            float c = cosf(angle) * radius, s = sinf(angle) * radius;
+            points[i] = position + vec3(c, s, 0.0f);
+            points[segments + i] = position + vec3(c, 0.0f, s);
+            points[segments * 2 + i] = position + vec3(0.0f, c, s);
+            for (int ring = 0; ring < 3; ++ring) {
+                edges[(ring * segments + i) * 2] = ring * segments + i;
+                edges[(ring * segments + i) * 2 + 1] = ring * segments + (i + 1) % segments;
+            }
+        }
+        add(points, segments * 3, edges, segments * 6, color);
+    }
+
+    void draw(const Pipeline& pipeline, const mat4& viewProjection) {
+        vertices.flush();
+        indices.flush();
+        if (indexCount > 0) {
+            pipeline.bind();
+            glUniformMatrix4fv(glGetUniformLocation(pipeline.getShader().getProgram(), "viewProjection"), 1, GL_FALSE, value_ptr(viewProjection));
+            glBindVertexArray(vao.get());
+            glDrawElementsBaseVertex(GL_LINES, indexCount, GL_UNSIGNED_INT, (void*)indices.getRegionOffset(),
+                                     vertices.getRegionOffset() / sizeof(Vertex));
+            glBindVertexArray(0);
+        }
+        if (dropped != reportedDropped) {
+            if (dropped > 0) cerr << "debug draw: " << dropped << " primitives dropped" << endl;
+            reportedDropped = dropped;
+        }
+        vertices.endFrame();
+        indices.endFrame();
+        indexCount = 0;
+        dropped = 0;
+    }
+
+private:
+    struct Vertex {
+        vec3 position;
+        uint32_t color;
+    };
+    inline static const uint8_t boxEdges[24] = {0, 1, 2, 3, 4, 5, 6, 7, 0, 2, 1, 3, 4, 6, 5, 7, 0, 4, 1, 5, 2, 6, 3, 7};
+
+    StreamBuffer vertices;
+    StreamBuffer indices;
+    VertexArrayResource vao;
+    GLsizei indexCount = 0;
+    int dropped = 0;
+    int reportedDropped = 0;
+
+    void add(const vec3* points, int pointCount, const uint8_t* edges, int edgeIndexCount, const vec3& color) {
+        Vertex* vertex = vertices.allocate<Vertex>(pointCount);
+        uint32_t* index = vertex ? indices.allocate<uint32_t>(edgeIndexCount) : nullptr;
+        if (!index) {
+            dropped++;
+            return;
+        }
+        uvec3 rgb = uvec3(glm::clamp(color, vec3(0.0f), vec3(1.0f)) * 255.0f + 0.5f);
+        uint32_t packed = rgb.x | rgb.y << 8 | rgb.z << 16 | 0xFF000000u;
+        uint32_t base = (vertices.getOffset(vertex) - vertices.getRegionOffset()) / sizeof(Vertex);
+        for (int i = 0; i < pointCount; ++i) {
+            vertex[i] = {points[i], packed};
+        }
+        for (int i = 0; i < edgeIndexCount; ++i) {
+            index[i] = base + edges[i];
+        }
+        indexCount += edgeIndexCount;
+    }
+};
+
+struct IndexedMesh {
+    vector<float> vertices;
+    vector<uint32_t> indices;
+};
+
+struct FloatKeyHash {
+    size_t operator()(const array<uint32_t, 5>& key) const {
+        size_t h = 1469598103934665603ull;
+        for (uint32_t k : key) h = (h ^ k) * 1099511628211ull;
+        return h;
+    }
+};
+
+array<uint32_t, 5> vertexKey(const float* v, int components) {
+    array<uint32_t, 5> key = {0, 0, 0, 0, 0};
+    for (int i = 0; i < components; ++i) {
+        float value = v[i] == 0.0f ? 0.0f : v[i];
+        memcpy(&key[i], &value, 4);
+    }
+    return key;
+}
+
+IndexedMesh weldMesh(const vector<float>& vertices) {
+    IndexedMesh mesh;
+    unordered_map<array<uint32_t, 5>, uint32_t, FloatKeyHash> lookup;
+    size_t count = vertices.size() / 5;
+    mesh.indices.reserve(count);
+    lookup.reserve(count);
+    for (size_t i = 0; i < count; ++i) {
+        auto inserted = lookup.emplace(vertexKey(&vertices[i * 5], 5), (uint32_t)(mesh.vertices.size() / 5));
+        if (inserted.second) {
+            mesh.vertices.insert(mesh.vertices.end(), vertices.begin() + i * 5, vertices.begin() + i * 5 + 5);
+        }
+        mesh.indices.push_back(inserted.first->second);
+    }
+    return mesh;
+}
+
+vector<float> unweldMesh(const IndexedMesh& mesh) {
+    vector<float> vertices(mesh.indices.size() * 5);
+    for (size_t i = 0; i < mesh.indices.size(); ++i) {
+        copy(mesh.vertices.begin() + mesh.indices[i] * 5, mesh.vertices.begin() + mesh.indices[i] * 5 + 5, vertices.begin() + i * 5);
+    }
+    return vertices;
+}
+
+struct Quadric {
+    double q[10] = {0};
+    double weight = 0.0;
+
+    void addPlane(const dvec3& n, double d, double w) {
+        q[0] += w * n.x * n.x; q[1] += w * n.x * n.y; q[2] += w * n.x * n.z; q[3] += w * n.x * d;
+        q[4] += w * n.y * n.y; q[5] += w * n.y * n.z; q[6] += w * n.y * d;
+        q[7] += w * n.z * n.z; q[8] += w * n.z * d;
+        q[9] += w * d * d;
+        weight += w;
+    }
+    void add(const Quadric& other) {
+        for (int i = 0; i < 10; ++i) q[i] += other.q[i];
+        weight += other.weight;
+    }
+    double evaluate(const vec3& p) const {
+        double x = p.x, y = p.y, z = p.z;
+        double e = q[0] * x * x + 2 * q[1] * x * y + 2 * q[2] * x * z + 2 * q[3] * x
+                 + q[4] * y * y + 2 * q[5] * y * z + 2 * q[6] * y
+                 + q[7] * z * z + 2 * q[8] * z + q[9];
+        return std::max(e, 0.0) / std::max(weight, 1e-30);
+    }
+};
+
+IndexedMesh simplifyMesh(const IndexedMesh& mesh, size_t targetTriangles, float& resultError) {
+    const float boundaryWeight = 10.0f;
+    size_t vertexCount = mesh.vertices.size() / 5;
+    size_t triangleCount = mesh.indices.size() / 3;
+    vector<uint32_t> corners = mesh.indices;
+    vector<bool> alive(triangleCount, true);
+
+    unordered_map<array<uint32_t, 5>, uint32_t, FloatKeyHash> positionLookup;
+    vector<uint32_t> group(vertexCount);
+    vector<vec3> positions;
+    for (size_t i = 0; i < vertexCount; ++i) {
+        auto inserted = positionLookup.emplace(vertexKey(&mesh.vertices[i * 5], 3), (uint32_t)positions.size());
+        if (inserted.second) {
+            positions.push_back(vec3(mesh.vertices[i * 5], mesh.vertices[i * 5 + 1], mesh.vertices[i * 5 + 2]));
+        }
+        group[i] = inserted.first->second;
+    }
+    size_t groupCount = positions.size();
+    vector<vector<uint32_t>> groupTriangles(groupCount);
+    vector<Quadric> quadrics(groupCount);
+    vector<uint32_t> version(groupCount, 0);
+    vector<bool> removed(groupCount, false);
+
+    auto edgeKey = [](uint32_t a, uint32_t b) { return a < b ? ((uint64_t)a << 32) | b : ((uint64_t)b << 32) | a; };
+    unordered_map<uint64_t, int> positionEdges, attributeEdges;
+    for (size_t t = 0; t < triangleCount; ++t) {
+        const uint32_t* c = &corners[t * 3];
+        vec3 a = positions[group[c[0]]], b = positions[group[c[1]]], d = positions[group[c[2]]];
+        dvec3 n = dvec3(cross(b - a, d - a));
+        double area = sqrt(n.x * n.x + n.y * n.y + n.z * n.z);
+        if (area > 0.0) {
+            n = n * (1.0 / area);
+            double offset = -(n.x * a.x + n.y * a.y + n.z * a.z);
+            for (int k = 0; k < 3; ++k) {
+                quadrics[group[c[k]]].addPlane(n, offset, area * 0.5);
+            }
+        }
+        for (int k = 0; k < 3; ++k) {
+            groupTriangles[group[c[k]]].push_back(t);
+            positionEdges[edgeKey(group[c[k]], group[c[(k + 1) % 3]])]++;
+            attributeEdges[edgeKey(c[k], c[(k + 1) % 3])]++;
+        }
+    }
+
+    for (size_t t = 0; t < triangleCount; ++t) {
+        const uint32_t* c = &corners[t * 3];
+        for (int k = 0; k < 3; ++k) {
+            uint32_t ga = group[c[k]], gb = group[c[(k + 1) % 3]];
+            bool border = positionEdges[edgeKey(ga, gb)] == 1;
+            bool seam = !border && attributeEdges[edgeKey(c[k], c[(k + 1) % 3])] == 1;
+            if (!border && !seam) continue;
+            vec3 a = positions[ga], b = positions[gb], d = positions[group[c[(k + 2) % 3]]];
+            vec3 edge = b - a;
+            dvec3 n = dvec3(cross(edge, cross(edge, d - a)));
+            double length = sqrt(n.x * n.x + n.y * n.y + n.z * n.z);
+            if (length <= 0.0) continue;
+            n = n * (1.0 / length);
+            double offset = -(n.x * a.x + n.y * a.y + n.z * a.z);
+            double w = dot(edge, edge) * boundaryWeight;
+            quadrics[ga].addPlane(n, offset, w);
+            quadrics[gb].addPlane(n, offset, w);
+        }
+    }
+
+    struct Collapse {
+        double cost;
+        uint32_t from, to, fromVersion, toVersion;
+        bool operator<(const Collapse& other) const {
+            return cost > other.cost;
+        }
+    };
+    priority_queue<Collapse> queue;
+    auto pushCollapse = [&](uint32_t from, uint32_t to) {
+        Quadric q = quadrics[from];
+        q.add(quadrics[to]);
+        queue.push({q.evaluate(positions[to]), from, to, version[from], version[to]});
+    };
+    for (const auto& edge : positionEdges) {
+        uint32_t a = edge.first >> 32, b = edge.first & 0xFFFFFFFF;
+        pushCollapse(a, b);
+        pushCollapse(b, a);
+    }
+
+    vector<pair<uint32_t, uint32_t>> remap;
+    vector<uint32_t> neighborsFrom, neighborsTo;
+    auto collectNeighbors = [&](uint32_t g, vector<uint32_t>& out) {
+        out.clear();
+        for (uint32_t t : groupTriangles[g]) {
+            if (!alive[t]) continue;
+            for (int k = 0; k < 3; ++k) {
+                uint32_t other = group[corners[t * 3 + k]];
+                if (other != g) out.push_back(other);
+            }
+        }
+        sort(out.begin(), out.end());
+        out.erase(unique(out.begin(), out.end()), out.end());
+    };
+
+    size_t liveTriangles = triangleCount;
+    double maxCost = 0.0;
+    while (liveTriangles > targetTriangles && !queue.empty()) {
+        Collapse collapse = queue.top();
+        queue.pop();
+        uint32_t u = collapse.from, v = collapse.to;
+        if (removed[u] || removed[v] || version[u] != collapse.fromVersion || version[v] != collapse.toVersion) {
+            continue;
+        }
+
+        remap.clear();
+        bool valid = true;
+        int sharedTriangles = 0;
+        for (uint32_t t : groupTriangles[u]) {
+            if (!alive[t]) continue;
+            const uint32_t* c = &corners[t * 3];
+            int ku = group[c[0]] == u ? 0 : group[c[1]] == u ? 1 : 2;
+            int kv = group[c[0]] == v ? 0 : group[c[1]] == v ? 1 : group[c[2]] == v ? 2 : -1;
+            if (kv < 0) {
+                vec3 a = positions[group[c[(ku + 1) % 3]]], b = positions[group[c[(ku + 2) % 3]]];
+                vec3 before = cross(a - positions[u], b - positions[u]);
+                vec3 after = cross(a - positions[v], b - positions[v]);
+                if (dot(before, after) <= 0.0f) {
+                    valid = false;
+                    break;
+                }
+                continue;
+            }
+            sharedTriangles++;
+            bool known = false;
+            for (auto& entry : remap) {
+                if (entry.first == c[ku]) {
+                    known = true;
+                    valid = valid && entry.second == c[kv];
+                }
+            }
+            if (!known) remap.push_back({c[ku], c[kv]});
+        }
+        for (uint32_t t : groupTriangles[u]) {
+            if (!valid) break;
+            if (!alive[t]) continue;
+            const uint32_t* c = &corners[t * 3];
+            uint32_t corner = group[c[0]] == u ? c[0] : group[c[1]] == u ? c[1] : c[2];
+            bool mapped = false;
+            for (auto& entry : remap) mapped = mapped || entry.first == corner;
+            valid = mapped;
+        }
+        if (valid) {
+            collectNeighbors(u, neighborsFrom);
+            collectNeighbors(v, neighborsTo);
+            int common = 0;
+            for (uint32_t n : neighborsFrom) {
+                common += binary_search(neighborsTo.begin(), neighborsTo.end(), n);
+            }
+            valid = common <= sharedTriangles;
+        }
+        if (!valid) continue;
+
+        for (uint32_t t : groupTriangles[u]) {
+            if (!alive[t]) continue;
+            uint32_t* c = &corners[t * 3];
+            if (group[c[0]] == v || group[c[1]] == v || group[c[2]] == v) {
+                alive[t] = false;
+                liveTriangles--;
+                continue;
+            }
+            for (int k = 0; k < 3; ++k) {
+                for (auto& entry : remap) {
+                    if (c[k] == entry.first) c[k] = entry.second;
+                }
+            }
+            groupTriangles[v].push_back(t);
+        }
+        groupTriangles[u].clear();
+        quadrics[v].add(quadrics[u]);
+        removed[u] = true;
+        version[v]++;
+        maxCost = std::max(maxCost, collapse.cost);
+
+        collectNeighbors(v, neighborsTo);
+        for (uint32_t n : neighborsTo) {
+            pushCollapse(v, n);
+            pushCollapse(n, v);
+        }
+    }
+
+    IndexedMesh result;
+    vector<uint32_t> newIndex(vertexCount, UINT32_MAX);
+    for (size_t t = 0; t < triangleCount; ++t) {
+        if (!alive[t]) continue;
+        for (int k = 0; k < 3; ++k) {
+            uint32_t c = corners[t * 3 + k];
+            if (newIndex[c] == UINT32_MAX) {
+                newIndex[c] = result.vertices.size() / 5;
+                result.vertices.insert(result.vertices.end(), mesh.vertices.begin() + c * 5, mesh.vertices.begin() + c * 5 + 5);
+            }
+            result.indices.push_back(newIndex[c]);
+        }
+    }
+    resultError = sqrt(maxCost);
+    return result;
+}
+
+struct MeshLod {
+    vector<float> vertices;
+    float error;
+};
+
+vector<MeshLod> generateLodChain(const vector<float>& vertices, int maxLevels = 8, size_t minTriangles = 64) {
+    vector<MeshLod> chain;
+    chain.push_back({vertices, 0.0f});
+    IndexedMesh current = weldMesh(vertices);
+    float error = 0.0f;
+    while ((int)chain.size() < maxLevels) {
+        size_t triangles = current.indices.size() / 3;
+        if (triangles / 2 < minTriangles) break;
+        float stepError;
+        IndexedMesh simplified = simplifyMesh(current, triangles / 2, stepError);
+        if (simplified.indices.size() / 3 > triangles * 9 / 10) break;
+        error += stepError;
+        current = move(simplified);
+        chain.push_back({unweldMesh(current), error});
+    }
+    return chain;
+}
+
+class LodSelector {
+public:
+    LodSelector(vector<float> errors = {0.0f}, float pixelThreshold = 1.0f)
+        : errors(move(errors)), pixelThreshold(pixelThreshold) {}
+
+    int select(float pixelsPerUnit) {
+        while (level > 0 && errors[level] * pixelsPerUnit > pixelThreshold) --level;
+        while (level + 1 < (int)errors.size() && errors[level + 1] * pixelsPerUnit <= pixelThreshold * hysteresis) ++level;
+        return level;
+    }
+    int getLevel() const {
+        return level;
+    }
+private:
+    vector<float> errors;
+    float pixelThreshold;
+    float hysteresis = 0.7f;
+    int level = 0;
+};
+
+float projectedPixelsPerUnit(const vec3& cameraPos, const vec3& center, float fovY, int screenHeight) {
+    float distance = std::max(length(center - cameraPos), 0.1f);
+    return screenHeight / (2.0f * distance * tanf(fovY * 0.5f));
+}
+
+struct StaticLod {
+    MeshView mesh;
+    float error;
+};
+
+class LodShapeRenderer {
+public:
+    LodShapeRenderer(const vector<float>& vertices, VertexFormat format = VERTEX_FLOAT) {
+        vector<MeshLod> chain = generateLodChain(vertices);
+        vector<float> errors;
+        for (const MeshLod& lod : chain) {
+            if (format == VERTEX_FLOAT) {
+                levels.emplace_back(lod.vertices);
+            } else {
+                levels.emplace_back(packVertices(lod.vertices, format == VERTEX_PACKED_NORMAL));
+            }
+            errors.push_back(lod.error);
+        }
+        selector = LodSelector(errors);
+    }
+    LodShapeRenderer(const StaticLod* lods, size_t lodCount, float scale, VertexFormat format = VERTEX_PACKED_NORMAL) {
+        vector<float> errors;
+        for (size_t i = 0; i < lodCount; ++i) {
+            levels.emplace_back(lods[i].mesh, format, scale);
+            errors.push_back(lods[i].error * scale);
+        }
+        selector = LodSelector(errors);
+    }
+    int selectLod(float pixelsPerUnit) {
+        return selector.select(pixelsPerUnit);
+    }
+    void render(Shader& shader, int textureIndex) {
+        levels[selector.getLevel()].render(shader, textureIndex);
+    }
+    DrawGeometry getGeometry() const {
+        return levels[selector.getLevel()].getGeometry();
+    }
+    DrawGeometry getGeometry(int level) const {
+        return levels[level].getGeometry();
+    }
+private:
+    vector<ShapeRenderer> levels;
+    LodSelector selector;
+};
+
+constexpr double constexprSqrt(double x) {
+    if (x <= 0.0) return 0.0;
+    double root = x > 1.0 ? x : 1.0;
+    for (int i = 0; i < 64; ++i) {
+        root = 0.5 * (root + x / root);
+    }
+    return root;
+}
+
+constexpr double constexprSin(double x) {
+    while (x > M_PI) x -= 2.0 * M_PI;
+    while (x < -M_PI) x += 2.0 * M_PI;
+    double term = x, sum = x;
+    for (int k = 1; k < 12; ++k) {
+        term *= -x * x / ((2 * k) * (2 * k + 1));
+        sum += term;
+    }
+    return sum;
+}
+
+constexpr double constexprCos(double x) {
+    return constexprSin(x + M_PI / 2);
+}
+
+template <size_t VertexCount, size_t IndexCount>
+struct StaticMesh {
+    static_assert(VertexCount <= 65536, "static meshes use 16-bit indices");
+
+    array<float, VertexCount * 8> vertices{};
+    array<uint16_t, IndexCount> indices{};
+
+    constexpr MeshView view() const {
+        return {vertices.data(), VertexCount, indices.data(), IndexCount};
+    }
+};
+
+template <size_t N>
+constexpr array<float, N / 5 * 8> faceNormalVertices(const array<float, N>& triangles) {
+    array<float, N / 5 * 8> vertices{};
+    for (size_t t = 0; t < N / 15; ++t) {
+        size_t a = t * 15;
+        double e1[3] = {}, e2[3] = {};
+        for (size_t c = 0; c < 3; ++c) {
+            e1[c] = triangles[a + 5 + c] - triangles[a + c];
+            e2[c] = triangles[a + 10 + c] - triangles[a + c];
+        }
+        double n[3] = {e1[1] * e2[2] - e1[2] * e2[1], e1[2] * e2[0] - e1[0] * e2[2], e1[0] * e2[1] - e1[1] * e2[0]};
+        double length = constexprSqrt(n[0] * n[0] + n[1] * n[1] + n[2] * n[2]);
+        for (size_t k = 0; k < 3; ++k) {
+            size_t v = (t * 3 + k) * 8;
+            for (size_t c = 0; c < 5; ++c) {
+                vertices[v + c] = triangles[a + k * 5 + c];
+            }
+            for (size_t c = 0; c < 3; ++c) {
+                vertices[v + 5 + c] = length > 0.0 ? (float)(n[c] / length) : (c == 2 ? 1.0f : 0.0f);
+            }
+        }
+    }
+    return vertices;
+}
+
+template <size_t A, size_t B>
+constexpr bool sameVertex(const array<float, A>& a, size_t i, const array<float, B>& b, size_t j) {
+    for (size_t c = 0; c < 8; ++c) {
+        if (a[i * 8 + c] != b[j * 8 + c]) return false;
+    }
+    return true;
+}
+
+template <size_t N>
+constexpr size_t uniqueVertexCount(const array<float, N>& triangles) {
+    array<float, N / 5 * 8> vertices = faceNormalVertices(triangles);
+    size_t count = 0;
+    for (size_t i = 0; i < N / 5; ++i) {
+        size_t j = 0;
+        while (j < i && !sameVertex(vertices, i, vertices, j)) ++j;
+        if (j == i) ++count;
+    }
+    return count;
+}
+
+template <size_t VertexCount, size_t N>
+constexpr StaticMesh<VertexCount, N / 5> indexTriangles(const array<float, N>& triangles) {
+    array<float, N / 5 * 8> expanded = faceNormalVertices(triangles);
+    StaticMesh<VertexCount, N / 5> mesh{};
+    size_t count = 0;
+    for (size_t i = 0; i < N / 5; ++i) {
+        size_t j = 0;
+        while (j < count && !sameVertex(mesh.vertices, j, expanded, i)) ++j;
+        if (j == count) {
+            for (size_t c = 0; c < 8; ++c) {
+                mesh.vertices[count * 8 + c] = expanded[i * 8 + c];
+            }
+            ++count;
+        }
+        mesh.indices[i] = (uint16_t)j;
+    }
+    return mesh;
+}
+
+template <int Sectors, int Stacks>
+constexpr StaticMesh<(Sectors + 1) * (Stacks + 1), Sectors * (Stacks - 1) * 6> generateSphere() {
+    StaticMesh<(Sectors + 1) * (Stacks + 1), Sectors * (Stacks - 1) * 6> mesh{};
+    for (int i = 0; i <= Stacks; ++i) {
+        double stackAngle = M_PI / 2 - i * M_PI / Stacks;
+        double xy = constexprCos(stackAngle);
+        double z = constexprSin(stackAngle);
+        for (int j = 0; j <= Sectors; ++j) {
+            double sectorAngle = j * 2 * M_PI / Sectors;
+            size_t v = (i * (Sectors + 1) + j) * 8;
+            mesh.vertices[v] = mesh.vertices[v + 5] = (float)(xy * constexprCos(sectorAngle));
+            mesh.vertices[v + 1] = mesh.vertices[v + 6] = (float)(xy * constexprSin(sectorAngle));
+            mesh.vertices[v + 2] = mesh.vertices[v + 7] = (float)z;
+            mesh.vertices[v + 3] = (float)j / Sectors;
+            mesh.vertices[v + 4] = (float)i / Stacks;
+        }
+    }
+    size_t n = 0;
+    for (int i = 0; i < Stacks; ++i) {
+        for (int j = 0; j < Sectors; ++j) {
+            int k1 = i * (Sectors + 1) + j;
+            int k2 = k1 + Sectors + 1;
+            if (i != 0) {
+                mesh.indices[n++] = (uint16_t)k1;
+                mesh.indices[n++] = (uint16_t)k2;
+                mesh.indices[n++] = (uint16_t)(k1 + 1);
+            }
+            if (i != Stacks - 1) {
+                mesh.indices[n++] = (uint16_t)(k1 + 1);
+                mesh.indices[n++] = (uint16_t)k2;
+                mesh.indices[n++] = (uint16_t)(k2 + 1);
+            }
+        }
+    }
+    return mesh;
+}
+
+constexpr float sphereLodError(int sectors, int stacks) {
+    return (float)(1.0 - constexprCos(M_PI / sectors) * constexprCos(M_PI / (2 * stacks)));
+}
+
+constexpr array cubeTriangles = {
+    -1.0f, -1.0f,  1.0f, 0.0f, 0.0f,
+     1.0f, -1.0f,  1.0f, 1.0f, 0.0f,
+     1.0f,  1.0f,  1.0f, 1.0f, 1.0f,
+     1.0f,  1.0f,  1.0f, 1.0f, 1.0f,
+    -1.0f,  1.0f,  1.0f, 0.0f, 1.0f,
+    -1.0f, -1.0f,  1.0f, 0.0f, 0.0f,
+    -1.0f, -1.0f, -1.0f, 0.0f, 0.0f,
+     1.0f, -1.0f, -1.0f, 1.0f, 0.0f,
+     1.0f,  1.0f, -1.0f, 1.0f, 1.0f,
+     1.0f,  1.0f, -1.0f, 1.0f, 1.0f,
+    -1.0f,  1.0f, -1.0f, 0.0f, 1.0f,
+    -1.0f, -1.0f, -1.0f, 0.0f, 0.0f,
+    -1.0f, -1.0f, -1.0f, 0.0f, 0.0f,
+    -1.0f, -1.0f,  1.0f, 1.0f, 0.0f,
+    -1.0f,  1.0f,  1.0f, 1.0f, 1.0f,
+    -1.0f,  1.0f,  1.0f, 1.0f, 1.0f,
+    -1.0f,  1.0f, -1.0f, 0.0f, 1.0f,
+    -1.0f, -1.0f, -1.0f, 0.0f, 0.0f,
+     1.0f, -1.0f, -1.0f, 0.0f, 0.0f,
+     1.0f, -1.0f,  1.0f, 1.0f, 0.0f,
+     1.0f,  1.0f,  1.0f, 1.0f, 1.0f,
+     1.0f,  1.0f,  1.0f, 1.0f, 1.0f,
+     1.0f,  1.0f, -1.0f, 0.0f, 1.0f,
+     1.0f, -1.0f, -1.0f, 0.0f, 0.0f,
+    -1.0f,  1.0f, -1.0f, 0.0f, 0.0f,
+     1.0f,  1.0f, -1.0f, 1.0f, 0.0f,
+     1.0f,  1.0f,  1.0f, 1.0f, 1.0f,
+     1.0f,  1.0f,  1.0f, 1.0f, 1.0f,
+    -1.0f,  1.0f,  1.0f, 0.0f, 1.0f,
+    -1.0f,  1.0f, -1.0f, 0.0f, 0.0f,
+    -1.0f, -1.0f, -1.0f, 0.0f, 0.0f,
+     1.0f, -1.0f, -1.0f, 1.0f, 0.0f,
+     1.0f, -1.0f,  1.0f, 1.0f, 1.0f,
+     1.0f, -1.0f,  1.0f, 1.0f, 1.0f,
+    -1.0f, -1.0f,  1.0f, 0.0f, 1.0f,
+    -1.0f, -1.0f, -1.0f, 0.0f, 0.0f,
+};
+
+constexpr array pyramidTriangles = {
+    -1.0f, 0.0f, -1.0f, 0.0f, 0.0f,
+     1.0f, 0.0f, -1.0f, 1.0f, 1.0f,
+     1.0f, 0.0f,  1.0f, 1.0f, 1.0f,
+     1.0f, 0.0f,  1.0f, 1.0f, 1.0f,
+    -1.0f, 0.0f,  1.0f, 1.0f, 1.0f,
+    -1.0f, 0.0f, -1.0f, 0.0f, 0.0f,
+    -1.0f, 0.0f, -1.0f, 0.0f, 0.0f,
+     1.0f, 0.0f, -1.0f, 1.0f, 0.0f,
+     0.0f, 3.0f, 0.0f, 0.5f, 1.0f,
+     1.0f, 0.0f, -1.0f, 1.0f, 0.0f,
+     1.0f, 0.0f,  1.0f, 1.0f, 1.0f,
+     0.0f, 3.0f, 0.0f, 0.5f, 1.0f,
+     1.0f, 0.0f,  1.0f, 1.0f, 1.0f,
+    -1.0f, 0.0f,  1.0f, 0.0f, 1.0f,
+     0.0f, 3.0f, 0.0f, 0.5f, 1.0f,
+    -1.0f, 0.0f,  1.0f, 0.0f, 1.0f,
+    -1.0f, 0.0f, -1.0f, 0.0f, 0.0f,
+     0.0f, 3.0f, 0.0f, 0.5f, 1.0f
+};
+
+constexpr array planeTriangles = {
+    -50.0f, 0.0f, -50.0f, 0.0f, 0.0f,
+     50.0f, 0.0f, -50.0f, 1.0f, 0.0f,
+     50.0f, 0.0f,  50.0f, 1.0f, 1.0f,
+     50.0f, 0.0f,  50.0f, 1.0f, 1.0f,
+    -50.0f, 0.0f,  50.0f, 0.0f, 1.0f,
+    -50.0f, 0.0f, -50.0f, 0.0f, 0.0f,
+};
+
+constexpr array secondPlaneTriangles = {
+    -10.0f, 13.0f, -10.0f, 0.0f, 0.0f,
+     10.0f, 13.0f, -10.0f, 1.0f, 0.0f,
+     10.0f, 13.0f,  10.0f, 1.0f, 1.0f,
+     10.0f, 13.0f,  10.0f, 1.0f, 1.0f,
+    -10.0f, 13.0f,  10.0f, 0.0f, 1.0f,
+    -10.0f, 13.0f, -10.0f, 0.0f, 0.0f,
+};
+
+constexpr array wallTriangles = {
+    -50.0f, -1.0f, -50.0f, 0.0f, 1.0f,
+     50.0f, -1.0f, -50.0f, 1.0f, 1.0f,
+     50.0f,  50.0f, -50.0f, 1.0f, 0.0f,
+     50.0f,  50.0f, -50.0f, 1.0f, 0.0f,
+    -50.0f,  50.0f, -50.0f, 0.0f, 0.0f,
+    -50.0f, -1.0f, -50.0f, 0.0f, 1.0f,
+
+    -50.0f, -1.0f, 50.0f, 1.0f, 1.0f,
+     50.0f, -1.0f, 50.0f, 0.0f, 1.0f,
+     50.0f,  50.0f, 50.0f, 0.0f, 0.0f,
+     50.0f,  50.0f, 50.0f, 0.0f, 0.0f,
+    -50.0f,  50.0f, 50.0f, 1.0f, 0.0f,
+    -50.0f, -1.0f, 50.0f, 1.0f, 1.0f,
+
+    -50.0f, -1.0f, -50.0f, 0.0f, 1.0f,
+    -50.0f, -1.0f, 50.0f, 1.0f, 1.0f,
+    -50.0f,  50.0f, 50.0f, 1.0f, 0.0f,
+    -50.0f,  50.0f, 50.0f, 1.0f, 0.0f,
+    -50.0f,  50.0f, -50.0f, 0.0f, 0.0f,
+    -50.0f, -1.0f, -50.0f, 0.0f, 1.0f,
+
+    50.0f, -1.0f, -50.0f, 1.0f, 1.0f,
+    50.0f, -1.0f, 50.0f, 0.0f, 1.0f,
+    50.0f,  50.0f, 50.0f,  0.0f, 0.0f,
+    50.0f,  50.0f, 50.0f,  0.0f, 0.0f,
+    50.0f,  50.0f, -50.0f, 1.0f, 0.0f,
+    50.0f, -1.0f, -50.0f, 1.0f, 1.0f,
+};
+
+constexpr array ceilingTriangles = {
+    -50.0f, 50.0f, -50.0f, 0.0f, 0.0f,
+     50.0f, 50.0f, -50.0f, 1.0f, 0.0f,
+     50.0f, 50.0f,  50.0f, 1.0f, 1.0f,
+     50.0f, 50.0f,  50.0f, 1.0f, 1.0f,
+    -50.0f, 50.0f,  50.0f, 0.0f, 1.0f,
+    -50.0f, 50.0f, -50.0f, 0.0f, 0.0f,
+};
+
+constexpr auto cubeMesh = indexTriangles<uniqueVertexCount(cubeTriangles)>(cubeTriangles);
+constexpr auto pyramidMesh = indexTriangles<uniqueVertexCount(pyramidTriangles)>(pyramidTriangles);
+constexpr auto planeMesh = indexTriangles<uniqueVertexCount(planeTriangles)>(planeTriangles);
+constexpr auto secondPlaneMesh = indexTriangles<uniqueVertexCount(secondPlaneTriangles)>(secondPlaneTriangles);
+constexpr auto wallMesh = indexTriangles<uniqueVertexCount(wallTriangles)>(wallTriangles);
+constexpr auto ceilingMesh = indexTriangles<uniqueVertexCount(ceilingTriangles)>(ceilingTriangles);
+
+constexpr auto sphereMesh36 = generateSphere<36, 18>();
+constexpr auto sphereMesh24 = generateSphere<24, 12>();
+constexpr auto sphereMesh16 = generateSphere<16, 8>();
+constexpr auto sphereMesh12 = generateSphere<12, 6>();
+constexpr auto sphereMesh8 = generateSphere<8, 4>();
+
+constexpr array<StaticLod, 5> sphereLods = {{
+    {sphereMesh36.view(), sphereLodError(36, 18)},
+    {sphereMesh24.view(), sphereLodError(24, 12)},
+    {sphereMesh16.view(), sphereLodError(16, 8)},
+    {sphereMesh12.view(), sphereLodError(12, 6)},
+    {sphereMesh8.view(), sphereLodError(8, 4)},
+}};
+
+TextureResource loadTexture(const char* path) {
+    TextureResource texture = createTexture();
+    glBindTexture(GL_TEXTURE_2D, texture.get());
+
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+
+    int width, height, nrChannels;
+    unsigned char* data = stbi_load(path, &width, &height, &nrChannels, 0);
+    if (data) {
+        GLenum format;
+        if (nrChannels == 1) {
+            format = GL_RED;
+        } else if (nrChannels == 3) {
+            format = GL_RGB;
+        } else if (nrChannels == 4) {
+            format = GL_RGBA;
+        }
+
+        glTexImage2D(GL_TEXTURE_2D, 0, format, width, height, 0, format, GL_UNSIGNED_BYTE, data);
+        glGenerateMipmap(GL_TEXTURE_2D);
+    } else {
+        cerr << "error with download texture: " << path << endl;
+        cerr << "stbi_load err: " << stbi_failure_reason() << endl;
+        return TextureResource();
+    }
+
+    stbi_image_free(data); 
+    return texture;
+}
+
+class BindlessTextureSet {
+public:
+    static const int maxTextures = 512;
+
+    ~BindlessTextureSet() {
+        for (size_t i = 0; i < textures.size(); ++i) {
+            setResident(i, false);
+        }
+    }
+    BindlessTextureSet() = default;
+    BindlessTextureSet(const BindlessTextureSet&) = delete;
+    BindlessTextureSet& operator=(const BindlessTextureSet&) = delete;
+
+    static bool isSupported() {
+        return GLEW_ARB_bindless_texture;
+    }
+
+    int add(TextureResource texture) {
+        if ((int)textures.size() >= maxTextures) {
+            throw runtime_error("Too many bindless textures");
+        }
+        if (!texture) {
+            unsigned char black[4] = {0, 0, 0, 255};
+            texture = createTexture();
+            glBindTexture(GL_TEXTURE_2D, texture.get());
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+            glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, 1, 1, 0, GL_RGBA, GL_UNSIGNED_BYTE, black);
+        }
+        glBindTexture(GL_TEXTURE_2D, 0);
+        handles.push_back(glGetTextureHandleARB(texture.get()));
+        textures.push_back(move(texture));
+        resident.push_back(false);
+        setResident(textures.size() - 1, true);
+        return textures.size() - 1;
+    }
+
+    void setResident(size_t index, bool value) {
+        if (resident[index] == value) return;
+        if (value) {
+            glMakeTextureHandleResidentARB(handles[index]);
+        } else {
+            glMakeTextureHandleNonResidentARB(handles[index]);
+        }
+        resident[index] = value;
+    }
+
+    void upload(Shader& shader, GLuint bindingPoint = 0) {
+        vector<GLuint64> data(maxTextures, 0);
+        copy(handles.begin(), handles.end(), data.begin());
+        ubo = createBuffer(data.size() * sizeof(GLuint64), data.data());
+        GLuint blockIndex = glGetUniformBlockIndex(shader.getProgram(), "TextureHandles");
+        if (blockIndex != GL_INVALID_INDEX) {
+            glUniformBlockBinding(shader.getProgram(), blockIndex, bindingPoint);
+        }
+        glBindBufferBase(GL_UNIFORM_BUFFER, bindingPoint, ubo.get());
+    }
+
+private:
+    vector<TextureResource> textures;
+    vector<GLuint64> handles;
+    vector<bool> resident;
+    BufferResource ubo;
+};
+
+vector<unsigned char> resampleImage(const unsigned char* src, int srcWidth, int srcHeight, int width, int height, int channels) {
+    vector<unsigned char> dst((size_t)width * height * channels);
+    float scaleX = (float)srcWidth / width;
+    float scaleY = (float)srcHeight / height;
+    parallelFor(height, [&](size_t firstRow, size_t lastRow) {
+        for (size_t y = firstRow; y < lastRow; ++y) {
+            for (int x = 0; x < width; ++x) {
+                unsigned char* out = &dst[(y * width + x) * channels];
+                if (scaleX > 1.0f || scaleY > 1.0f) {
+                    int x0 = (int)(x * scaleX), x1 = std::max(x0 + 1, std::min(srcWidth, (int)((x + 1) * scaleX)));
+                    int y0 = (int)(y * scaleY), y1 = std::max(y0 + 1, std::min(srcHeight, (int)((y + 1) * scaleY)));
+                    for (int c = 0; c < channels; ++c) {
+                        unsigned int sum = 0;
+                        for (int sy = y0; sy < y1; ++sy) {
+                            for (int sx = x0; sx < x1; ++sx) {
+                                sum += src[((size_t)sy * srcWidth + sx) * channels + c];
+                            }
+                        }
+                        out[c] = sum / ((x1 - x0) * (y1 - y0));
+                    }
+                } else {
+                    float fx = std::max((x + 0.5f) * scaleX - 0.5f, 0.0f);
+                    float fy = std::max((y + 0.5f) * scaleY - 0.5f, 0.0f);
+                    int x0 = std::min((int)fx, srcWidth - 1), x1 = std::min(x0 + 1, srcWidth - 1);
+                    int y0 = std::min((int)fy, srcHeight - 1), y1 = std::min(y0 + 1, srcHeight - 1);
+                    float tx = fx - x0, ty = fy - y0;
+                    for (int c = 0; c < channels; ++c) {
+                        float top = src[((size_t)y0 * srcWidth + x0) * channels + c] * (1 - tx) + src[((size_t)y0 * srcWidth + x1) * channels + c] * tx;
+                        float bottom = src[((size_t)y1 * srcWidth + x0) * channels + c] * (1 - tx) + src[((size_t)y1 * srcWidth + x1) * channels + c] * tx;
+                        out[c] = (unsigned char)(top * (1 - ty) + bottom * ty + 0.5f);
+                    }
+                }
+            }
+        }
+    });
+    return dst;
+}
+
+class TextureArray {
+public:
+    TextureArray(int maxLayerSize = 2048) : maxLayerSize(maxLayerSize) {}
+
+    int addImage(const char* path) {
+        Image image;
+        image.data = stbi_load(path, &image.width, &image.height, nullptr, 4);
+        if (!image.data) {
+            cerr << "error with download texture: " << path << endl;
+            cerr << "stbi_load err: " << stbi_failure_reason() << endl;
+        }
+        images.push_back(image);
+        return images.size() - 1;
+    }
+
+    void build() {
+        GLint maxSize, maxLayers;
+        glGetIntegerv(GL_MAX_TEXTURE_SIZE, &maxSize);
+        glGetIntegerv(GL_MAX_ARRAY_TEXTURE_LAYERS, &maxLayers);
+        if ((int)images.size() > maxLayers) {
+            throw runtime_error("Too many texture array layers");
+        }
+        width = height = 1;
+        for (const Image& image : images) {
+            if (!image.data) continue;
+            width = std::max(width, image.width);
+            height = std::max(height, image.height);
+        }
+        width = std::min(width, std::min(maxLayerSize, (int)maxSize));
+        height = std::min(height, std::min(maxLayerSize, (int)maxSize));
+
+        texture = createTexture();
+        glBindTexture(GL_TEXTURE_2D_ARRAY, texture.get());
+        glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_S, GL_REPEAT);
+        glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_T, GL_REPEAT);
+        glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
+        glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+        glTexImage3D(GL_TEXTURE_2D_ARRAY, 0, GL_RGBA8, width, height, std::max<int>(images.size(), 1), 0, GL_RGBA, GL_UNSIGNED_BYTE, nullptr);
+
+        vector<unsigned char> black((size_t)width * height * 4, 0);
+        for (size_t layer = 0; layer < images.size(); ++layer) {
+            Image& image = images[layer];
+            const unsigned char* pixels = black.data();
+            vector<unsigned char> resampled;
+            if (image.data && (image.width != width || image.height != height)) {
+                resampled = resampleImage(image.data, image.width, image.height, width, height, 4);
+                pixels = resampled.data();
+            } else if (image.data) {
+                pixels = image.data;
+            }
+            glTexSubImage3D(GL_TEXTURE_2D_ARRAY, 0, 0, 0, layer, width, height, 1, GL_RGBA, GL_UNSIGNED_BYTE, pixels);
+            if (image.data) stbi_image_free(image.data);
+            image.data = nullptr;
+        }
+        glGenerateMipmap(GL_TEXTURE_2D_ARRAY);
+        images.clear();
+    }
+
+    void bind(int unit = 0) const {
+        glActiveTexture(GL_TEXTURE0 + unit);
+        glBindTexture(GL_TEXTURE_2D_ARRAY, texture.get());
+    }
+
+    GLuint getTexture() const {
+        return texture.get();
+    }
+
+private:
+    struct Image {
+        unsigned char* data = nullptr;
+        int width = 0;
+        int height = 0;
+    };
+    vector<Image> images;
+    TextureResource texture;
+    int width = 0;
+    int height = 0;
+    int maxLayerSize;
+};
+
+struct PointLight {
+    vec3 position;
+    float radius;
+    vec3 color;
+};
+
+class ClusteredLighting {
+public:
+    ClusteredLighting(int tilesX = 16, int tilesY = 9, int slices = 24, int maxLightsPerCluster = 128)
+        : tilesX(tilesX), tilesY(tilesY), slices(slices), maxLightsPerCluster(maxLightsPerCluster),
+          clusterBounds(tilesX * tilesY * slices), sliceLists(slices) {
+        for (int i = 0; i < 3; ++i) {
+            textures[i] = createTexture();
+            reserve(i, tilesX * tilesY * slices * texelSizes[i]);
+        }
+    }
+    ClusteredLighting(const ClusteredLighting&) = delete;
+    ClusteredLighting& operator=(const ClusteredLighting&) = delete;
+
+    vector<PointLight>& getLights() {
+        return lights;
+    }
+
+    void update(const mat4& view, float fovY, int width, int height, float nearPlane, float farPlane) {
+        viewportWidth = width;
+        viewportHeight = height;
+        if (fovY != boundsFovY || (float)width / height != boundsAspect || nearPlane != zNear || farPlane != zFar) {
+            zNear = nearPlane;
+            zFar = farPlane;
+            buildClusterBounds(fovY, (float)width / height);
+        }
+
+        viewLights.resize(lights.size());
+        lightData.resize(lights.size() * 8);
+        for (size_t i = 0; i < lights.size(); ++i) {
+            const PointLight& light = lights[i];
+            viewLights[i] = vec4(vec3(view * vec4(light.position, 1.0f)), light.radius);
+            float* data = &lightData[i * 8];
+            data[0] = light.position.x; data[1] = light.position.y; data[2] = light.position.z; data[3] = light.radius;
+            data[4] = light.color.x; data[5] = light.color.y; data[6] = light.color.z; data[7] = 0.0f;
+        }
+
+        parallelFor(slices, [&](size_t first, size_t last) {
+            for (size_t slice = first; slice < last; ++slice) {
+                binSlice(slice);
+            }
+        });
+
+        clusterTable.resize(tilesX * tilesY * slices * 2);
+        lightIndices.clear();
+        for (int slice = 0; slice < slices; ++slice) {
+            const SliceList& list = sliceLists[slice];
+            for (int tile = 0; tile < tilesX * tilesY; ++tile) {
+                int cluster = slice * tilesX * tilesY + tile;
+                clusterTable[cluster * 2] = lightIndices.size() + list.offsets[tile];
+                clusterTable[cluster * 2 + 1] = list.offsets[tile + 1] - list.offsets[tile];
+            }
+            lightIndices.insert(lightIndices.end(), list.indices.begin(), list.indices.end());
+        }
+        if (lightIndices.empty()) lightIndices.push_back(0);
+        if (lightData.empty()) lightData.resize(8, 0.0f);
+
+        upload(0, clusterTable.data(), clusterTable.size() * sizeof(uint32_t));
+        upload(1, lightIndices.data(), lightIndices.size() * sizeof(uint32_t));
+        upload(2, lightData.data(), lightData.size() * sizeof(float));
+    }
+
+    void bind(Shader& shader, int firstUnit = 1) {
+        GLuint program = shader.getProgram();
+        const char* samplers[3] = {"clusterTable", "clusterLightIndices", "clusterLightData"};
+        for (int i = 0; i < 3; ++i) {
+            glActiveTexture(GL_TEXTURE0 + firstUnit + i);
+            glBindTexture(GL_TEXTURE_BUFFER, textures[i].get());
+            glUniform1i(glGetUniformLocation(program, samplers[i]), firstUnit + i);
+        }
+        glActiveTexture(GL_TEXTURE0);
+        float sliceScale = slices / logf(zFar / zNear);
+        glUniform3i(glGetUniformLocation(program, "clusterOffsets"), offsets[0], offsets[1], offsets[2]);
+        glUniform3i(glGetUniformLocation(program, "clusterDims"), tilesX, tilesY, slices);
+        glUniform2f(glGetUniformLocation(program, "clusterTileSize"), (float)viewportWidth / tilesX, (float)viewportHeight / tilesY);
+        glUniform1f(glGetUniformLocation(program, "clusterNear"), zNear);
+        glUniform1f(glGetUniformLocation(program, "clusterFar"), zFar);
+        glUniform1f(glGetUniformLocation(program, "clusterSliceScale"), sliceScale);
+        glUniform1f(glGetUniformLocation(program, "clusterSliceBias"), -sliceScale * logf(zNear));
+    }
+
+private:
+    struct ClusterBounds {
+        vec3 min;
+        vec3 max;
+    };
+    struct SliceList {
+        vector<float> x, y, z, r;
+        vector<uint32_t> lightIds;
+        vector<uint32_t> offsets;
+        vector<uint32_t> indices;
+    };
+
+    int tilesX, tilesY, slices, maxLightsPerCluster;
+    float zNear = 0.1f, zFar = 100.0f, boundsFovY = 0.0f, boundsAspect = 0.0f;
+    int viewportWidth = 1, viewportHeight = 1;
+    inline static const GLenum formats[3] = {GL_RG32UI, GL_R32UI, GL_RGBA32F};
+    inline static const size_t texelSizes[3] = {2 * sizeof(uint32_t), sizeof(uint32_t), 4 * sizeof(float)};
+    unique_ptr<StreamBuffer> streams[3];
+    size_t capacities[3] = {4096, 4096, 4096};
+    int offsets[3] = {0, 0, 0};
+    TextureResource textures[3];
+    vector<PointLight> lights;
+    vector<vec4> viewLights;
+    vector<ClusterBounds> clusterBounds;
+    vector<SliceList> sliceLists;
+    vector<uint32_t> clusterTable;
+    vector<uint32_t> lightIndices;
+    vector<float> lightData;
+
+    float sliceDepth(int slice) const {
+        return zNear * powf(zFar / zNear, (float)slice / slices);
+    }
+
+    void buildClusterBounds(float fovY, float aspect) {
+        boundsFovY = fovY;
+        boundsAspect = aspect;
+        float tanY = tanf(fovY * 0.5f);
+        float tanX = tanY * aspect;
+        for (int slice = 0; slice < slices; ++slice) {
+            float depths[2] = {sliceDepth(slice), sliceDepth(slice + 1)};
+            for (int ty = 0; ty < tilesY; ++ty) {
+                for (int tx = 0; tx < tilesX; ++tx) {
+                    ClusterBounds& bounds = clusterBounds[(slice * tilesY + ty) * tilesX + tx];
+                    bounds.min = vec3(numeric_limits<float>::max());
+                    bounds.max = vec3(-numeric_limits<float>::max());
+                    for (float depth : depths) {
+                        for (int corner = 0; corner < 4; ++corner) {
+                            float ndcX = -1.0f + 2.0f * (tx + (corner & 1)) / tilesX;
+                            float ndcY = -1.0f + 2.0f * (ty + (corner >> 1)) / tilesY;
+                            vec3 p(ndcX * tanX * depth, ndcY * tanY * depth, -depth);
+                            bounds.min = glm::min(bounds.min, p);
+                            bounds.max = glm::max(bounds.max, p);
+                        }
+                    }
+                }
+            }
+        }
+    }
+
+    void binSlice(int slice) {
+        SliceList& list = sliceLists[slice];
+        list.x.clear(); list.y.clear(); list.z.clear(); list.r.clear(); list.lightIds.clear();
+        float sliceNear = -sliceDepth(slice), sliceFar = -sliceDepth(slice + 1);
+        for (size_t i = 0; i < viewLights.size(); ++i) {
+            const vec4& light = viewLights[i];
+            if (light.z - light.w > sliceNear || light.z + light.w < sliceFar) continue;
+            list.x.push_back(light.x);
+            list.y.push_back(light.y);
+            list.z.push_back(light.z);
+            list.r.push_back(light.w * light.w);
+            list.lightIds.push_back(i);
+        }
+        while (list.x.size() % 4 != 0) {
+            list.x.push_back(numeric_limits<float>::max());
+            list.y.push_back(0.0f);
+            list.z.push_back(0.0f);
+            list.r.push_back(0.0f);
+        }
+
+        list.offsets.assign(tilesX * tilesY + 1, 0);
+        list.indices.clear();
+        for (int tile = 0; tile < tilesX * tilesY; ++tile) {
+            const ClusterBounds& bounds = clusterBounds[slice * tilesX * tilesY + tile];
+            size_t start = list.indices.size();
+            for (size_t i = 0; i < list.x.size() && list.indices.size() - start < (size_t)maxLightsPerCluster; i += 4) {
+                int mask = sphereAabbMask4(&list.x[i], &list.y[i], &list.z[i], &list.r[i], bounds);
+                for (int lane = 0; lane < 4; ++lane) {
+                    if ((mask & (1 << lane)) && list.indices.size() - start < (size_t)maxLightsPerCluster) {
+                        list.indices.push_back(list.lightIds[i + lane]);
+                    }
+                }
+            }
+            list.offsets[tile + 1] = list.indices.size();
+        }
+    }
+
+    static int sphereAabbMask4(const float* x, const float* y, const float* z, const float* r2, const ClusterBounds& bounds) {
+#if defined(__SSE2__)
+        __m128 zero = _mm_setzero_ps();
+        __m128 px = _mm_loadu_ps(x), py = _mm_loadu_ps(y), pz = _mm_loadu_ps(z);
+        __m128 dx = _mm_max_ps(_mm_max_ps(_mm_sub_ps(_mm_set1_ps(bounds.min.x), px), zero), _mm_sub_ps(px, _mm_set1_ps(bounds.max.x)));
+        __m128 dy = _mm_max_ps(_mm_max_ps(_mm_sub_ps(_mm_set1_ps(bounds.min.y), py), zero), _mm_sub_ps(py, _mm_set1_ps(bounds.max.y)));
+        __m128 dz = _mm_max_ps(_mm_max_ps(_mm_sub_ps(_mm_set1_ps(bounds.min.z), pz), zero), _mm_sub_ps(pz, _mm_set1_ps(bounds.max.z)));
+        __m128 distance2 = _mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, dx), _mm_mul_ps(dy, dy)), _mm_mul_ps(dz, dz));
+        return _mm_movemask_ps(_mm_cmple_ps(distance2, _mm_loadu_ps(r2)));
+#else
+        int mask = 0;
+        for (int lane = 0; lane < 4; ++lane) {
+            float dx = std::max(std::max(bounds.min.x - x[lane], 0.0f), x[lane] - bounds.max.x);
+            float dy = std::max(std::max(bounds.min.y - y[lane], 0.0f), y[lane] - bounds.max.y);
+            float dz = std::max(std::max(bounds.min.z - z[lane], 0.0f), z[lane] - bounds.max.z);
+            if (dx * dx + dy * dy + dz * dz <= r2[lane]) mask |= 1 << lane;
+        }
+        return mask;
+#endif
+    }
+
+    void reserve(int index, size_t size) {
+        while (capacities[index] < size) capacities[index] *= 2;
+        streams[index].reset(new StreamBuffer(capacities[index]));
+        glBindTexture(GL_TEXTURE_BUFFER, textures[index].get());
+        glTexBuffer(GL_TEXTURE_BUFFER, formats[index], streams[index]->getBuffer());
+        glBindTexture(GL_TEXTURE_BUFFER, 0);
+    }
+
+    void upload(int index, const void* data, size_t size) {
+        streams[index]->endFrame();
+        char* target = streams[index]->allocate<char>(size);
+        if (!target) {
+            reserve(index, size);
+            target = streams[index]->allocate<char>(size);
+        }
+        memcpy(target, data, size);
+        streams[index]->flush();
+        offsets[index] = streams[index]->getOffset(target) / texelSizes[index];
+    }
+};
+
+class ShadowCascades {
+public:
+    static const int cascadeCount = 4;
+
+    ShadowCascades(int size = 1024, float angleThreshold = radians(2.0f))
+        : size(size), angleThreshold(angleThreshold) {
+        for (TextureResource& texture : textures) {
+            texture = createTexture();
+        }
+        for (int t = 0; t < 2; ++t) {
+            glBindTexture(GL_TEXTURE_2D_ARRAY, textures[t].get());
+            glTexImage3D(GL_TEXTURE_2D_ARRAY, 0, GL_DEPTH_COMPONENT24, size, size, cascadeCount, 0, GL_DEPTH_COMPONENT, GL_FLOAT, nullptr);
+            glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+            glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+            glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+            glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+            glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_COMPARE_MODE, GL_COMPARE_REF_TO_TEXTURE);
+            glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_COMPARE_FUNC, GL_LEQUAL);
+        }
+        glGenFramebuffers(cascadeCount * 2, framebuffers);
+        for (int i = 0; i < cascadeCount * 2; ++i) {
+            glBindFramebuffer(GL_FRAMEBUFFER, framebuffers[i]);
+            glFramebufferTextureLayer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, textures[i / cascadeCount].get(), 0, i % cascadeCount);
+            glDrawBuffer(GL_NONE);
+            glReadBuffer(GL_NONE);
+            if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE) {
+                throw runtime_error("Shadow framebuffer error");
+            }
+        }
+        glBindFramebuffer(GL_FRAMEBUFFER, 0);
+        glBindTexture(GL_TEXTURE_2D_ARRAY, 0);
+    }
+    ~ShadowCascades() {
+        glDeleteFramebuffers(cascadeCount * 2, framebuffers);
+    }
+    ShadowCascades(const ShadowCascades&) = delete;
+    ShadowCascades& operator=(const ShadowCascades&) = delete;
+
+    template <typename DrawCasters>
+    void update(const Pipeline& depthPipeline, const vec3& sunDirection, const vec3& cameraPos, const vec3& front,
+                float fovY, float aspect, float nearPlane, float farPlane, const DrawCasters& drawCasters) {
+        vec3 dir = normalize(sunDirection);
+        vec3 forward = normalize(front);
+        shadowDistance = farPlane;
+        viewForward = forward;
+        vec3 right = normalize(cross(forward, vec3(0.0f, 1.0f, 0.0f)));
+        vec3 up = cross(right, forward);
+        float tanY = tanf(fovY * 0.5f), tanX = tanY * aspect;
+
+        GLint previousFramebuffer;
+        glGetIntegerv(GL_FRAMEBUFFER_BINDING, &previousFramebuffer);
+        depthPipeline.bind();
+        Shader& depthShader = depthPipeline.getShader();
+        glViewport(0, 0, size, size);
+
+        for (int i = 0; i < cascadeCount; ++i) {
+            float splitNear = i == 0 ? nearPlane : splitDistance(i, nearPlane);
+            float splitFar = splitDistance(i + 1, nearPlane);
+            splits[i] = splitFar;
+            vec3 center(0.0f);
+            vec3 corners[8];
+            for (int c = 0; c < 8; ++c) {
+                float depth = c < 4 ? splitNear : splitFar;
+                float sx = (c & 1) ? 1.0f : -1.0f, sy = (c & 2) ? 1.0f : -1.0f;
+                corners[c] = cameraPos + forward * depth + right * (sx * tanX * depth) + up * (sy * tanY * depth);
+                center += corners[c] * 0.125f;
+            }
+            float radius = 0.0f;
+            for (const vec3& corner : corners) {
+                radius = std::max(radius, length(corner - center));
+            }
+
+            Cascade& cascade = cascades[i];
+            bool rebuild = !cascade.valid
+                || acosf(std::clamp(dot(dir, cascade.direction), -1.0f, 1.0f)) > angleThreshold
+                || length(center - cascade.center) + radius > cascade.radius;
+            bool refresh = rebuild || i == 0 || (frame + i) % (1 << i) == 0;
+            if (rebuild) {
+                cascade.direction = dir;
+                cascade.radius = radius * 1.25f;
+                cascade.center = center;
+                cascade.matrix = buildMatrix(cascade);
+                cascade.valid = true;
+                glBindFramebuffer(GL_FRAMEBUFFER, framebuffers[cascadeCount + i]);
+                Pipeline::clear(GL_DEPTH_BUFFER_BIT);
+                drawCasters(depthShader, cascade.matrix, false);
+            }
+            if (refresh) {
+                glBindFramebuffer(GL_READ_FRAMEBUFFER, framebuffers[cascadeCount + i]);
+                glBindFramebuffer(GL_DRAW_FRAMEBUFFER, framebuffers[i]);
+                glBlitFramebuffer(0, 0, size, size, 0, 0, size, size, GL_DEPTH_BUFFER_BIT, GL_NEAREST);
+                glBindFramebuffer(GL_FRAMEBUFFER, framebuffers[i]);
+                drawCasters(depthShader, cascade.matrix, true);
+            }
+        }
+
+        glBindFramebuffer(GL_FRAMEBUFFER, previousFramebuffer);
+        frame++;
+    }
+
+    void bind(Shader& shader, int unit = 4) {
+        GLuint program = shader.getProgram();
+        glActiveTexture(GL_TEXTURE0 + unit);
+        glBindTexture(GL_TEXTURE_2D_ARRAY, textures[0].get());
+        glActiveTexture(GL_TEXTURE0);
+        glUniform1i(glGetUniformLocation(program, "shadowMap"), unit);
+        mat4 matrices[cascadeCount];
+        for (int i = 0; i < cascadeCount; ++i) {
+            matrices[i] = translate(mat4(1.0f), vec3(0.5f)) * scale(mat4(1.0f), vec3(0.5f)) * cascades[i].matrix;
+        }
+        glUniformMatrix4fv(glGetUniformLocation(program, "shadowMatrices"), cascadeCount, GL_FALSE, value_ptr(matrices[0]));
+        glUniform1i(glGetUniformLocation(program, "shadowCascadeCount"), cascades[0].valid ? cascadeCount : 0);
+        glUniform1fv(glGetUniformLocation(program, "shadowSplits"), cascadeCount, splits);
+        glUniform3fv(glGetUniformLocation(program, "shadowViewForward"), 1, value_ptr(viewForward));
+    }
+    int getCascadeCount() const {
+        return cascades[0].valid ? cascadeCount : 0;
+    }
+    const mat4& getCascadeMatrix(int index) const {
+        return cascades[index].matrix;
+    }
+
+private:
+    struct Cascade {
+        bool valid = false;
+        vec3 direction = vec3(0.0f, 1.0f, 0.0f);
+        vec3 center = vec3(0.0f);
+        float radius = 0.0f;
+        mat4 matrix = mat4(1.0f);
+    };
+
+    int size;
+    float shadowDistance = 100.0f;
+    float angleThreshold;
+    TextureResource textures[2];
+    GLuint framebuffers[cascadeCount * 2];
+    Cascade cascades[cascadeCount];
+    float splits[cascadeCount] = {0.0f};
+    vec3 viewForward = vec3(0.0f, 0.0f, -1.0f);
+    unsigned int frame = 0;
+
+    float splitDistance(int index, float nearPlane) const {
+        float ratio = (float)index / cascadeCount;
+        float logarithmic = nearPlane * powf(shadowDistance / nearPlane, ratio);
+        float uniform = nearPlane + (shadowDistance - nearPlane) * ratio;
+        return 0.75f * logarithmic + 0.25f * uniform;
+    }
+
+    mat4 buildMatrix(const Cascade& cascade) const {
+        vec3 up = fabsf(cascade.direction.y) > 0.99f ? vec3(0.0f, 0.0f, 1.0f) : vec3(0.0f, 1.0f, 0.0f);
+        float depthRange = cascade.radius + 150.0f;
+        mat4 lightView = lookAt(cascade.center + cascade.direction * depthRange, cascade.center, up);
+        mat4 lightProjection = ortho(-cascade.radius, cascade.radius, -cascade.radius, cascade.radius, 0.0f, depthRange * 2.0f);
+        mat4 matrix = lightProjection * lightView;
+        vec4 origin = matrix * vec4(0.0f, 0.0f, 0.0f, 1.0f);
+        float texels = size * 0.5f;
+        vec2 snapped(roundf(origin.x * texels) / texels, roundf(origin.y * texels) / texels);
+        matrix[3][0] += snapped.x - origin.x;
+        matrix[3][1] += snapped.y - origin.y;
+        return matrix;
+    }
+};
+
+class GpuTimer {
+public:
+    GpuTimer(int latency = 4) : frames(latency) {}
+    ~GpuTimer() {
+        for (Frame& frame : frames) {
+            if (!frame.queries.empty()) glDeleteQueries(frame.queries.size(), frame.queries.data());
+        }
+    }
+    GpuTimer(const GpuTimer&) = delete;
+    GpuTimer& operator=(const GpuTimer&) = delete;
+
+    void beginFrame(FrameArena& arena) {
+        Frame& frame = frames[frameIndex % frames.size()];
+        collect(frame, arena);
+        frame.scopes.clear();
+        frame.usedQueries = 0;
+        begin("frame");
+    }
+
+    void endFrame() {
+        while (!openScopes.empty()) end();
+        frameIndex++;
+    }
+
+    void begin(const char* name) {
+        Frame& frame = frames[frameIndex % frames.size()];
+        frame.scopes.push_back({scopeIndex(name), nextQuery(frame), -1});
+        glQueryCounter(frame.queries[frame.scopes.back().startQuery], GL_TIMESTAMP);
+        openScopes.push_back(frame.scopes.size() - 1);
+    }
+
+    void end() {
+        Frame& frame = frames[frameIndex % frames.size()];
+        Scope& scope = frame.scopes[openScopes.back()];
+        openScopes.pop_back();
+        scope.endQuery = nextQuery(frame);
+        glQueryCounter(frame.queries[scope.endQuery], GL_TIMESTAMP);
+    }
+
+    float getMilliseconds(const char* name) const {
+        for (size_t i = 0; i < names.size(); ++i) {
+            if (names[i] == name) return averages[i];
+        }
+        return 0.0f;
+    }
+
+    const char* report(char* text, size_t size) const {
+        int length = snprintf(text, size, "GPU");
+        for (size_t i = 0; i < names.size() && length >= 0 && (size_t)length < size; ++i) {
+            length += snprintf(text + length, size - length, " | %s %.2f ms", names[i].c_str(), averages[i]);
+        }
+        return text;
+    }
+
+private:
+    struct Scope {
+        int name;
+        int startQuery;
+        int endQuery;
+    };
+    struct Frame {
+        vector<GLuint> queries;
+        int usedQueries = 0;
+        vector<Scope> scopes;
+    };
+    vector<Frame> frames;
+    vector<string> names;
+    vector<float> averages;
+    vector<size_t> openScopes;
+    unsigned int frameIndex = 0;
+
+    int scopeIndex(const char* name) {
+        for (size_t i = 0; i < names.size(); ++i) {
+            if (names[i] == name) return i;
+        }
+        names.push_back(name);
+        averages.push_back(0.0f);
+        return names.size() - 1;
+    }
+
+    int nextQuery(Frame& frame) {
+        if (frame.usedQueries == (int)frame.queries.size()) {
+            GLuint query;
+            glGenQueries(1, &query);
+            frame.queries.push_back(query);
+        }
+        return frame.usedQueries++;
+    }
+
+    void collect(Frame& frame, FrameArena& arena) {
+        if (frame.scopes.empty()) return;
+        GLint available = 0;
+        glGetQueryObjectiv(frame.queries[frame.usedQueries - 1], GL_QUERY_RESULT_AVAILABLE, &available);
+        if (!available) return;
+        float* totals = arena.allocate<float>(names.size());
+        for (const Scope& scope : frame.scopes) {
+            if (scope.endQuery < 0) continue;
+            GLuint64 start, end;
+            glGetQueryObjectui64v(frame.queries[scope.startQuery], GL_QUERY_RESULT, &start);
+            glGetQueryObjectui64v(frame.queries[scope.endQuery], GL_QUERY_RESULT, &end);
+            totals[scope.name] += (end - start) * 1e-6f;
+        }
+        for (size_t i = 0; i < names.size(); ++i) {
+            averages[i] = averages[i] == 0.0f ? totals[i] : averages[i] * 0.9f + totals[i] * 0.1f;
+        }
+    }
+};
+
+class DeferredRenderer {
+public:
+    DeferredRenderer() {
+        glGenFramebuffers(1, &framebuffer);
+        for (TextureResource& texture : textures) {
+            texture = createTexture();
+        }
+        fullscreenVAO = createVertexArray();
+    }
+    ~DeferredRenderer() {
+        glDeleteFramebuffers(1, &framebuffer);
+    }
+    DeferredRenderer(const DeferredRenderer&) = delete;
+    DeferredRenderer& operator=(const DeferredRenderer&) = delete;
+
+    void beginGeometry(int targetWidth, int targetHeight) {
+        if (targetWidth > capacityWidth || targetHeight > capacityHeight) {
+            resize(std::max(targetWidth, capacityWidth), std::max(targetHeight, capacityHeight));
+        }
+        width = targetWidth;
+        height = targetHeight;
+        glBindFramebuffer(GL_FRAMEBUFFER, framebuffer);
+        glViewport(0, 0, width, height);
+        glClearColor(0.0f, 0.0f, 0.0f, 0.0f);
+        Pipeline::clear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+    }
+
+    GLuint getNormalTexture() const {
+        return textures[1].get();
+    }
+    GLuint getVelocityTexture() const {
+        return textures[3].get();
+    }
+    GLuint getDepthTexture() const {
+        return textures[4].get();
+    }
+    vec2 getUvScale() const {
+        return vec2((float)width / capacityWidth, (float)height / capacityHeight);
+    }
+
+    void resolve(const Pipeline& lightingPipeline, const mat4& viewProjection, GLuint targetFramebuffer = 0, int firstUnit = 6) {
+        glBindFramebuffer(GL_FRAMEBUFFER, targetFramebuffer);
+        glViewport(0, 0, width, height);
+        lightingPipeline.bind();
+        GLuint program = lightingPipeline.getShader().getProgram();
+        const char* names[targetCount] = {"gAlbedo", "gNormal", "gLighting", "gVelocity", "gDepth"};
+        for (int i = 0; i < targetCount; ++i) {
+            glActiveTexture(GL_TEXTURE0 + firstUnit + i);
+            glBindTexture(GL_TEXTURE_2D, textures[i].get());
+            glUniform1i(glGetUniformLocation(program, names[i]), firstUnit + i);
+        }
+        glActiveTexture(GL_TEXTURE0);
+        glUniformMatrix4fv(glGetUniformLocation(program, "inverseViewProjection"), 1, GL_FALSE, value_ptr(inverse(viewProjection)));
+        glUniform2f(glGetUniformLocation(program, "screenSize"), (float)width, (float)height);
+        glBindVertexArray(fullscreenVAO.get());
+        glDrawArrays(GL_TRIANGLES, 0, 3);
+        glBindVertexArray(0);
+    }
+
+private:
+    static const int targetCount = 5;
+    GLuint framebuffer;
+    TextureResource textures[targetCount];
+    VertexArrayResource fullscreenVAO;
+    int width = 0;
+    int height = 0;
+    int capacityWidth = 0;
+    int capacityHeight = 0;
+
+    void resize(int targetWidth, int targetHeight) {
+        capacityWidth = targetWidth;
+        capacityHeight = targetHeight;
+        GLenum internalFormats[targetCount] = {GL_RGBA8, GL_RG16F, GL_R11F_G11F_B10F, GL_RG16F, GL_DEPTH_COMPONENT24};
+        GLenum formats[targetCount] = {GL_RGBA, GL_RG, GL_RGB, GL_RG, GL_DEPTH_COMPONENT};
+        glBindFramebuffer(GL_FRAMEBUFFER, framebuffer);
+        for (int i = 0; i < targetCount; ++i) {
+            glBindTexture(GL_TEXTURE_2D, textures[i].get());
+            glTexImage2D(GL_TEXTURE_2D, 0, internalFormats[i], capacityWidth, capacityHeight, 0, formats[i], GL_FLOAT, nullptr);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+            glFramebufferTexture2D(GL_FRAMEBUFFER, i == targetCount - 1 ? GL_DEPTH_ATTACHMENT : GL_COLOR_ATTACHMENT0 + i,
+                                   GL_TEXTURE_2D, textures[i].get(), 0);
+        }
+        GLenum drawBuffers[targetCount - 1] = {GL_COLOR_ATTACHMENT0, GL_COLOR_ATTACHMENT1, GL_COLOR_ATTACHMENT2, GL_COLOR_ATTACHMENT3};
+        glDrawBuffers(targetCount - 1, drawBuffers);
+        if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE) {
+            throw runtime_error("G-buffer framebuffer error");
+        }
+        glBindTexture(GL_TEXTURE_2D, 0);
+        glBindFramebuffer(GL_FRAMEBUFFER, 0);
+    }
+};
+
+class ScreenSpaceAO {
+public:
+    ScreenSpaceAO(int divisor = 2, bool temporal = false, float radius = 1.5f)
+        : divisor(divisor), temporal(temporal), radius(radius) {
+        glGenFramebuffers(2, framebuffers);
+        for (TextureResource& texture : textures) {
+            texture = createTexture();
+        }
+        fullscreenVAO = createVertexArray();
+        for (int i = 0; i < kernelSize; ++i) {
+            float t = (i + 0.5f) / kernelSize;
+            float r = sqrtf(t), phi = i * 2.39996323f;
+            kernel[i] = vec3(r * cosf(phi), r * sinf(phi), sqrtf(1.0f - t)) * (0.2f + 0.8f * t * t);
+        }
+    }
+    ~ScreenSpaceAO() {
+        glDeleteFramebuffers(2, framebuffers);
+    }
+    ScreenSpaceAO(const ScreenSpaceAO&) = delete;
+    ScreenSpaceAO& operator=(const ScreenSpaceAO&) = delete;
+
+    void compute(const Pipeline& pipeline, GLuint depthTexture, GLuint normalTexture, int fullWidth, int fullHeight, const vec2& depthUvScale,
+                 const mat4& viewProjection, float nearPlane, float farPlane, int firstUnit = 6) {
+        int targetWidth = (fullWidth + divisor - 1) / divisor, targetHeight = (fullHeight + divisor - 1) / divisor;
+        if (targetWidth != width || targetHeight != height) {
+            resize(targetWidth, targetHeight);
+        }
+        int target = temporal ? frame & 1 : 0;
+        glBindFramebuffer(GL_FRAMEBUFFER, framebuffers[target]);
+        glViewport(0, 0, width, height);
+        pipeline.bind();
+        GLuint program = pipeline.getShader().getProgram();
+        GLuint inputs[3] = {depthTexture, normalTexture, textures[target ^ 1].get()};
+        const char* names[3] = {"gDepth", "gNormal", "ssaoHistory"};
+        for (int i = 0; i < 3; ++i) {
+            glActiveTexture(GL_TEXTURE0 + firstUnit + i);
+            glBindTexture(GL_TEXTURE_2D, inputs[i]);
+            glUniform1i(glGetUniformLocation(program, names[i]), firstUnit + i);
+        }
+        glActiveTexture(GL_TEXTURE0);
+        glUniform1i(glGetUniformLocation(program, "ssaoDivisor"), divisor);
+        glUniform2f(glGetUniformLocation(program, "screenSize"), (float)fullWidth, (float)fullHeight);
+        glUniform2fv(glGetUniformLocation(program, "depthUvScale"), 1, value_ptr(depthUvScale));
+        glUniform1f(glGetUniformLocation(program, "nearPlane"), nearPlane);
+        glUniform1f(glGetUniformLocation(program, "farPlane"), farPlane);
+        glUniformMatrix4fv(glGetUniformLocation(program, "viewProjection"), 1, GL_FALSE, value_ptr(viewProjection));
+        glUniformMatrix4fv(glGetUniformLocation(program, "inverseViewProjection"), 1, GL_FALSE, value_ptr(inverse(viewProjection)));
+        glUniformMatrix4fv(glGetUniformLocation(program, "previousViewProjection"), 1, GL_FALSE, value_ptr(previousViewProjection));
+        glUniform3fv(glGetUniformLocation(program, "kernel"), kernelSize, value_ptr(kernel[0]));
+        glUniform1f(glGetUniformLocation(program, "radius"), radius);
+        glUniform1i(glGetUniformLocation(program, "frameIndex"), temporal ? frame : 0);
+        glUniform1i(glGetUniformLocation(program, "historyValid"), historyValid);
+        glBindVertexArray(fullscreenVAO.get());
+        glDrawArrays(GL_TRIANGLES, 0, 3);
+        glBindVertexArray(0);
+        glBindFramebuffer(GL_FRAMEBUFFER, 0);
+        previousViewProjection = viewProjection;
+        historyValid = temporal;
+        current = target;
+        frame++;
+    }
+
+    void bind(Shader& shader, int unit = 11) {
+        GLuint program = shader.getProgram();
+        glActiveTexture(GL_TEXTURE0 + unit);
+        glBindTexture(GL_TEXTURE_2D, textures[current].get());
+        glActiveTexture(GL_TEXTURE0);
+        glUniform1i(glGetUniformLocation(program, "ssaoTexture"), unit);
+        glUniform1i(glGetUniformLocation(program, "ssaoDivisor"), divisor);
+        glUniform1i(glGetUniformLocation(program, "ssaoEnabled"), 1);
+    }
+
+private:
+    static const int kernelSize = 12;
+    int divisor;
+    bool temporal;
+    float radius;
+    vec3 kernel[kernelSize];
+    GLuint framebuffers[2];
+    TextureResource textures[2];
+    VertexArrayResource fullscreenVAO;
+    int width = 0;
+    int height = 0;
+    int current = 0;
+    int frame = 0;
+    bool historyValid = false;
+    mat4 previousViewProjection = mat4(1.0f);
+
+    void resize(int targetWidth, int targetHeight) {
+        width = targetWidth;
+        height = targetHeight;
+        for (int i = 0; i < 2; ++i) {
+            glBindTexture(GL_TEXTURE_2D, textures[i].get());
+            glTexImage2D(GL_TEXTURE_2D, 0, GL_RG16F, width, height, 0, GL_RG, GL_FLOAT, nullptr);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+            glBindFramebuffer(GL_FRAMEBUFFER, framebuffers[i]);
+            glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, textures[i].get(), 0);
+            if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE) {
+                throw runtime_error("SSAO framebuffer error");
+            }
+        }
+        glBindTexture(GL_TEXTURE_2D, 0);
+        glBindFramebuffer(GL_FRAMEBUFFER, 0);
+        historyValid = false;
+    }
+};
+
+class DynamicResolution {
+public:
+    DynamicResolution(float budgetMilliseconds, float minScale = 0.5f, float maxScale = 1.0f)
+        : budget(budgetMilliseconds), minScale(minScale), maxScale(maxScale), scale(maxScale) {
+        glGenFramebuffers(1, &framebuffer);
+        for (TextureResource& texture : textures) {
+            texture = createTexture();
+        }
+        glGenRenderbuffers(1, &depthBuffer);
+    }
+    ~DynamicResolution() {
+        glDeleteRenderbuffers(1, &depthBuffer);
+        glDeleteFramebuffers(1, &framebuffer);
+    }
+    DynamicResolution(const DynamicResolution&) = delete;
+    DynamicResolution& operator=(const DynamicResolution&) = delete;
+
+    void update(float gpuMilliseconds) {
+        if (budget <= 0.0f) return;
+        if (cooldown > 0) {
+            cooldown--;
+            return;
+        }
+        if (gpuMilliseconds <= 0.0f) return;
+        float target = scale;
+        if (gpuMilliseconds > budget) {
+            target = scale * sqrtf(budget * 0.95f / gpuMilliseconds);
+        } else if (gpuMilliseconds < budget * 0.8f) {
+            target = scale * std::min(sqrtf(budget * 0.9f / gpuMilliseconds), 1.05f);
+        }
+        target = std::clamp(roundf(target * 40.0f) / 40.0f, minScale, maxScale);
+        if (target != scale) {
+            scale = target;
+            cooldown = 8;
+        }
+    }
+
+    void begin(int outputWidth, int outputHeight) {
+        if (outputWidth != capacityWidth || outputHeight != capacityHeight) {
+            resize(outputWidth, outputHeight);
+        }
+        glBindFramebuffer(GL_FRAMEBUFFER, framebuffer);
+        glViewport(0, 0, getWidth(), getHeight());
+        Pipeline::clear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+    }
+
+    void present() {
+        glBindFramebuffer(GL_READ_FRAMEBUFFER, framebuffer);
+        glBindFramebuffer(GL_DRAW_FRAMEBUFFER, 0);
+        glBlitFramebuffer(0, 0, getWidth(), getHeight(), 0, 0, capacityWidth, capacityHeight, GL_COLOR_BUFFER_BIT, GL_LINEAR);
+        glBindFramebuffer(GL_FRAMEBUFFER, 0);
+        glViewport(0, 0, capacityWidth, capacityHeight);
+    }
+
+    int getWidth() const {
+        return std::max(1, (int)(capacityWidth * scale));
+    }
+    int getHeight() const {
+        return std::max(1, (int)(capacityHeight * scale));
+    }
+    float getScale() const {
+        return scale;
+    }
+    vec2 getUvScale() const {
+        return vec2((float)getWidth() / capacityWidth, (float)getHeight() / capacityHeight);
+    }
+    GLuint getFramebuffer() const {
+        return framebuffer;
+    }
+    GLuint getColorTexture() const {
+        return textures[0].get();
+    }
+    GLuint getVelocityTexture() const {
+        return textures[1].get();
+    }
+
+private:
+    float budget;
+    float minScale;
+    float maxScale;
+    float scale;
+    int cooldown = 0;
+    int capacityWidth = 0;
+    int capacityHeight = 0;
+    GLuint framebuffer;
+    TextureResource textures[2];
+    GLuint depthBuffer;
+
+    void resize(int outputWidth, int outputHeight) {
+        capacityWidth = outputWidth;
+        capacityHeight = outputHeight;
+        GLenum internalFormats[2] = {GL_RGBA8, GL_RG16F};
+        GLenum formats[2] = {GL_RGBA, GL_RG};
+        glBindFramebuffer(GL_FRAMEBUFFER, framebuffer);
+        for (int i = 0; i < 2; ++i) {
+            glBindTexture(GL_TEXTURE_2D, textures[i].get());
+            glTexImage2D(GL_TEXTURE_2D, 0, internalFormats[i], capacityWidth, capacityHeight, 0, formats[i], GL_FLOAT, nullptr);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+            glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0 + i, GL_TEXTURE_2D, textures[i].get(), 0);
+        }
+        GLenum drawBuffers[2] = {GL_COLOR_ATTACHMENT0, GL_COLOR_ATTACHMENT1};
+        glDrawBuffers(2, drawBuffers);
+        glBindTexture(GL_TEXTURE_2D, 0);
+        glBindRenderbuffer(GL_RENDERBUFFER, depthBuffer);
+        glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH_COMPONENT24, capacityWidth, capacityHeight);
+        glBindRenderbuffer(GL_RENDERBUFFER, 0);
+        glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_RENDERBUFFER, depthBuffer);
+        if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE) {
+            throw runtime_error("Dynamic resolution framebuffer error");
+        }
+        glBindFramebuffer(GL_FRAMEBUFFER, 0);
+    }
+};
+
+class TemporalAA {
+public:
+    TemporalAA() {
+        glGenFramebuffers(2, framebuffers);
+        for (TextureResource& texture : textures) {
+            texture = createTexture();
+        }
+        fullscreenVAO = createVertexArray();
+    }
+    ~TemporalAA() {
+        glDeleteFramebuffers(2, framebuffers);
+    }
+    TemporalAA(const TemporalAA&) = delete;
+    TemporalAA& operator=(const TemporalAA&) = delete;
+
+    vec2 nextJitter(int renderWidth, int renderHeight) {
+        int index = frame % 8 + 1;
+        jitter = vec2((halton(index, 2) - 0.5f) * 2.0f / renderWidth, (halton(index, 3) - 0.5f) * 2.0f / renderHeight);
+        return jitter;
+    }
+
+    void resolve(const Pipeline& pipeline, GLuint colorTexture, GLuint velocityTexture, int renderWidth, int renderHeight,
+                 const vec2& inputUvScale, int outputWidth, int outputHeight, int firstUnit = 6) {
+        if (outputWidth != width || outputHeight != height) {
+            resize(outputWidth, outputHeight);
+        }
+        int target = frame & 1;
+        glBindFramebuffer(GL_FRAMEBUFFER, framebuffers[target]);
+        glViewport(0, 0, width, height);
+        pipeline.bind();
+        GLuint program = pipeline.getShader().getProgram();
+        GLuint inputs[3] = {colorTexture, velocityTexture, textures[target ^ 1].get()};
+        const char* names[3] = {"currentColor", "velocityTexture", "historyColor"};
+        for (int i = 0; i < 3; ++i) {
+            glActiveTexture(GL_TEXTURE0 + firstUnit + i);
+            glBindTexture(GL_TEXTURE_2D, inputs[i]);
+            glUniform1i(glGetUniformLocation(program, names[i]), firstUnit + i);
+        }
+        glActiveTexture(GL_TEXTURE0);
+        glUniform2f(glGetUniformLocation(program, "renderSize"), (float)renderWidth, (float)renderHeight);
+        glUniform2fv(glGetUniformLocation(program, "inputUvScale"), 1, value_ptr(inputUvScale));
+        glUniform2f(glGetUniformLocation(program, "outputSize"), (float)width, (float)height);
+        glUniform2fv(glGetUniformLocation(program, "jitter"), 1, value_ptr(jitter));
+        glUniform1i(glGetUniformLocation(program, "historyValid"), historyValid);
+        glBindVertexArray(fullscreenVAO.get());
+        glDrawArrays(GL_TRIANGLES, 0, 3);
+        glBindVertexArray(0);
+        historyValid = true;
+        current = target;
+        frame++;
+    }
+
+    void present() {
+        glBindFramebuffer(GL_READ_FRAMEBUFFER, framebuffers[current]);
+        glBindFramebuffer(GL_DRAW_FRAMEBUFFER, 0);
+        glBlitFramebuffer(0, 0, width, height, 0, 0, width, height, GL_COLOR_BUFFER_BIT, GL_NEAREST);
+        glBindFramebuffer(GL_FRAMEBUFFER, 0);
+    }
+
+private:
+    GLuint framebuffers[2];
+    TextureResource textures[2];
+    VertexArrayResource fullscreenVAO;
+    int width = 0;
+    int height = 0;
+    int current = 0;
+    unsigned int frame = 0;
+    bool historyValid = false;
+    vec2 jitter = vec2(0.0f);
+
+    static float halton(int index, int base) {
+        float result = 0.0f, fraction = 1.0f;
+        while (index > 0) {
+            fraction /= base;
+            result += fraction * (index % base);
+            index /= base;
+        }
+        return result;
+    }
+
+    void resize(int outputWidth, int outputHeight) {
+        width = outputWidth;
+        height = outputHeight;
+        for (int i = 0; i < 2; ++i) {
+            glBindTexture(GL_TEXTURE_2D, textures[i].get());
+            glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA16F, width, height, 0, GL_RGBA, GL_FLOAT, nullptr);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+            glBindFramebuffer(GL_FRAMEBUFFER, framebuffers[i]);
+            glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, textures[i].get(), 0);
+            if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE) {
+                throw runtime_error("TAA framebuffer error");
+            }
+        }
+        glBindTexture(GL_TEXTURE_2D, 0);
+        glBindFramebuffer(GL_FRAMEBUFFER, 0);
+        historyValid = false;
+    }
+};
+
+void computeVertexBounds(const vector<float>& vertices, vec3& boundsMin, vec3& boundsMax) {
+    boundsMin = vec3(numeric_limits<float>::max());
+    boundsMax = vec3(-numeric_limits<float>::max());
+    for (size_t i = 0; i + 4 < vertices.size(); i += 5) {
+        vec3 p(vertices[i], vertices[i + 1], vertices[i + 2]);
+        boundsMin = glm::min(boundsMin, p);
+        boundsMax = glm::max(boundsMax, p);
+    }
+}
+
+void computeVertexBounds(const MeshView& mesh, vec3& boundsMin, vec3& boundsMax) {
+    boundsMin = vec3(numeric_limits<float>::max());
+    boundsMax = vec3(-numeric_limits<float>::max());
+    for (size_t i = 0; i < mesh.vertexCount; ++i) {
+        vec3 p(mesh.vertices[i * 8], mesh.vertices[i * 8 + 1], mesh.vertices[i * 8 + 2]);
+        boundsMin = glm::min(boundsMin, p);
+        boundsMax = glm::max(boundsMax, p);
+    }
+}
+
+void transformBounds(const mat4& model, const vec3& boundsMin, const vec3& boundsMax, vec3& worldMin, vec3& worldMax) {
+    vec3 corners[2] = {boundsMin, boundsMax};
+    worldMin = vec3(numeric_limits<float>::max());
+    worldMax = vec3(-numeric_limits<float>::max());
+    for (int c = 0; c < 8; ++c) {
+        vec3 corner(corners[c & 1].x, corners[(c >> 1) & 1].y, corners[c >> 2].z);
+        vec3 world = vec3(model * vec4(corner, 1.0f));
+        worldMin = glm::min(worldMin, world);
+        worldMax = glm::max(worldMax, world);
+    }
+}
+
+struct Frustum {
+    vec4 planes[6];
+
+    Frustum(const mat4& viewProjection) {
+        for (int i = 0; i < 3; ++i) {
+            for (int side = 0; side < 2; ++side) {
+                vec4& plane = planes[i * 2 + side];
+                for (int column = 0; column < 4; ++column) {
+                    float row = viewProjection[column][i];
+                    plane[column] = viewProjection[column][3] + (side == 0 ? row : -row);
+                }
+            }
+        }
+    }
+
+    bool intersects(const vec3& boundsMin, const vec3& boundsMax) const {
+        for (const vec4& plane : planes) {
+            vec3 positive(plane.x >= 0.0f ? boundsMax.x : boundsMin.x,
+                          plane.y >= 0.0f ? boundsMax.y : boundsMin.y,
+                          plane.z >= 0.0f ? boundsMax.z : boundsMin.z);
+            if (dot(vec3(plane), positive) + plane.w < 0.0f) return false;
+        }
+        return true;
+    }
+};
+
+struct Float4 {
+#if defined(__SSE2__)
+    __m128 v;
+    Float4() : v(_mm_setzero_ps()) {}
+    Float4(__m128 value) : v(value) {}
+    explicit Float4(float s) : v(_mm_set1_ps(s)) {}
+    Float4(float a, float b, float c, float d) : v(_mm_setr_ps(a, b, c, d)) {}
+    float operator[](int lane) const { float lanes[4]; _mm_storeu_ps(lanes, v); return lanes[lane]; }
+    friend Float4 operator+(Float4 a, Float4 b) { return _mm_add_ps(a.v, b.v); }
+    friend Float4 operator-(Float4 a, Float4 b) { return _mm_sub_ps(a.v, b.v); }
+    friend Float4 operator*(Float4 a, Float4 b) { return _mm_mul_ps(a.v, b.v); }
+    friend Float4 operator/(Float4 a, Float4 b) { return _mm_div_ps(a.v, b.v); }
+    friend Float4 operator<(Float4 a, Float4 b) { return _mm_cmplt_ps(a.v, b.v); }
+    friend Float4 operator<=(Float4 a, Float4 b) { return _mm_cmple_ps(a.v, b.v); }
+    friend Float4 operator>(Float4 a, Float4 b) { return _mm_cmpgt_ps(a.v, b.v); }
+    friend Float4 operator>=(Float4 a, Float4 b) { return _mm_cmpge_ps(a.v, b.v); }
+    friend Float4 operator&(Float4 a, Float4 b) { return _mm_and_ps(a.v, b.v); }
+    friend Float4 operator|(Float4 a, Float4 b) { return _mm_or_ps(a.v, b.v); }
+    friend Float4 min4(Float4 a, Float4 b) { return _mm_min_ps(a.v, b.v); }
+    friend Float4 max4(Float4 a, Float4 b) { return _mm_max_ps(a.v, b.v); }
+    friend Float4 abs4(Float4 a) { return _mm_andnot_ps(_mm_set1_ps(-0.0f), a.v); }
+    friend Float4 select4(Float4 mask, Float4 a, Float4 b) { return _mm_or_ps(_mm_and_ps(mask.v, a.v), _mm_andnot_ps(mask.v, b.v)); }
+    friend int mask4(Float4 a) { return _mm_movemask_ps(a.v); }
+#else
+    float v[4];
+    Float4() : v{0, 0, 0, 0} {}
+    explicit Float4(float s) : v{s, s, s, s} {}
+    Float4(float a, float b, float c, float d) : v{a, b, c, d} {}
+    float operator[](int lane) const { return v[lane]; }
+    template<typename F> static Float4 map(Float4 a, Float4 b, F f) { return Float4(f(a.v[0], b.v[0]), f(a.v[1], b.v[1]), f(a.v[2], b.v[2]), f(a.v[3], b.v[3])); }
+    static float bits(bool value) { uint32_t b = value ? 0xFFFFFFFFu : 0u; float f; memcpy(&f, &b, 4); return f; }
+    static bool isSet(float f) { uint32_t b; memcpy(&b, &f, 4); return b != 0; }
+    friend Float4 operator+(Float4 a, Float4 b) { return map(a, b, [](float x, float y) { return x + y; }); }
+    friend Float4 operator-(Float4 a, Float4 b) { return map(a, b, [](float x, float y) { return x - y; }); }
+    friend Float4 operator*(Float4 a, Float4 b) { return map(a, b, [](float x, float y) { return x * y; }); }
+    friend Float4 operator/(Float4 a, Float4 b) { return map(a, b, [](float x, float y) { return x / y; }); }
+    friend Float4 operator<(Float4 a, Float4 b) { return map(a, b, [](float x, float y) { return bits(x < y); }); }
+    friend Float4 operator<=(Float4 a, Float4 b) { return map(a, b, [](float x, float y) { return bits(x <= y); }); }
+    friend Float4 operator>(Float4 a, Float4 b) { return map(a, b, [](float x, float y) { return bits(x > y); }); }
+    friend Float4 operator>=(Float4 a, Float4 b) { return map(a, b, [](float x, float y) { return bits(x >= y); }); }
+    friend Float4 operator&(Float4 a, Float4 b) { return map(a, b, [](float x, float y) { return bits(isSet(x) && isSet(y)); }); }
+    friend Float4 operator|(Float4 a, Float4 b) { return map(a, b, [](float x, float y) { return bits(isSet(x) || isSet(y)); }); }
+    friend Float4 min4(Float4 a, Float4 b) { return map(a, b, [](float x, float y) { return std::min(x, y); }); }
+    friend Float4 max4(Float4 a, Float4 b) { return map(a, b, [](float x, float y) { return std::max(x, y); }); }
+    friend Float4 abs4(Float4 a) { return map(a, a, [](float x, float) { return fabsf(x); }); }
+    friend Float4 select4(Float4 mask, Float4 a, Float4 b) { return Float4(isSet(mask.v[0]) ? a.v[0] : b.v[0], isSet(mask.v[1]) ? a.v[1] : b.v[1], isSet(mask.v[2]) ? a.v[2] : b.v[2], isSet(mask.v[3]) ? a.v[3] : b.v[3]); }
+    friend int mask4(Float4 a) { return isSet(a.v[0]) | isSet(a.v[1]) << 1 | isSet(a.v[2]) << 2 | isSet(a.v[3]) << 3; }
+#endif
+};
+
+class OcclusionCuller {
+public:
+    OcclusionCuller(int width = 320, int height = 192)
+        : width(width), height(height), tilesX(width / 8), tilesY(height / 4), tiles(tilesX * tilesY) {}
+
+    void addOccluder(const MeshView& mesh, const mat4& model) {
+        for (size_t i = 0; i + 2 < mesh.indexCount; i += 3) {
+            for (int k = 0; k < 3; ++k) {
+                const float* v = &mesh.vertices[mesh.indices[i + k] * 8];
+                occluders.push_back(vec3(model * vec4(v[0], v[1], v[2], 1.0f)));
+            }
+        }
+    }
+
+    void render(const mat4& viewProjection) {
+        for (Tile& tile : tiles) {
+            tile = Tile();
+        }
+        for (size_t i = 0; i + 2 < occluders.size(); i += 3) {
+            vec4 polygon[4];
+            int count = 0;
+            vec4 clip[3];
+            for (int k = 0; k < 3; ++k) {
+                clip[k] = viewProjection * vec4(occluders[i + k], 1.0f);
+            }
+            for (int k = 0; k < 3; ++k) {
+                const vec4& a = clip[k];
+                const vec4& b = clip[(k + 1) % 3];
+                float da = a.z + a.w, db = b.z + b.w;
+                if (da >= 0.0f) polygon[count++] = a;
+                if ((da >= 0.0f) != (db >= 0.0f)) polygon[count++] = a + (b - a) * (da / (da - db));
+            }
+            for (int k = 1; k + 1 < count; ++k) {
+                rasterize(toScreen(polygon[0]), toScreen(polygon[k]), toScreen(polygon[k + 1]));
+            }
+        }
+    }
+
+    bool isVisible(const mat4& viewProjection, const vec3& boundsMin, const vec3& boundsMax) const {
+        vec3 corners[2] = {boundsMin, boundsMax};
+        vec2 screenMin(numeric_limits<float>::max()), screenMax(-numeric_limits<float>::max());
+        float nearest = 1.0f;
+        for (int c = 0; c < 8; ++c) {
+            vec4 clip = viewProjection * vec4(corners[c & 1].x, corners[(c >> 1) & 1].y, corners[c >> 2].z, 1.0f);
+            if (clip.z < -clip.w || clip.w <= 1e-5f) return true;
+            vec3 screen = toScreen(clip);
+            screenMin = glm::min(screenMin, vec2(screen.x, screen.y));
+            screenMax = glm::max(screenMax, vec2(screen.x, screen.y));
+            nearest = std::min(nearest, screen.z);
+        }
+        int x0 = std::max(0, (int)floorf(screenMin.x) / 8), x1 = std::min(tilesX - 1, (int)floorf(screenMax.x) / 8);
+        int y0 = std::max(0, (int)floorf(screenMin.y) / 4), y1 = std::min(tilesY - 1, (int)floorf(screenMax.y) / 4);
+        for (int ty = y0; ty <= y1; ++ty) {
+            for (int tx = x0; tx <= x1; ++tx) {
+                if (nearest < tiles[ty * tilesX + tx].committedDepth) return true;
+            }
+        }
+        return false;
+    }
+
+    int getTilesX() const {
+        return tilesX;
+    }
+
+    int getTilesY() const {
+        return tilesY;
+    }
+
+    float getTileDepth(int tx, int ty) const {
+        return tiles[ty * tilesX + tx].committedDepth;
+    }
+
+private:
+    struct Tile {
+        uint32_t mask = 0;
+        float committedDepth = 1.0f;
+        float workingDepth = 0.0f;
+    };
+
+    int width;
+    int height;
+    int tilesX;
+    int tilesY;
+    vector<Tile> tiles;
+    vector<vec3> occluders;
+
+    vec3 toScreen(const vec4& clip) const {
+        vec3 ndc = vec3(clip) / clip.w;
+        return vec3((ndc.x * 0.5f + 0.5f) * width, (ndc.y * 0.5f + 0.5f) * height, ndc.z * 0.5f + 0.5f);
+    }
+
+    void rasterize(vec3 a, vec3 b, vec3 c) {
+        float area = (b.x - a.x) * (c.y - a.y) - (c.x - a.x) * (b.y - a.y);
+        if (fabsf(area) < 1e-6f) return;
+        if (area < 0.0f) swap(b, c);
+        float depth = std::max(a.z, std::max(b.z, c.z));
+        if (depth > 1.0f) return;
+        int x0 = std::max(0, (int)floorf(std::min(a.x, std::min(b.x, c.x))) / 8);
+        int x1 = std::min(tilesX - 1, (int)floorf(std::max(a.x, std::max(b.x, c.x))) / 8);
+        int y0 = std::max(0, (int)floorf(std::min(a.y, std::min(b.y, c.y))) / 4);
+        int y1 = std::min(tilesY - 1, (int)floorf(std::max(a.y, std::max(b.y, c.y))) / 4);
+        if (x0 > x1 || y0 > y1) return;
+
+        vec3 v[3] = {a, b, c};
+        Float4 edgeA[3], edgeB[3], edgeC[3];
+        for (int e = 0; e < 3; ++e) {
+            const vec3& p = v[e];
+            const vec3& q = v[(e + 1) % 3];
+            edgeA[e] = Float4(p.y - q.y);
+            edgeB[e] = Float4(q.x - p.x);
+            edgeC[e] = Float4(p.x * q.y - q.x * p.y);
+        }
+        Float4 zero(0.0f);
+        for (int ty = y0; ty <= y1; ++ty) {
+            for (int tx = x0; tx <= x1; ++tx) {
+                float left = tx * 8 + 0.5f;
+                Float4 xs[2] = {Float4(left, left + 1, left + 2, left + 3), Float4(left + 4, left + 5, left + 6, left + 7)};
+                uint32_t coverage = 0;
+                for (int row = 0; row < 4; ++row) {
+                    Float4 y(ty * 4 + row + 0.5f);
+                    for (int half = 0; half < 2; ++half) {
+                        Float4 inside = (edgeA[0] * xs[half] + edgeB[0] * y + edgeC[0]) >= zero;
+                        inside = inside & ((edgeA[1] * xs[half] + edgeB[1] * y + edgeC[1]) >= zero);
+                        inside = inside & ((edgeA[2] * xs[half] + edgeB[2] * y + edgeC[2]) >= zero);
+                        coverage |= (uint32_t)mask4(inside) << (row * 8 + half * 4);
+                    }
+                }
+                if (coverage) {
+                    updateTile(tiles[ty * tilesX + tx], coverage, depth);
+                }
+            }
+        }
+    }
+
+    static void updateTile(Tile& tile, uint32_t coverage, float depth) {
+        if (depth >= tile.committedDepth) return;
+        if (tile.workingDepth - depth > tile.committedDepth - tile.workingDepth) {
+            tile.mask = 0;
+            tile.workingDepth = 0.0f;
+        }
+        tile.mask |= coverage;
+        tile.workingDepth = std::max(tile.workingDepth, depth);
+        if (tile.mask == 0xFFFFFFFFu) {
+            tile.committedDepth = tile.workingDepth;
+            tile.mask = 0;
+            tile.workingDepth = 0.0f;
+        }
+    }
+};
+
+class PortalVisibility {
+public:
+    int addCell(const vec3& boundsMin, const vec3& boundsMax) {
+        if (cells.size() >= 64) {
+            throw runtime_error("too many portal cells");
+        }
+        cells.push_back({boundsMin, boundsMax, {}});
+        return cells.size() - 1;
+    }
+
+    void addPortal(int cellA, int cellB, const vec3& a, const vec3& b, const vec3& c, const vec3& d) {
+        if (cellA < 0 || cellB < 0 || cellA >= (int)cells.size() || cellB >= (int)cells.size() || cellA == cellB) {
+            throw runtime_error("bad portal cell");
+        }
+        portals.push_back({{cellA, cellB}, {a, b, c, d}});
+        cells[cellA].portals.push_back(portals.size() - 1);
+        cells[cellB].portals.push_back(portals.size() - 1);
+    }
+
+    int findCell(const vec3& point) const {
+        for (size_t i = 0; i < cells.size(); ++i) {
+            if (overlaps(cells[i], point, point)) return i;
+        }
+        return -1;
+    }
+
+    void update(const mat4& viewProjection, const vec3& cameraPos) {
+        visibleCells = ~0ull;
+        int start = findCell(cameraPos);
+        if (start < 0) return;
+        visibleCells = 0;
+        visit(start, vec4(-1.0f, -1.0f, 1.0f, 1.0f), viewProjection, cameraPos, 1ull << start);
+    }
+
+    bool isVisible(const vec3& boundsMin, const vec3& boundsMax) const {
+        bool inside = false;
+        for (size_t i = 0; i < cells.size(); ++i) {
+            if (!overlaps(cells[i], boundsMin, boundsMax)) continue;
+            if (visibleCells >> i & 1) return true;
+            inside = true;
+        }
+        return !inside;
+    }
+
+private:
+    struct Cell {
+        vec3 boundsMin;
+        vec3 boundsMax;
+        vector<int> portals;
+    };
+    struct Portal {
+        int cells[2];
+        vec3 corners[4];
+    };
+
+    vector<Cell> cells;
+    vector<Portal> portals;
+    uint64_t visibleCells = ~0ull;
+
+    static bool overlaps(const Cell& cell, const vec3& boundsMin, const vec3& boundsMax) {
+        return boundsMin.x <= cell.boundsMax.x && boundsMax.x >= cell.boundsMin.x &&
+               boundsMin.y <= cell.boundsMax.y && boundsMax.y >= cell.boundsMin.y &&
+               boundsMin.z <= cell.boundsMax.z && boundsMax.z >= cell.boundsMin.z;
+    }
+
+    void visit(int cell, const vec4& rect, const mat4& viewProjection, const vec3& cameraPos, uint64_t path) {
+        visibleCells |= 1ull << cell;
+        for (int index : cells[cell].portals) {
+            const Portal& portal = portals[index];
+            int next = portal.cells[0] == cell ? portal.cells[1] : portal.cells[0];
+            if (path >> next & 1) continue;
+            vec4 portalRect;
+            if (clipPortal(portal, viewProjection, cameraPos, rect, portalRect)) {
+                visit(next, portalRect, viewProjection, cameraPos, path | 1ull << next);
+            }
+        }
+    }
+
+    static bool clipPortal(const Portal& portal, const mat4& viewProjection, const vec3& cameraPos, const vec4& rect, vec4& result) {
+        const vec3* c = portal.corners;
+        vec3 normal = cross(c[1] - c[0], c[2] - c[0]);
+        if (fabsf(dot(normal, cameraPos - c[0])) < 0.2f * length(normal)) {
+            result = rect;
+            return true;
+        }
+        vec4 clip[4], polygon[8];
+        for (int k = 0; k < 4; ++k) {
+            clip[k] = viewProjection * vec4(c[k], 1.0f);
+        }
+        int count = 0;
+        for (int k = 0; k < 4; ++k) {
+            const vec4& a = clip[k];
+            const vec4& b = clip[(k + 1) % 4];
+            float da = a.z + a.w, db = b.z + b.w;
+            if (da >= 0.0f) polygon[count++] = a;
+            if ((da >= 0.0f) != (db >= 0.0f)) polygon[count++] = a + (b - a) * (da / (da - db));
+        }
+        if (count == 0) return false;
+        vec2 screenMin(numeric_limits<float>::max()), screenMax(-numeric_limits<float>::max());
+        for (int k = 0; k < count; ++k) {
+            vec2 ndc = vec2(polygon[k].x, polygon[k].y) / polygon[k].w;
+            screenMin = glm::min(screenMin, ndc);
+            screenMax = glm::max(screenMax, ndc);
+        }
+        result = vec4(std::max(screenMin.x, rect.x), std::max(screenMin.y, rect.y),
+                      std::min(screenMax.x, rect.z), std::min(screenMax.y, rect.w));
+        return result.x < result.z && result.y < result.w;
+    }
+};
+
+PortalVisibility staticPortalGraph() {
+    PortalVisibility graph;
+    int below = graph.addCell(vec3(-10.0f, -1.0f, -10.0f), vec3(10.0f, 12.0f, 10.0f));
+    int above = graph.addCell(vec3(-10.0f, 12.0f, -10.0f), vec3(10.0f, 50.0f, 10.0f));
+    int west = graph.addCell(vec3(-50.0f, -1.0f, -50.0f), vec3(-10.0f, 50.0f, 50.0f));
+    int east = graph.addCell(vec3(10.0f, -1.0f, -50.0f), vec3(50.0f, 50.0f, 50.0f));
+    int north = graph.addCell(vec3(-10.0f, -1.0f, -50.0f), vec3(10.0f, 50.0f, -10.0f));
+    int south = graph.addCell(vec3(-10.0f, -1.0f, 10.0f), vec3(10.0f, 50.0f, 50.0f));
+    for (int cell : {below, above}) {
+        float y0 = cell == below ? -1.0f : 12.0f, y1 = cell == below ? 12.0f : 50.0f;
+        graph.addPortal(cell, west, vec3(-10, y0, -10), vec3(-10, y0, 10), vec3(-10, y1, 10), vec3(-10, y1, -10));
+        graph.addPortal(cell, east, vec3(10, y0, -10), vec3(10, y0, 10), vec3(10, y1, 10), vec3(10, y1, -10));
+        graph.addPortal(cell, north, vec3(-10, y0, -10), vec3(10, y0, -10), vec3(10, y1, -10), vec3(-10, y1, -10));
+        graph.addPortal(cell, south, vec3(-10, y0, 10), vec3(10, y0, 10), vec3(10, y1, 10), vec3(-10, y1, 10));
+    }
+    graph.addPortal(west, north, vec3(-10, -1, -50), vec3(-10, -1, -10), vec3(-10, 50, -10), vec3(-10, 50, -50));
+    graph.addPortal(west, south, vec3(-10, -1, 10), vec3(-10, -1, 50), vec3(-10, 50, 50), vec3(-10, 50, 10));
+    graph.addPortal(east, north, vec3(10, -1, -50), vec3(10, -1, -10), vec3(10, 50, -10), vec3(10, 50, -50));
+    graph.addPortal(east, south, vec3(10, -1, 10), vec3(10, -1, 50), vec3(10, 50, 50), vec3(10, 50, 10));
+    return graph;
+}
+
+struct DrawElementsIndirectCommand {
+    GLuint count;
+    GLuint instanceCount;
+    GLuint firstIndex;
+    GLint baseVertex;
+    GLuint baseInstance;
+};
+
+class GpuInstanceCuller {
+public:
+    GpuInstanceCuller(const StaticLod* lods, size_t lodCount, float scale, const vector<mat4>& models) : instanceCount(models.size()) {
+        vector<float> lodVertices;
+        vector<uint32_t> indices;
+        for (size_t level = 0; level < lodCount && level < 8; ++level) {
+            const MeshView& mesh = lods[level].mesh;
+            commands.push_back({(GLuint)mesh.indexCount, 0, (GLuint)indices.size(), (GLint)(lodVertices.size() / 8),
+                                (GLuint)(level * instanceCount)});
+            lodErrors.push_back(lods[level].error * scale);
+            lodVertices.insert(lodVertices.end(), mesh.vertices, mesh.vertices + mesh.vertexCount * 8);
+            indices.insert(indices.end(), mesh.indices, mesh.indices + mesh.indexCount);
+        }
+        MeshView combined = {lodVertices.data(), lodVertices.size() / 8, nullptr, 0};
+        PackedVertexData packed = packVertices(combined, true);
+        positionScale = packed.positionScale * scale;
+        positionOffset = packed.positionOffset * scale;
+
+        vec3 boundsMin, boundsMax;
+        computeVertexBounds(lods[0].mesh, boundsMin, boundsMax);
+        boundsMin *= scale;
+        boundsMax *= scale;
+        vector<Instance> instances;
+        instances.reserve(models.size());
+        for (const mat4& model : models) {
+            vec3 worldMin, worldMax;
+            transformBounds(model, boundsMin, boundsMax, worldMin, worldMax);
+            instances.push_back({model, vec4(worldMin, 0.0f), vec4(worldMax, 0.0f)});
+        }
+
+        vao = createVertexArray();
+        vertexBuffer = createBuffer(packed.bytes.size(), packed.bytes.data());
+        indexBuffer = createBuffer(indices.size() * sizeof(uint32_t), indices.data());
+        visibleBuffer = createBuffer(commands.size() * instanceCount * sizeof(GLuint), nullptr, GL_DYNAMIC_COPY);
+        instanceBuffer = createBuffer(instances.size() * sizeof(Instance), instances.data());
+        commandBuffer = createBuffer(commands.size() * sizeof(DrawElementsIndirectCommand), commands.data(), GL_DYNAMIC_DRAW);
+        glBindVertexArray(vao.get());
+        glBindBuffer(GL_ARRAY_BUFFER, vertexBuffer.get());
+        setupVertexAttributes(VERTEX_PACKED_NORMAL, packed.texCoordType);
+        glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, indexBuffer.get());
+        glBindBuffer(GL_ARRAY_BUFFER, visibleBuffer.get());
+        glVertexAttribIPointer(3, 1, GL_UNSIGNED_INT, 0, (void*)0);
+        glEnableVertexAttribArray(3);
+        glVertexAttribDivisor(3, 1);
+        glBindVertexArray(0);
+        glBindBuffer(GL_ARRAY_BUFFER, 0);
+    }
+    GpuInstanceCuller(const GpuInstanceCuller&) = delete;
+    GpuInstanceCuller& operator=(const GpuInstanceCuller&) = delete;
+
+    static bool isSupported() {
+        if (!GLEW_VERSION_4_3) return false;
+        GLint vertexStorageBlocks = 0;
+        glGetIntegerv(GL_MAX_VERTEX_SHADER_STORAGE_BLOCKS, &vertexStorageBlocks);
+        return vertexStorageBlocks > 0;
+    }
+
+    void updateHiZ(const OcclusionCuller& occlusion, FrameArena& arena) {
+        int width = occlusion.getTilesX(), height = occlusion.getTilesY();
+        if (!hiZTexture) {
+            hiZLevels = 1;
+            while ((width >> hiZLevels) > 0 || (height >> hiZLevels) > 0) ++hiZLevels;
+            hiZTexture = createTexture();
+            glBindTexture(GL_TEXTURE_2D, hiZTexture.get());
+            glTexStorage2D(GL_TEXTURE_2D, hiZLevels, GL_R32F, width, height);
+        } else {
+            glBindTexture(GL_TEXTURE_2D, hiZTexture.get());
+        }
+        float* hiZDepths = arena.allocate<float>(width * height);
+        for (int ty = 0; ty < height; ++ty) {
+            for (int tx = 0; tx < width; ++tx) {
+                hiZDepths[ty * width + tx] = occlusion.getTileDepth(tx, ty);
+            }
+        }
+        glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, width, height, GL_RED, GL_FLOAT, hiZDepths);
+        for (int level = 1; level < hiZLevels; ++level) {
+            int nextWidth = std::max(1, width / 2), nextHeight = std::max(1, height / 2);
+            float* hiZReduced = arena.allocate<float>(nextWidth * nextHeight);
+            for (int y = 0; y < nextHeight; ++y) {
+                int lastY = y == nextHeight - 1 ? height - 1 : y * 2 + 1;
+                for (int x = 0; x < nextWidth; ++x) {
+                    int lastX = x == nextWidth - 1 ? width - 1 : x * 2 + 1;
+                    float depth = 0.0f;
+                    for (int sy = y * 2; sy <= lastY; ++sy) {
+                        for (int sx = x * 2; sx <= lastX; ++sx) {
+                            depth = std::max(depth, hiZDepths[sy * width + sx]);
+                        }
+                    }
+                    hiZReduced[y * nextWidth + x] = depth;
+                }
+            }
+            glTexSubImage2D(GL_TEXTURE_2D, level, 0, 0, nextWidth, nextHeight, GL_RED, GL_FLOAT, hiZReduced);
+            hiZDepths = hiZReduced;
+            width = nextWidth;
+            height = nextHeight;
+        }
+        glBindTexture(GL_TEXTURE_2D, 0);
+    }
+
+    void cull(Shader& shader, const mat4& viewProjection, const vec3& cameraPos, float fovY, int screenHeight,
+              bool occlusion, int hiZUnit = 12) {
+        glBindBuffer(GL_DRAW_INDIRECT_BUFFER, commandBuffer.get());
+        glBufferSubData(GL_DRAW_INDIRECT_BUFFER, 0, commands.size() * sizeof(DrawElementsIndirectCommand), commands.data());
+        glBindBuffer(GL_DRAW_INDIRECT_BUFFER, 0);
+
+        shader.use();
+        GLuint program = shader.getProgram();
+        Frustum frustum(viewProjection);
+        glUniform1ui(glGetUniformLocation(program, "instanceCount"), instanceCount);
+        glUniform4fv(glGetUniformLocation(program, "frustumPlanes"), 6, value_ptr(frustum.planes[0]));
+        glUniformMatrix4fv(glGetUniformLocation(program, "viewProjection"), 1, GL_FALSE, value_ptr(viewProjection));
+        glUniform3fv(glGetUniformLocation(program, "cameraPos"), 1, value_ptr(cameraPos));
+        glUniform1f(glGetUniformLocation(program, "pixelsPerUnitScale"), screenHeight / (2.0f * tanf(fovY * 0.5f)));
+        glUniform1fv(glGetUniformLocation(program, "lodErrors"), lodErrors.size(), lodErrors.data());
+        glUniform1i(glGetUniformLocation(program, "lodCount"), lodErrors.size());
+        glUniform1i(glGetUniformLocation(program, "hiZEnabled"), occlusion && hiZTexture);
+        glActiveTexture(GL_TEXTURE0 + hiZUnit);
+        glBindTexture(GL_TEXTURE_2D, hiZTexture.get());
+        glActiveTexture(GL_TEXTURE0);
+        glUniform1i(glGetUniformLocation(program, "hiZ"), hiZUnit);
+        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, instanceBuffer.get());
+        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 1, commandBuffer.get());
+        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 2, visibleBuffer.get());
+        glDispatchCompute((instanceCount + 63) / 64, 1, 1);
+        glMemoryBarrier(GL_COMMAND_BARRIER_BIT | GL_VERTEX_ATTRIB_ARRAY_BARRIER_BIT);
+    }
+
+    void draw(Shader& shader, const mat4& viewProjection, const mat4& previousViewProjection) {
+        shader.use();
+        GLuint program = shader.getProgram();
+        glUniformMatrix4fv(glGetUniformLocation(program, "viewProjection"), 1, GL_FALSE, value_ptr(viewProjection));
+        glUniformMatrix4fv(glGetUniformLocation(program, "previousViewProjection"), 1, GL_FALSE, value_ptr(previousViewProjection));
+        setPositionDecode(shader, positionScale, positionOffset);
+        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, instanceBuffer.get());
+        glBindVertexArray(vao.get());
+        glBindBuffer(GL_DRAW_INDIRECT_BUFFER, commandBuffer.get());
+        glMultiDrawElementsIndirect(GL_TRIANGLES, GL_UNSIGNED_INT, nullptr, commands.size(), 0);
+        glBindBuffer(GL_DRAW_INDIRECT_BUFFER, 0);
+        glBindVertexArray(0);
+    }
+
+private:
+    struct Instance {
+        mat4 model;
+        vec4 boundsMin;
+        vec4 boundsMax;
+    };
+
+    GLuint instanceCount;
+    vector<DrawElementsIndirectCommand> commands;
+    vector<float> lodErrors;
+    vec3 positionScale;
+    vec3 positionOffset;
+    VertexArrayResource vao;
+    BufferResource vertexBuffer, indexBuffer, visibleBuffer, instanceBuffer, commandBuffer;
+    TextureResource hiZTexture;
+    int hiZLevels = 0;
+};
+
+struct SceneObject {
+    function<DrawGeometry(int)> geometry;
+    mat4 model;
+    mat4 previousModel;
+    vec3 boundsMin;
+    vec3 boundsMax;
+    int textureIndex;
+    int lightmapBase;
+    float lodScale;
+    bool occluder = false;
+    function<int(float)> selectLod;
+    int lod = 0;
+};
+
+void selectLods(vector<SceneObject>& objects, const vec3& cameraPos, float fovY, int screenHeight) {
+    for (SceneObject& object : objects) {
+        if (!object.selectLod) continue;
+        vec3 worldMin, worldMax;
+        transformBounds(object.model, object.boundsMin, object.boundsMax, worldMin, worldMax);
+        object.lod = object.selectLod(object.lodScale * projectedPixelsPerUnit(cameraPos, (worldMin + worldMax) * 0.5f, fovY, screenHeight));
+    }
+}
+
+struct DrawPacket {
+    const Pipeline* pipeline;
+    DrawGeometry geometry;
+    mat4 transform;
+    mat4 model;
+    mat4 previousTransform;
+    int textureIndex;
+    int lightmapBase;
+};
+
+class CommandList {
+public:
+    void begin(DrawPacket* packetStorage, uint64_t* keyStorage, size_t firstPacket) {
+        packets = packetStorage;
+        keys = keyStorage;
+        base = firstPacket;
+        count = 0;
+    }
+
+    void add(int shaderId, float normalizedDepth, const DrawPacket& packet) {
+        uint64_t depth = (uint64_t)(std::clamp(normalizedDepth, 0.0f, 1.0f) * 0xFFFFFF);
+        keys[count] = (uint64_t)(shaderId & 0xFF) << 56 | depth << 32
+                      | (uint64_t)(packet.textureIndex & 0xFFF) << 20 | (base + count);
+        packets[count++] = packet;
+    }
+
+    const uint64_t* getKeys() const {
+        return keys;
+    }
+    size_t getCount() const {
+        return count;
+    }
+
+private:
+    DrawPacket* packets = nullptr;
+    uint64_t* keys = nullptr;
+    size_t base = 0;
+    size_t count = 0;
+};
+
+class RenderQueue {
+public:
+    RenderQueue(float maxDepth = 200.0f, size_t minObjectsPerList = 64)
+        : maxDepth(maxDepth), minObjectsPerList(minObjectsPerList), lists(std::max(1u, thread::hardware_concurrency())) {}
+
+    void record(const vector<SceneObject>& objects, const Pipeline& pipeline, const mat4& viewProjection,
+                const mat4& previousViewProjection, const vec3& cameraPos, FrameArena& arena,
+                const OcclusionCuller* occlusion = nullptr, const PortalVisibility* portals = nullptr) {
+        Frustum frustum(viewProjection);
+        size_t listCount = std::clamp<size_t>(objects.size() / minObjectsPerList, 1, lists.size());
+        packets = arena.allocate<DrawPacket>(objects.size());
+        keys = arena.allocate<uint64_t>(objects.size());
+        scratch = arena.allocate<uint64_t>(objects.size());
+        for (size_t l = 0; l < listCount; ++l) {
+            size_t first = objects.size() * l / listCount;
+            lists[l].begin(packets + first, keys + first, first);
+        }
+        parallelFor(listCount, [&](size_t firstList, size_t lastList) {
+            for (size_t l = firstList; l < lastList; ++l) {
+                CommandList& list = lists[l];
+                for (size_t i = objects.size() * l / listCount; i < objects.size() * (l + 1) / listCount; ++i) {
+                    const SceneObject& object = objects[i];
+                    vec3 worldMin, worldMax;
+                    transformBounds(object.model, object.boundsMin, object.boundsMax, worldMin, worldMax);
+                    if (!frustum.intersects(worldMin, worldMax)) continue;
+                    if (portals && !portals->isVisible(worldMin, worldMax)) continue;
+                    if (occlusion && !object.occluder && !occlusion->isVisible(viewProjection, worldMin, worldMax)) continue;
+                    vec3 nearest = glm::clamp(cameraPos, worldMin, worldMax);
+                    float distance = nearest == cameraPos ? length(glm::max(cameraPos - worldMin, worldMax - cameraPos))
+                                                          : length(cameraPos - nearest);
+                    list.add(pipeline.getId(), distance / maxDepth,
+                             {&pipeline, object.geometry(object.lod), viewProjection * object.model, object.model,
+                              previousViewProjection * object.previousModel, object.textureIndex, object.lightmapBase});
+                }
+            }
+        });
+        merge(listCount);
+        sort();
+    }
+
+    void replay(const Pipeline* overridePipeline = nullptr) const {
+        const Pipeline* currentPipeline = nullptr;
+        GLuint currentProgram = 0, currentVAO = 0;
+        GLint locations[7] = {-1, -1, -1, -1, -1, -1, -1};
+        for (size_t k = 0; k < keyCount; ++k) {
+            uint64_t key = keys[k];
+            const DrawPacket& packet = packets[key & 0xFFFFF];
+            const Pipeline* pipeline = overridePipeline ? overridePipeline : packet.pipeline;
+            if (pipeline != currentPipeline) {
+                currentPipeline = pipeline;
+                pipeline->bind();
+            }
+            GLuint program = pipeline->getShader().getProgram();
+            if (program != currentProgram) {
+                currentProgram = program;
+                const char* names[7] = {"transform", "model", "previousTransform", "positionScale", "positionOffset", "textureIndex", "lightmapBase"};
+                for (int i = 0; i < 7; ++i) {
+                    locations[i] = glGetUniformLocation(program, names[i]);
+                }
+            }
+            if (packet.geometry.vao != currentVAO) {
+                currentVAO = packet.geometry.vao;
+                glBindVertexArray(currentVAO);
+            }
+            glUniformMatrix4fv(locations[0], 1, GL_FALSE, value_ptr(packet.transform));
+            glUniformMatrix4fv(locations[1], 1, GL_FALSE, value_ptr(packet.model));
+            glUniformMatrix4fv(locations[2], 1, GL_FALSE, value_ptr(packet.previousTransform));
+            glUniform3fv(locations[3], 1, value_ptr(packet.geometry.positionScale));
+            glUniform3fv(locations[4], 1, value_ptr(packet.geometry.positionOffset));
+            glUniform1i(locations[5], packet.textureIndex);
+            glUniform1i(locations[6], packet.lightmapBase);
+            drawGeometry(packet.geometry);
+        }
+        glBindVertexArray(0);
+    }
+
+private:
+    float maxDepth;
+    size_t minObjectsPerList;
+    vector<CommandList> lists;
+    DrawPacket* packets = nullptr;
+    uint64_t* keys = nullptr;
+    uint64_t* scratch = nullptr;
+    size_t keyCount = 0;
+
+    void merge(size_t listCount) {
+        keyCount = 0;
+        for (size_t l = 0; l < listCount; ++l) {
+            memmove(keys + keyCount, lists[l].getKeys(), lists[l].getCount() * sizeof(uint64_t));
+            keyCount += lists[l].getCount();
+        }
+    }
+
+    void sort() {
+        for (int shift = 0; shift < 64; shift += 8) {
+            size_t counts[256] = {0};
+            for (size_t k = 0; k < keyCount; ++k) counts[(keys[k] >> shift) & 0xFF]++;
+            if (counts[(keyCount == 0 ? 0 : keys[0] >> shift) & 0xFF] == keyCount) continue;
+            size_t offset = 0;
+            for (size_t& count : counts) {
+                size_t bucket = count;
+                count = offset;
+                offset += bucket;
+            }
+            for (size_t k = 0; k < keyCount; ++k) scratch[counts[(keys[k] >> shift) & 0xFF]++] = keys[k];
+            std::swap(keys, scratch);
+        }
+    }
+};
+
+struct RayPacket {
+    Float4 origin[3];
+    Float4 direction[3];
+    Float4 inverseDirection[3];
+    Float4 hitT;
+    int hitTriangle[4];
+    int active;
+
+    RayPacket() : hitTriangle{-1, -1, -1, -1}, active(0) {}
+
+    void set(int lane, const vec3& o, const vec3& d, float maxDistance) {
+        float* lanes[9];
+        for (int axis = 0; axis < 3; ++axis) {
+            lanes[axis] = reinterpret_cast<float*>(&origin[axis]);
+            lanes[3 + axis] = reinterpret_cast<float*>(&direction[axis]);
+            lanes[6 + axis] = reinterpret_cast<float*>(&inverseDirection[axis]);
+        }
+        for (int axis = 0; axis < 3; ++axis) {
+            lanes[axis][lane] = o[axis];
+            lanes[3 + axis][lane] = d[axis];
+            lanes[6 + axis][lane] = 1.0f / (fabsf(d[axis]) > 1e-12f ? d[axis] : 1e-12f);
+        }
+        reinterpret_cast<float*>(&hitT)[lane] = maxDistance;
+        hitTriangle[lane] = -1;
+        active |= 1 << lane;
+    }
+};
+
+class RayTracer {
+public:
+    void addTriangle(const vec3& a, const vec3& b, const vec3& c, bool castsSunShadow) {
+        triangles.push_back({a, b - a, c - a, castsSunShadow});
+    }
+
+    void build() {
+        vector<int> order(triangles.size());
+        for (size_t i = 0; i < order.size(); ++i) order[i] = i;
+        nodes.clear();
+        if (triangles.empty()) return;
+        nodes.reserve(triangles.size() * 2 + 1);
+        nodes.push_back(Node());
+        buildNode(order, 0, order.size(), 0);
+        vector<Triangle> sorted;
+        for (int index : order) sorted.push_back(triangles[index]);
+        triangles = move(sorted);
+    }
+
+    vec3 getNormal(int triangle) const {
+        return normalize(cross(triangles[triangle].edge1, triangles[triangle].edge2));
+    }
+
+    void trace(RayPacket& packet, bool shadowRays) const {
+        if (nodes.empty() || !packet.active) return;
+        int stack[64];
+        int stackSize = 0;
+        stack[stackSize++] = 0;
+        Float4 activeMask = laneMask(packet.active);
+        while (stackSize > 0) {
+            const Node& node = nodes[stack[--stackSize]];
+            Float4 tNear(0.0f), tFar = packet.hitT;
+            for (int axis = 0; axis < 3; ++axis) {
+                Float4 t0 = (Float4(node.boundsMin[axis]) - packet.origin[axis]) * packet.inverseDirection[axis];
+                Float4 t1 = (Float4(node.boundsMax[axis]) - packet.origin[axis]) * packet.inverseDirection[axis];
+                tNear = max4(tNear, min4(t0, t1));
+                tFar = min4(tFar, max4(t0, t1));
+            }
+            if (!mask4((tNear <= tFar) & activeMask)) continue;
+            if (node.count == 0) {
+                stack[stackSize++] = node.first + 1;
+                stack[stackSize++] = node.first;
+                continue;
+            }
+            for (int i = node.first; i < node.first + node.count; ++i) {
+                const Triangle& tri = triangles[i];
+                if (shadowRays && !tri.castsSunShadow) continue;
+                intersect(packet, tri, i, activeMask);
+            }
+            if (shadowRays) {
+                int hitLanes = 0;
+                for (int lane = 0; lane < 4; ++lane) hitLanes |= (packet.hitTriangle[lane] >= 0) << lane;
+                packet.active &= ~hitLanes;
+                activeMask = laneMask(packet.active);
+                if (!packet.active) return;
+            }
+        }
+    }
+
+private:
+    struct Triangle {
+        vec3 v0, edge1, edge2;
+        bool castsSunShadow;
+    };
+    struct Node {
+        vec3 boundsMin, boundsMax;
+        int first;
+        int count;
+    };
+    vector<Triangle> triangles;
+    vector<Node> nodes;
+
+    static Float4 laneMask(int active) {
+        Float4 all = Float4(0.0f) <= Float4(0.0f);
+        Float4 none(0.0f);
+        return Float4(active & 1 ? all[0] : none[0], active & 2 ? all[1] : none[1], active & 4 ? all[2] : none[2], active & 8 ? all[3] : none[3]);
+    }
+
+    void buildNode(vector<int>& order, size_t begin, size_t end, int index) {
+        vec3 boundsMin(numeric_limits<float>::max()), boundsMax(-numeric_limits<float>::max());
+        vec3 centroidMin = boundsMin, centroidMax = boundsMax;
+        for (size_t i = begin; i < end; ++i) {
+            const Triangle& tri = triangles[order[i]];
+            vec3 corners[3] = {tri.v0, tri.v0 + tri.edge1, tri.v0 + tri.edge2};
+            for (const vec3& corner : corners) {
+                boundsMin = glm::min(boundsMin, corner);
+                boundsMax = glm::max(boundsMax, corner);
+            }
+            centroidMin = glm::min(centroidMin, centroid(tri));
+            centroidMax = glm::max(centroidMax, centroid(tri));
+        }
+        nodes[index].boundsMin = boundsMin - vec3(1e-4f);
+        nodes[index].boundsMax = boundsMax + vec3(1e-4f);
+        if (end - begin <= 4) {
+            nodes[index].first = begin;
+            nodes[index].count = end - begin;
+            return;
+        }
+        vec3 extent = centroidMax - centroidMin;
+        int axis = extent.x > extent.y ? (extent.x > extent.z ? 0 : 2) : (extent.y > extent.z ? 1 : 2);
+        size_t middle = (begin + end) / 2;
+        nth_element(order.begin() + begin, order.begin() + middle, order.begin() + end, [&](int a, int b) {
+            return centroid(triangles[a])[axis] < centroid(triangles[b])[axis];
+        });
+        int left = nodes.size();
+        nodes[index].first = left;
+        nodes[index].count = 0;
+        nodes.push_back(Node());
+        nodes.push_back(Node());
+        buildNode(order, begin, middle, left);
+        buildNode(order, middle, end, left + 1);
+    }
+
+    static vec3 centroid(const Triangle& tri) {
+        return tri.v0 + (tri.edge1 + tri.edge2) * (1.0f / 3.0f);
+    }
+
+    static void intersect(RayPacket& packet, const Triangle& tri, int index, Float4 activeMask) {
+        Float4 e1[3] = {Float4(tri.edge1.x), Float4(tri.edge1.y), Float4(tri.edge1.z)};
+        Float4 e2[3] = {Float4(tri.edge2.x), Float4(tri.edge2.y), Float4(tri.edge2.z)};
+        const Float4* d = packet.direction;
+        Float4 p[3] = {d[1] * e2[2] - d[2] * e2[1], d[2] * e2[0] - d[0] * e2[2], d[0] * e2[1] - d[1] * e2[0]};
+        Float4 det = e1[0] * p[0] + e1[1] * p[1] + e1[2] * p[2];
+        Float4 inverseDet = Float4(1.0f) / select4(abs4(det) > Float4(1e-12f), det, Float4(1.0f));
+        Float4 s[3] = {packet.origin[0] - Float4(tri.v0.x), packet.origin[1] - Float4(tri.v0.y), packet.origin[2] - Float4(tri.v0.z)};
+        Float4 u = (s[0] * p[0] + s[1] * p[1] + s[2] * p[2]) * inverseDet;
+        Float4 q[3] = {s[1] * e1[2] - s[2] * e1[1], s[2] * e1[0] - s[0] * e1[2], s[0] * e1[1] - s[1] * e1[0]};
+        Float4 v = (d[0] * q[0] + d[1] * q[1] + d[2] * q[2]) * inverseDet;
+        Float4 t = (e2[0] * q[0] + e2[1] * q[1] + e2[2] * q[2]) * inverseDet;
+        Float4 hit = activeMask & (abs4(det) > Float4(1e-12f)) & (u >= Float4(0.0f)) & (v >= Float4(0.0f))
+                   & (u + v <= Float4(1.0f)) & (t > Float4(1e-4f)) & (t < packet.hitT);
+        int hitMask = mask4(hit);
+        if (!hitMask) return;
+        packet.hitT = select4(hit, t, packet.hitT);
+        for (int lane = 0; lane < 4; ++lane) {
+            if (hitMask & (1 << lane)) packet.hitTriangle[lane] = index;
+        }
+    }
+};
+
+struct BakeMesh {
+    vector<float> vertices;
+    mat4 model;
+    bool lightmapped;
+    bool castsSunShadow;
+    bool twoSided = false;
+
+    int lightmapLayerCount() const {
+        return lightmapped ? vertices.size() / 30 * (twoSided ? 2 : 1) : 0;
+    }
+};
+
+struct LightmapData {
+    int resolution = 0;
+    int quadCount = 0;
+    int keyframeCount = 0;
+    uint64_t hash = 0;
+    vector<float> texels;
+
+    bool load(const char* path, uint64_t expectedHash) {
+        FILE* file = fopen(path, "rb");
+        if (!file) return false;
+        char magic[4];
+        int header[3];
+        uint64_t fileHash;
+        bool ok = fread(magic, 1, 4, file) == 4 && memcmp(magic, "LMAP", 4) == 0
+               && fread(header, sizeof(int), 3, file) == 3 && fread(&fileHash, sizeof(fileHash), 1, file) == 1
+               && fileHash == expectedHash && header[0] > 0 && header[1] > 0 && header[2] > 0;
+        if (ok) {
+            resolution = header[0];
+            quadCount = header[1];
+            keyframeCount = header[2];
+            hash = fileHash;
+            texels.resize((size_t)resolution * resolution * quadCount * keyframeCount * 2);
+            ok = fread(texels.data(), sizeof(float), texels.size(), file) == texels.size();
+        }
+        fclose(file);
+        return ok;
+    }
+
+    bool save(const char* path) const {
+        string temporary = string(path) + ".tmp";
+        FILE* file = fopen(temporary.c_str(), "wb");
+        if (!file) return false;
+        int header[3] = {resolution, quadCount, keyframeCount};
+        bool ok = fwrite("LMAP", 1, 4, file) == 4 && fwrite(header, sizeof(int), 3, file) == 3
+               && fwrite(&hash, sizeof(hash), 1, file) == 1
+               && fwrite(texels.data(), sizeof(float), texels.size(), file) == texels.size();
+        ok = fclose(file) == 0 && ok;
+        return ok && rename(temporary.c_str(), path) == 0;
+    }
+};
+
+class LightmapBaker {
+public:
+    LightmapBaker(int resolution = 64, int samples = 32, float aoRadius = 8.0f, float albedo = 0.5f)
+        : resolution(resolution), samples(samples), aoRadius(aoRadius), albedo(albedo) {}
+
+    void addMesh(const BakeMesh& mesh) {
+        meshes.push_back(mesh);
+    }
+
+    uint64_t hash(const vector<vec3>& sunDirections) const {
+        uint64_t h = 1469598103934665603ull;
+        auto mix = [&](const void* data, size_t size) {
+            const unsigned char* bytes = static_cast<const unsigned char*>(data);
+            for (size_t i = 0; i < size; ++i) h = (h ^ bytes[i]) * 1099511628211ull;
+        };
+        int settings[2] = {resolution, samples};
+        float parameters[2] = {aoRadius, albedo};
+        mix(settings, sizeof(settings));
+        mix(parameters, sizeof(parameters));
+        for (const BakeMesh& mesh : meshes) {
+            mix(mesh.vertices.data(), mesh.vertices.size() * sizeof(float));
+            mix(value_ptr(mesh.model), 16 * sizeof(float));
+            bool flags[3] = {mesh.lightmapped, mesh.castsSunShadow, mesh.twoSided};
+            mix(flags, sizeof(flags));
+        }
+        for (const vec3& direction : sunDirections) mix(value_ptr(direction), 3 * sizeof(float));
+        return h;
+    }
+
+    LightmapData bake(const vector<vec3>& sunDirections, const vec3& interiorPoint) {
+        RayTracer tracer;
+        vector<Quad> quads;
+        for (const BakeMesh& mesh : meshes) {
+            size_t count = mesh.vertices.size() / 5;
+            for (size_t i = 0; i + 2 < count; i += 3) {
+                vec3 corners[3];
+                for (int k = 0; k < 3; ++k) {
+                    const float* v = &mesh.vertices[(i + k) * 5];
+                    corners[k] = vec3(mesh.model * vec4(v[0], v[1], v[2], 1.0f));
+                }
+                tracer.addTriangle(corners[0], corners[1], corners[2], mesh.castsSunShadow);
+            }
+            if (!mesh.lightmapped) continue;
+            for (size_t i = 0; i + 5 < count; i += 6) {
+                Quad quad;
+                for (int k = 0; k < 6; ++k) {
+                    const float* v = &mesh.vertices[(i + k) * 5];
+                    quad.positions[k] = vec3(mesh.model * vec4(v[0], v[1], v[2], 1.0f));
+                    quad.uvs[k] = vec2(v[3], v[4]);
+                }
+                quad.normal = normalize(cross(quad.positions[1] - quad.positions[0], quad.positions[2] - quad.positions[0]));
+                if (mesh.twoSided) {
+                    quads.push_back(quad);
+                    quad.normal = -quad.normal;
+                } else if (dot(quad.normal, interiorPoint - quad.positions[0]) < 0.0f) {
+                    quad.normal = -quad.normal;
+                }
+                quads.push_back(quad);
+            }
+        }
+        tracer.build();
+
+        LightmapData data;
+        data.resolution = resolution;
+        data.quadCount = quads.size();
+        data.keyframeCount = sunDirections.size();
+        data.hash = hash(sunDirections);
+        size_t layerSize = (size_t)resolution * resolution * 2;
+        data.texels.assign(layerSize * quads.size() * sunDirections.size(), 0.0f);
+
+        size_t rows = quads.size() * resolution;
+        parallelFor(rows, [&](size_t firstRow, size_t lastRow) {
+            for (size_t row = firstRow; row < lastRow; ++row) {
+                int quadIndex = row / resolution, y = row % resolution;
+                for (int x = 0; x < resolution; ++x) {
+                    vec2 uv((x + 0.5f) / resolution, (y + 0.5f) / resolution);
+                    vec3 position;
+                    if (!quads[quadIndex].locate(uv, position)) continue;
+                    bakeTexel(tracer, quads[quadIndex], position, sunDirections, data, quadIndex, x, y);
+                }
+            }
+        });
+        return data;
+    }
+
+private:
+    struct Quad {
+        vec3 positions[6];
+        vec2 uvs[6];
+        vec3 normal;
+
+        bool locate(const vec2& uv, vec3& position) const {
+            for (int t = 0; t < 2; ++t) {
+                const vec2* p = &uvs[t * 3];
+                float det = (p[1].x - p[0].x) * (p[2].y - p[0].y) - (p[2].x - p[0].x) * (p[1].y - p[0].y);
+                if (fabsf(det) < 1e-12f) continue;
+                float b1 = ((uv.x - p[0].x) * (p[2].y - p[0].y) - (p[2].x - p[0].x) * (uv.y - p[0].y)) / det;
+                float b2 = ((p[1].x - p[0].x) * (uv.y - p[0].y) - (uv.x - p[0].x) * (p[1].y - p[0].y)) / det;
+                if (b1 < -1e-4f || b2 < -1e-4f || b1 + b2 > 1.0f + 1e-4f) continue;
+                const vec3* q = &positions[t * 3];
+                position = q[0] + (q[1] - q[0]) * b1 + (q[2] - q[0]) * b2;
+                return true;
+            }
+            return false;
+        }
+    };
+
+    int resolution;
+    int samples;
+    float aoRadius;
+    float albedo;
+    vector<BakeMesh> meshes;
+
+    static float radicalInverse(uint32_t bits) {
+        bits = (bits << 16u) | (bits >> 16u);
+        bits = ((bits & 0x55555555u) << 1u) | ((bits & 0xAAAAAAAAu) >> 1u);
+        bits = ((bits & 0x33333333u) << 2u) | ((bits & 0xCCCCCCCCu) >> 2u);
+        bits = ((bits & 0x0F0F0F0Fu) << 4u) | ((bits & 0xF0F0F0F0u) >> 4u);
+        bits = ((bits & 0x00FF00FFu) << 8u) | ((bits & 0xFF00FF00u) >> 8u);
+        return bits * 2.3283064365386963e-10f;
+    }
+
+    static float hashToUnit(uint32_t value) {
+        value ^= value >> 16;
+        value *= 0x7feb352du;
+        value ^= value >> 15;
+        value *= 0x846ca68bu;
+        value ^= value >> 16;
+        return value * 2.3283064365386963e-10f;
+    }
+
+    void bakeTexel(const RayTracer& tracer, const Quad& quad, const vec3& position, const vector<vec3>& sunDirections,
+                   LightmapData& data, int quadIndex, int x, int y) const {
+        vec3 n = quad.normal;
+        vec3 tangent = normalize(fabsf(n.x) > 0.5f ? cross(n, vec3(0.0f, 1.0f, 0.0f)) : cross(n, vec3(1.0f, 0.0f, 0.0f)));
+        vec3 bitangent = cross(n, tangent);
+        vec3 origin = position + n * 1e-3f;
+        uint32_t seed = (quadIndex * 73856093u) ^ (x * 19349663u) ^ (y * 83492791u);
+        float rotationU = hashToUnit(seed), rotationV = hashToUnit(seed + 1);
+        size_t keyframes = sunDirections.size();
+
+        int openSamples = 0;
+        vector<float> bounce(keyframes, 0.0f);
+        for (int first = 0; first < samples; first += 4) {
+            RayPacket packet;
+            vec3 hitNormals[4];
+            for (int lane = 0; lane < 4 && first + lane < samples; ++lane) {
+                float u = fmodf((first + lane + 0.5f) / samples + rotationU, 1.0f);
+                float v = fmodf(radicalInverse(first + lane) + rotationV, 1.0f);
+                float r = sqrtf(u), phi = 2.0f * M_PI * v;
+                vec3 direction = tangent * (r * cosf(phi)) + bitangent * (r * sinf(phi)) + n * sqrtf(std::max(0.0f, 1.0f - u));
+                packet.set(lane, origin, direction, 1e30f);
+            }
+            int lanes = packet.active;
+            tracer.trace(packet, false);
+
+            for (size_t key = 0; key < keyframes; ++key) {
+                RayPacket shadow;
+                vec3 sun = normalize(sunDirections[key]);
+                for (int lane = 0; lane < 4; ++lane) {
+                    if (!(lanes & (1 << lane)) || packet.hitTriangle[lane] < 0) continue;
+                    vec3 hitNormal = tracer.getNormal(packet.hitTriangle[lane]);
+                    vec3 direction(packet.direction[0][lane], packet.direction[1][lane], packet.direction[2][lane]);
+                    if (dot(hitNormal, direction) > 0.0f) hitNormal = -hitNormal;
+                    hitNormals[lane] = hitNormal;
+                    float cosine = dot(hitNormal, sun);
+                    if (cosine <= 0.0f) continue;
+                    vec3 hitPoint = origin + direction * packet.hitT[lane] + hitNormal * 1e-3f;
+                    shadow.set(lane, hitPoint, sun, 1e30f);
+                }
+                int shadowLanes = shadow.active;
+                tracer.trace(shadow, true);
+                for (int lane = 0; lane < 4; ++lane) {
+                    if ((shadowLanes & (1 << lane)) && shadow.hitTriangle[lane] < 0) {
+                        bounce[key] += albedo * dot(hitNormals[lane], sun);
+                    }
+                }
+            }
+            for (int lane = 0; lane < 4; ++lane) {
+                if ((lanes & (1 << lane)) && (packet.hitTriangle[lane] < 0 || packet.hitT[lane] > aoRadius)) openSamples++;
+            }
+        }
+        float ambient = (float)openSamples / samples;
+
+        for (size_t first = 0; first < keyframes; first += 4) {
+            RayPacket shadow;
+            for (size_t key = first; key < first + 4 && key < keyframes; ++key) {
+                vec3 sun = normalize(sunDirections[key]);
+                if (dot(n, sun) > 0.0f) shadow.set(key - first, origin, sun, 1e30f);
+            }
+            int shadowLanes = shadow.active;
+            tracer.trace(shadow, true);
+            for (size_t key = first; key < first + 4 && key < keyframes; ++key) {
+                int lane = key - first;
+                float direct = (shadowLanes & (1 << lane)) && shadow.hitTriangle[lane] < 0 ? dot(n, normalize(sunDirections[key])) : 0.0f;
+                float* texel = &data.texels[((key * data.quadCount + quadIndex) * (size_t)resolution * resolution + (size_t)y * resolution + x) * 2];
+                texel[0] = 0.6f * ambient + 0.4f * bounce[key] / samples;
+                texel[1] = direct;
+            }
+        }
+    }
+};
+
+class Lightmaps {
+public:
+    Lightmaps(const LightmapData& data) : quadCount(data.quadCount), keyframeCount(data.keyframeCount) {
+        texture = createTexture();
+        glBindTexture(GL_TEXTURE_2D_ARRAY, texture.get());
+        glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+        glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+        glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+        glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+        glTexImage3D(GL_TEXTURE_2D_ARRAY, 0, GL_RG16F, data.resolution, data.resolution, data.quadCount * data.keyframeCount,
+                     0, GL_RG, GL_FLOAT, data.texels.data());
+        glBindTexture(GL_TEXTURE_2D_ARRAY, 0);
+    }
+
+    void bind(Shader& shader, float dayPhase, int unit = 5) {
+        float position = dayPhase * keyframeCount;
+        int first = (int)floorf(position) % keyframeCount;
+        GLuint program = shader.getProgram();
+        glActiveTexture(GL_TEXTURE0 + unit);
+        glBindTexture(GL_TEXTURE_2D_ARRAY, texture.get());
+        glActiveTexture(GL_TEXTURE0);
+        glUniform1i(glGetUniformLocation(program, "lightmaps"), unit);
+        glUniform1i(glGetUniformLocation(program, "lightmapQuadCount"), quadCount);
+        glUniform2i(glGetUniformLocation(program, "lightmapKeyframes"), first, (first + 1) % keyframeCount);
+        glUniform1f(glGetUniformLocation(program, "lightmapBlend"), position - floorf(position));
+    }
+
+private:
+    TextureResource texture;
+    int quadCount;
+    int keyframeCount;
+};
+
+vector<BakeMesh> staticBakeScene() {
+    mat4 floorModel = translate(mat4(1.0f), vec3(0.0f, -1.0f, 0.0f));
+    mat4 cubeModel = translate(mat4(1.0f), vec3(5, 13.2, 0));
+    mat4 pyramidModel = translate(mat4(1.0f), vec3(-5.0f, 12.2f, 0.0f)) * rotate(mat4(1.0f), radians(180.0f), vec3(0, 1, 0));
+    auto triangles = [](const auto& table) {
+        return vector<float>(table.begin(), table.end());
+    };
+    return {
+        {triangles(planeTriangles), floorModel, true, false},
+        {triangles(secondPlaneTriangles), floorModel, true, true, true},
+        {triangles(wallTriangles), mat4(1.0f), true, false},
+        {triangles(ceilingTriangles), mat4(1.0f), true, false},
+        {triangles(cubeTriangles), cubeModel, false, true},
+        {triangles(pyramidTriangles), pyramidModel, false, true},
+    };
+}
 
-void key_callback(GLFWwindow* window, int key, int scancode, int action, int mods) {
-    if (key == GLFW_KEY_ESCAPE && action == GLFW_PRESS) {
-        glfwSetWindowShouldClose(window, true);
+vector<vec3> lightmapSunDirections(int keyframeCount) {
+    vector<vec3> directions;
+    for (int i = 0; i < keyframeCount; ++i) {
+        float angle = i * 2.0f * M_PI / keyframeCount;
+        directions.push_back(vec3(cosf(angle), sinf(angle), 0.0f));
     }
+    return directions;
 }
 
-void mouse_callback(GLFWwindow* window, double xposIn, double yposIn) {
-    if (firstMouse) {
-        lastX = xposIn;
-        lastY = yposIn;
-        firstMouse = false;
+LightmapData loadOrBakeLightmaps(const vector<BakeMesh>& scene, const char* cachePath, bool forceBake) {
+    LightmapBaker baker;
+    for (const BakeMesh& mesh : scene) {
+        baker.addMesh(mesh);
     }
-    double xoffset = xposIn - lastX;
-    double yoffset = lastY - yposIn;
-    lastX = xposIn;
-    lastY = yposIn;
-    float sensitivity = 0.1;
-    xoffset *= sensitivity;
-    yoffset *= sensitivity;
-    zalfa -= xoffset; 
-    alfa -= yoffset; 
-    if (alfa > 89.0f) alfa = 89.0f; 
-    if (alfa < -89.0f) alfa = -89.0f;
+    vector<vec3> sunDirections = lightmapSunDirections(8);
+    LightmapData data;
+    if (!forceBake && data.load(cachePath, baker.hash(sunDirections))) {
+        return data;
+    }
+    cout << "Baking lightmaps on " << std::max(1u, thread::hardware_concurrency()) << " threads..." << endl;
+    data = baker.bake(sunDirections, vec3(0.0f, 25.0f, 0.0f));
+    if (!data.save(cachePath)) {
+        cerr << "error with save lightmaps: " << cachePath << endl;
+    }
+    return data;
 }
 
-class Shader {
+
+class MappedFile {
 public:
-    Shader(const char* vertexSource, const char* fragmentSource) {
-        GLuint vertexShader = compileShader(GL_VERTEX_SHADER, vertexSource);
-        GLuint fragmentShader = compileShader(GL_FRAGMENT_SHADER, fragmentSource);
-        program = glCreateProgram();
-        glAttachShader(program, vertexShader);
-        glAttachShader(program, fragmentShader);
-        glLinkProgram(program);
-        glDeleteShader(vertexShader);
-        glDeleteShader(fragmentShader);
-        checkProgram(program);
+    MappedFile(const char* path) {
+        int fd = open(path, O_RDONLY);
+        if (fd < 0) {
+            throw runtime_error(string("cannot open ") + path);
+        }
+        struct stat st;
+        if (fstat(fd, &st) != 0) {
+            close(fd);
+            throw runtime_error(string("cannot stat ") + path);
+        }
+        size = st.st_size;
+        if (size > 0) {
+            void* mapped = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (mapped == MAP_FAILED) {
+                close(fd);
+                throw runtime_error(string("cannot map ") + path);
+            }
+            data = static_cast<const char*>(mapped);
+            madvise(mapped, size, MADV_SEQUENTIAL);
+        }
+        close(fd);
     }
-    ~Shader() {
-        glDeleteProgram(program);
+    ~MappedFile() {
+        if (data) munmap(const_cast<char*>(data), size);
     }
-    void use() {
-        glUseProgram(program);
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+    const char* getData() const {
+        return data;
     }
-    GLuint getProgram() const {
-        return program;
+    size_t getSize() const {
+        return size;
     }
 private:
-    GLuint program;
-    GLuint compileShader(GLenum type, const char* src) {
-        GLuint shader = glCreateShader(type);
-        glShaderSource(shader, 1, &src, nullptr);
-        glCompileShader(shader);
-        checkShader(shader);
-        return shader;
+    const char* data = nullptr;
+    size_t size = 0;
+};
+
+struct MeshData {
+    vector<float> vertices;
+    vec3 boundsMin = vec3(0.0f);
+    vec3 boundsMax = vec3(0.0f);
+    int getVertexCount() const {
+        return vertices.size() / 5;
     }
-    void checkShader(GLuint shader) {
-        GLint success;
-        glGetShaderiv(shader, GL_COMPILE_STATUS, &success);
-        if (!success) {
-            GLint logLength;
-            glGetShaderiv(shader, GL_INFO_LOG_LENGTH, &logLength);
-            vector<char> log(logLength);
-            glGetShaderInfoLog(shader, logLength, nullptr, log.data());
-            cerr << "Shader compile error: " << log.data() << endl;
+    void computeBounds() {
+        computeVertexBounds(vertices, boundsMin, boundsMax);
+    }
+};
+
+const char* skipSpaces(const char* p, const char* end) {
+    while (p < end && (*p == ' ' || *p == '\t' || *p == '\r')) ++p;
+    return p;
+}
+
+const char* parseFloat(const char* p, const char* end, float& value) {
+    p = skipSpaces(p, end);
+    if (p < end && *p == '+') ++p;
+    from_chars_result result = from_chars(p, end, value);
+    if (result.ec != errc()) {
+        throw runtime_error("bad number");
+    }
+    return result.ptr;
+}
+
+const char* parseInt(const char* p, const char* end, int& value) {
+    from_chars_result result = from_chars(p, end, value);
+    if (result.ec != errc()) {
+        throw runtime_error("bad index");
+    }
+    return result.ptr;
+}
+
+struct ObjCorner {
+    int v;
+    int vt;
+    bool relativeV;
+    bool relativeVt;
+};
+
+struct ObjChunk {
+    vector<float> positions;
+    vector<float> texCoords;
+    vector<ObjCorner> corners;
+};
+
+void parseObjChunk(const char* p, const char* end, ObjChunk& chunk) {
+    vector<ObjCorner> polygon;
+    while (p < end) {
+        const char* lineEnd = static_cast<const char*>(memchr(p, '\n', end - p));
+        if (!lineEnd) lineEnd = end;
+        p = skipSpaces(p, lineEnd);
+        if (lineEnd - p > 2 && p[0] == 'v' && p[1] == ' ') {
+            float x, y, z;
+            const char* q = parseFloat(p + 2, lineEnd, x);
+            q = parseFloat(q, lineEnd, y);
+            parseFloat(q, lineEnd, z);
+            chunk.positions.insert(chunk.positions.end(), {x, y, z});
+        } else if (lineEnd - p > 3 && p[0] == 'v' && p[1] == 't' && p[2] == ' ') {
+            float s, t;
+            const char* q = parseFloat(p + 3, lineEnd, s);
+            parseFloat(q, lineEnd, t);
+            chunk.texCoords.insert(chunk.texCoords.end(), {s, t});
+        } else if (lineEnd - p > 2 && p[0] == 'f' && p[1] == ' ') {
+            polygon.clear();
+            const char* q = skipSpaces(p + 2, lineEnd);
+            int localV = chunk.positions.size() / 3;
+            int localVt = chunk.texCoords.size() / 2;
+            while (q < lineEnd) {
+                ObjCorner corner = {0, -1, false, false};
+                int index;
+                q = parseInt(q, lineEnd, index);
+                corner.relativeV = index < 0;
+                corner.v = index < 0 ? localV + index : index - 1;
+                if (q < lineEnd && *q == '/') {
+                    ++q;
+                    if (q < lineEnd && *q != '/') {
+                        q = parseInt(q, lineEnd, index);
+                        corner.relativeVt = index < 0;
+                        corner.vt = index < 0 ? localVt + index : index - 1;
+                    }
+                    while (q < lineEnd && *q != ' ' && *q != '\t' && *q != '\r') ++q;
+                }
+                polygon.push_back(corner);
+                q = skipSpaces(q, lineEnd);
+            }
+            for (size_t i = 2; i < polygon.size(); ++i) {
+                chunk.corners.push_back(polygon[0]);
+                chunk.corners.push_back(polygon[i - 1]);
+                chunk.corners.push_back(polygon[i]);
+            }
         }
+        p = lineEnd + 1;
     }
-    void checkProgram(GLuint program) {
-        GLint success;
-        glGetProgramiv(program, GL_LINK_STATUS, &success);
-        if (!success) {
-            GLint logLength;
-            glGetProgramiv(program, GL_INFO_LOG_LENGTH, &logLength);
-            vector<char> log(logLength);
-            glGetProgramInfoLog(program, logLength, nullptr, log.data());
-            cerr << "Program link error: " << log.data() << endl;
+}
+
+MeshData parseObj(const MappedFile& file) {
+    const char* begin = file.getData();
+    const char* end = begin + file.getSize();
+    size_t chunkCount = std::min<size_t>(std::max(1u, thread::hardware_concurrency()) * 4, file.getSize() / (1 << 16) + 1);
+    vector<const char*> bounds(chunkCount + 1, end);
+    bounds[0] = begin;
+    for (size_t i = 1; i < chunkCount; ++i) {
+        const char* p = std::max(bounds[i - 1], begin + file.getSize() * i / chunkCount);
+        const char* newline = static_cast<const char*>(memchr(p, '\n', end - p));
+        bounds[i] = newline ? newline + 1 : end;
+    }
+
+    vector<ObjChunk> chunks(chunkCount);
+    parallelFor(chunkCount, [&](size_t first, size_t last) {
+        for (size_t i = first; i < last; ++i) {
+            parseObjChunk(bounds[i], bounds[i + 1], chunks[i]);
         }
+    });
+
+    vector<size_t> positionBase(chunkCount + 1, 0), texCoordBase(chunkCount + 1, 0), cornerBase(chunkCount + 1, 0);
+    for (size_t i = 0; i < chunkCount; ++i) {
+        positionBase[i + 1] = positionBase[i] + chunks[i].positions.size() / 3;
+        texCoordBase[i + 1] = texCoordBase[i] + chunks[i].texCoords.size() / 2;
+        cornerBase[i + 1] = cornerBase[i] + chunks[i].corners.size();
     }
-};
+    vector<float> positions(positionBase[chunkCount] * 3);
+    vector<float> texCoords(texCoordBase[chunkCount] * 2);
+    parallelFor(chunkCount, [&](size_t first, size_t last) {
+        for (size_t i = first; i < last; ++i) {
+            copy(chunks[i].positions.begin(), chunks[i].positions.end(), positions.begin() + positionBase[i] * 3);
+            copy(chunks[i].texCoords.begin(), chunks[i].texCoords.end(), texCoords.begin() + texCoordBase[i] * 2);
+        }
+    });
 
-class ShapeRenderer {
-public:
-    ShapeRenderer(const vector<float>& vertices) {
-        glGenVertexArrays(1, &vao);
-        glGenBuffers(1, &vbo);
-        glBindVertexArray(vao);
-        glBindBuffer(GL_ARRAY_BUFFER, vbo);
-        glBufferData(GL_ARRAY_BUFFER, vertices.size() * sizeof(float), vertices.data(), GL_STATIC_DRAW);
-        glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 5 * sizeof(float), (void*)0);
-        glEnableVertexAttribArray(0);
-        glVertexAttribPointer(1, 2, GL_FLOAT, GL_FALSE, 5 * sizeof(float), (void*)(3 * sizeof(float)));
-        glEnableVertexAttribArray(1);
-        glBindBuffer(GL_ARRAY_BUFFER, 0);
-        glBindVertexArray(0);
+    MeshData mesh;
+    mesh.vertices.resize(cornerBase[chunkCount] * 5);
+    atomic<bool> badIndex(false);
+    parallelFor(chunkCount, [&](size_t first, size_t last) {
+        for (size_t i = first; i < last; ++i) {
+            float* out = mesh.vertices.data() + cornerBase[i] * 5;
+            for (const ObjCorner& corner : chunks[i].corners) {
+                long v = corner.v + (corner.relativeV ? (long)positionBase[i] : 0);
+                long vt = corner.vt + (corner.relativeVt ? (long)texCoordBase[i] : 0);
+                if (v < 0 || v >= (long)positionBase[chunkCount]) {
+                    badIndex = true;
+                    v = 0;
+                }
+                out[0] = positions[v * 3];
+                out[1] = positions[v * 3 + 1];
+                out[2] = positions[v * 3 + 2];
+                bool hasVt = corner.vt >= 0 || corner.relativeVt;
+                if (hasVt && vt >= 0 && vt < (long)texCoordBase[chunkCount]) {
+                    out[3] = texCoords[vt * 2];
+                    out[4] = texCoords[vt * 2 + 1];
+                } else {
+                    out[3] = 0.0f;
+                    out[4] = 0.0f;
+                }
+                out += 5;
+            }
+        }
+    });
+    if (badIndex) {
+        throw runtime_error("face index out of range");
     }
-    ~ShapeRenderer() {
-        glDeleteVertexArrays(1, &vao);
-        glDeleteBuffers(1, &vbo);
+    return mesh;
+}
+
+struct JsonValue {
+    enum Type { Null, Bool, Number, String, Array, Object };
+    Type type = Null;
+    bool boolean = false;
+    double number = 0.0;
+    string str;
+    vector<JsonValue> array;
+    vector<pair<string, JsonValue>> object;
+
+    const JsonValue* find(const char* key) const {
+        for (const auto& member : object) {
+            if (member.first == key) return &member.second;
+        }
+        return nullptr;
     }
-    void render(Shader& shader, GLuint texture, int count) {
-        shader.use();
-        glBindTexture(GL_TEXTURE_2D, texture); 
-        glBindVertexArray(vao);
-        glDrawArrays(GL_TRIANGLES, 0, count);
+    double getNumber(const char* key, double fallback) const {
+        const JsonValue* value = find(key);
+        return value && value->type == Number ? value->number : fallback;
     }
-private:
-    GLuint vao, vbo;
 };
 
-class Sphere {
+class JsonParser {
 public:
-    Sphere(float radius, int sectorCount, int stackCount) {
-        createSphere(radius, sectorCount, stackCount);
+    JsonParser(const char* begin, const char* end) : p(begin), end(end) {}
+    JsonValue parse() {
+        JsonValue value = parseValue();
+        skip();
+        return value;
     }
+private:
+    static const int maxDepth = 256;
+    const char* p;
+    const char* end;
+    int depth = 0;
 
-    void render(Shader& shader, GLuint texture) {
-        shader.use();
-        glBindTexture(GL_TEXTURE_2D, texture);
-        glBindVertexArray(vao);
-        glDrawArrays(GL_TRIANGLES, 0, vertexCount);
+    void skip() {
+        while (p < end && (*p == ' ' || *p == '\t' || *p == '\r' || *p == '\n')) ++p;
+    }
+    void expect(char c) {
+        skip();
+        if (p >= end || *p != c) {
+            throw runtime_error(string("json: expected '") + c + "'");
+        }
+        ++p;
+    }
+    JsonValue parseValue() {
+        skip();
+        if (p >= end) throw runtime_error("json: unexpected end");
+        JsonValue value;
+        if ((*p == '{' || *p == '[') && ++depth > maxDepth) {
+            throw runtime_error("json: nesting too deep");
+        }
+        if (*p == '{') {
+            value.type = JsonValue::Object;
+            ++p;
+            skip();
+            if (p < end && *p == '}') { ++p; --depth; return value; }
+            do {
+                skip();
+                string key = parseString();
+                expect(':');
+                value.object.emplace_back(move(key), parseValue());
+                skip();
+            } while (p < end && *p == ',' && ++p);
+            expect('}');
+            --depth;
+        } else if (*p == '[') {
+            value.type = JsonValue::Array;
+            ++p;
+            skip();
+            if (p < end && *p == ']') { ++p; --depth; return value; }
+            do {
+                value.array.push_back(parseValue());
+                skip();
+            } while (p < end && *p == ',' && ++p);
+            expect(']');
+            --depth;
+        } else if (*p == '"') {
+            value.type = JsonValue::String;
+            value.str = parseString();
+        } else if (end - p >= 4 && strncmp(p, "true", 4) == 0) {
+            value.type = JsonValue::Bool;
+            value.boolean = true;
+            p += 4;
+        } else if (end - p >= 5 && strncmp(p, "false", 5) == 0) {
+            value.type = JsonValue::Bool;
+            p += 5;
+        } else if (end - p >= 4 && strncmp(p, "null", 4) == 0) {
+            p += 4;
+        } else {
+            value.type = JsonValue::Number;
+            from_chars_result result = from_chars(p, end, value.number);
+            if (result.ec != errc()) throw runtime_error("json: bad number");
+            p = result.ptr;
+        }
+        return value;
     }
+    string parseString() {
+        if (p >= end || *p != '"') throw runtime_error("json: expected string");
+        ++p;
+        string result;
+        while (p < end && *p != '"') {
+            if (*p == '\\' && p + 1 < end) {
+                ++p;
+                switch (*p) {
+                    case 'n': result += '\n'; break;
+                    case 't': result += '\t'; break;
+                    case 'r': result += '\r'; break;
+                    case 'b': result += '\b'; break;
+                    case 'f': result += '\f'; break;
+                    case 'u': result += '?'; p += std::min<ptrdiff_t>(4, end - p - 1); break;
+                    default: result += *p; break;
+                }
+                ++p;
+            } else {
+                result += *p++;
+            }
+        }
+        if (p >= end) throw runtime_error("json: unterminated string");
+        ++p;
+        return result;
+    }
+};
 
-    GLuint getVAO() const {
-        return vao;
+vector<unsigned char> decodeBase64(const string& text) {
+    vector<unsigned char> out;
+    out.reserve(text.size() * 3 / 4);
+    unsigned int bits = 0;
+    int bitCount = 0;
+    for (char c : text) {
+        int v;
+        if (c >= 'A' && c <= 'Z') v = c - 'A';
+        else if (c >= 'a' && c <= 'z') v = c - 'a' + 26;
+        else if (c >= '0' && c <= '9') v = c - '0' + 52;
+        else if (c == '+') v = 62;
+        else if (c == '/') v = 63;
+        else continue;
+        bits = (bits << 6) | v;
+        bitCount += 6;
+        if (bitCount >= 8) {
+            bitCount -= 8;
+            out.push_back((bits >> bitCount) & 0xFF);
+        }
     }
+    return out;
+}
 
-    int getVertexCount() const {
-        return vertexCount;
+struct GltfBuffer {
+    const unsigned char* data = nullptr;
+    size_t size = 0;
+};
+
+class GltfLoader {
+public:
+    GltfLoader(const char* path) : file(path), directory(path) {
+        size_t slash = directory.find_last_of('/');
+        directory = slash == string::npos ? string() : directory.substr(0, slash + 1);
+    }
+
+    MeshData load() {
+        const char* begin = file.getData();
+        size_t size = file.getSize();
+        GltfBuffer binChunk;
+        if (size >= 12 && memcmp(begin, "glTF", 4) == 0) {
+            if (size < 20) {
+                throw runtime_error("glb: truncated header");
+            }
+            uint32_t jsonLength = readU32(begin + 12);
+            if (size < 20 + (size_t)jsonLength || memcmp(begin + 16, "JSON", 4) != 0) {
+                throw runtime_error("glb: bad JSON chunk");
+            }
+            root = JsonParser(begin + 20, begin + 20 + jsonLength).parse();
+            size_t binOffset = 20 + ((jsonLength + 3) & ~3u);
+            if (binOffset + 8 <= size && memcmp(begin + binOffset + 4, "BIN\0", 4) == 0) {
+                binChunk.data = reinterpret_cast<const unsigned char*>(begin + binOffset + 8);
+                binChunk.size = std::min<size_t>(readU32(begin + binOffset), size - binOffset - 8);
+            }
+        } else {
+            root = JsonParser(begin, begin + size).parse();
+        }
+
+        const JsonValue* bufferList = root.find("buffers");
+        if (bufferList) {
+            for (const JsonValue& buffer : bufferList->array) {
+                const JsonValue* uri = buffer.find("uri");
+                if (!uri) {
+                    buffers.push_back(binChunk);
+                } else if (uri->str.compare(0, 5, "data:") == 0) {
+                    size_t comma = uri->str.find(',');
+                    ownedData.push_back(decodeBase64(uri->str.substr(comma == string::npos ? 0 : comma + 1)));
+                    buffers.push_back({ownedData.back().data(), ownedData.back().size()});
+                } else {
+                    externalFiles.emplace_back(new MappedFile((directory + uri->str).c_str()));
+                    const MappedFile& external = *externalFiles.back();
+                    buffers.push_back({reinterpret_cast<const unsigned char*>(external.getData()), external.getSize()});
+                }
+            }
+        }
+
+        const JsonValue* nodes = root.find("nodes");
+        const JsonValue* scenes = root.find("scenes");
+        if (nodes && scenes && !scenes->array.empty()) {
+            const JsonValue& scene = element("scenes", toIndex(root.getNumber("scene", 0)));
+            const JsonValue* sceneNodes = scene.find("nodes");
+            if (sceneNodes) {
+                for (const JsonValue& node : sceneNodes->array) {
+                    visitNode(toIndex(node.number), mat4(1.0f), 0);
+                }
+            }
+        } else if (const JsonValue* meshes = root.find("meshes")) {
+            for (size_t i = 0; i < meshes->array.size(); ++i) {
+                appendMesh(meshes->array[i], mat4(1.0f));
+            }
+        }
+        return move(result);
     }
 
 private:
-    GLuint vao;
-    int vertexCount;
-
-    void createSphere(float radius, int sectorCount, int stackCount) {
-        vector<float> vertices;
-        for (int i = 0; i <= stackCount; ++i) {
-            float stackAngle = M_PI / 2 - i * M_PI / stackCount;
-            float xy = radius * cosf(stackAngle);
-            float z = radius * sinf(stackAngle);
-            for (int j = 0; j <= sectorCount; ++j) {
-                float sectorAngle = j * 2 * M_PI / sectorCount;
-                float x = xy * cosf(sectorAngle);
-                float y = xy * sinf(sectorAngle);
-                vertices.push_back(x);
-                vertices.push_back(y);
-                vertices.push_back(z);
-                float s = (float)j / sectorCount;
-                float t = (float)i / stackCount;
-                vertices.push_back(s);
-                vertices.push_back(t);
-            }
-        }
-
-        vertexCount = (sectorCount + 1) * (stackCount + 1);
-        glGenVertexArrays(1, &vao);
-        GLuint vbo;
-        glGenBuffers(1, &vbo);
-        glBindVertexArray(vao);
-        glBindBuffer(GL_ARRAY_BUFFER, vbo);
-        glBufferData(GL_ARRAY_BUFFER, vertices.size() * sizeof(float), vertices.data(), GL_STATIC_DRAW);
-        glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 5 * sizeof(float), (void*)0);
-        glEnableVertexAttribArray(0);
-        glVertexAttribPointer(1, 2, GL_FLOAT, GL_FALSE, 5 * sizeof(float), (void*)(3 * sizeof(float)));
-        glEnableVertexAttribArray(1);
-        glBindBuffer(GL_ARRAY_BUFFER, 0);
-        glBindVertexArray(0);
+    MappedFile file;
+    string directory;
+    JsonValue root;
+    vector<GltfBuffer> buffers;
+    vector<vector<unsigned char>> ownedData;
+    vector<unique_ptr<MappedFile>> externalFiles;
+    MeshData result;
+
+    static uint32_t readU32(const char* p) {
+        uint32_t value;
+        memcpy(&value, p, 4);
+        return value;
     }
-};
 
-vector<float> generateCubeVertices() {
-    return {
-        -1.0f, -1.0f,  1.0f, 0.0f, 0.0f,
-         1.0f, -1.0f,  1.0f, 1.0f, 0.0f,
-         1.0f,  1.0f,  1.0f, 1.0f, 1.0f,
-         1.0f,  1.0f,  1.0f, 1.0f, 1.0f,
-        -1.0f,  1.0f,  1.0f, 0.0f, 1.0f,
-        -1.0f, -1.0f,  1.0f, 0.0f, 0.0f,
-        -1.0f, -1.0f, -1.0f, 0.0f, 0.0f,
-         1.0f, -1.0f, -1.0f, 1.0f, 0.0f,
-         1.0f,  1.0f, -1.0f, 1.0f, 1.0f,
-         1.0f,  1.0f, -1.0f, 1.0f, 1.0f,
-        -1.0f,  1.0f, -1.0f, 0.0f, 1.0f,
-        -1.0f, -1.0f, -1.0f, 0.0f, 0.0f,
-        -1.0f, -1.0f, -1.0f, 0.0f, 0.0f,
-        -1.0f, -1.0f,  1.0f, 1.0f, 0.0f,
-        -1.0f,  1.0f,  1.0f, 1.0f, 1.0f,
-        -1.0f,  1.0f,  1.0f, 1.0f, 1.0f,
-        -1.0f,  1.0f, -1.0f, 0.0f, 1.0f,
-        -1.0f, -1.0f, -1.0f, 0.0f, 0.0f,
-         1.0f, -1.0f, -1.0f, 0.0f, 0.0f,
-         1.0f, -1.0f,  1.0f, 1.0f, 0.0f,
-         1.0f,  1.0f,  1.0f, 1.0f, 1.0f,
-         1.0f,  1.0f,  1.0f, 1.0f, 1.0f,
-         1.0f,  1.0f, -1.0f, 0.0f, 1.0f,
-         1.0f, -1.0f, -1.0f, 0.0f, 0.0f,
-        -1.0f,  1.0f, -1.0f, 0.0f, 0.0f,
-         1.0f,  1.0f, -1.0f, 1.0f, 0.0f,
-         1.0f,  1.0f,  1.0f, 1.0f, 1.0f,
-         1.0f,  1.0f,  1.0f, 1.0f, 1.0f,
-        -1.0f,  1.0f,  1.0f, 0.0f, 1.0f,
-        -1.0f,  1.0f, -1.0f, 0.0f, 0.0f,
-        -1.0f, -1.0f, -1.0f, 0.0f, 0.0f,
-         1.0f, -1.0f, -1.0f, 1.0f, 0.0f,
-         1.0f, -1.0f,  1.0f, 1.0f, 1.0f,
-         1.0f, -1.0f,  1.0f, 1.0f, 1.0f,
-        -1.0f, -1.0f,  1.0f, 0.0f, 1.0f,
-        -1.0f, -1.0f, -1.0f, 0.0f, 0.0f,
-    };
-}
+    static size_t toIndex(double value) {
+        return value >= 0.0 && value == floor(value) && value < 4294967296.0 ? (size_t)value : SIZE_MAX;
+    }
 
-vector<float> generatePlaneVertices() {
-    return {
-        -50.0f, 0.0f, -50.0f, 0.0f, 0.0f,
-         50.0f, 0.0f, -50.0f, 1.0f, 0.0f,
-         50.0f, 0.0f,  50.0f, 1.0f, 1.0f,
-         50.0f, 0.0f,  50.0f, 1.0f, 1.0f,
-        -50.0f, 0.0f,  50.0f, 0.0f, 1.0f,
-        -50.0f, 0.0f, -50.0f, 0.0f, 0.0f,
-    };
-}
+    static size_t toSize(double value, const char* name) {
+        size_t size = toIndex(value);
+        if (size == SIZE_MAX) {
+            throw runtime_error(string("gltf: bad ") + name);
+        }
+        return size;
+    }
 
-vector<float> generateSecondPlaneVertices() {
-    return {
-        -10.0f, 13.0f, -10.0f, 0.0f, 0.0f,
-         10.0f, 13.0f, -10.0f, 1.0f, 0.0f,
-         10.0f, 13.0f,  10.0f, 1.0f, 1.0f,
-         10.0f, 13.0f,  10.0f, 1.0f, 1.0f,
-        -10.0f, 13.0f,  10.0f, 0.0f, 1.0f,
-        -10.0f, 13.0f, -10.0f, 0.0f, 0.0f,
-    };
-}
+    const JsonValue& element(const char* list, size_t index) {
+        const JsonValue* values = root.find(list);
+        if (!values || index >= values->array.size()) {
+            throw runtime_error(string("gltf: bad reference into ") + list);
+        }
+        return values->array[index];
+    }
 
-vector<float> generateWallVertices() {
-    return {
-        -50.0f, -1.0f, -50.0f, 0.0f, 1.0f,
-         50.0f, -1.0f, -50.0f, 1.0f, 1.0f,
-         50.0f,  50.0f, -50.0f, 1.0f, 0.0f,
-         50.0f,  50.0f, -50.0f, 1.0f, 0.0f,
-        -50.0f,  50.0f, -50.0f, 0.0f, 0.0f,
-        -50.0f, -1.0f, -50.0f, 0.0f, 1.0f,
-        
-        -50.0f, -1.0f, 50.0f, 1.0f, 1.0f, 
-         50.0f, -1.0f, 50.0f, 0.0f, 1.0f, 
-         50.0f,  50.0f, 50.0f, 0.0f, 0.0f,
-         50.0f,  50.0f, 50.0f, 0.0f, 0.0f,
-        -50.0f,  50.0f, 50.0f, 1.0f, 0.0f,
-        -50.0f, -1.0f, 50.0f, 1.0f, 1.0f, 
-        
-        -50.0f, -1.0f, -50.0f, 0.0f, 1.0f,
-        -50.0f, -1.0f, 50.0f, 1.0f, 1.0f,
-        -50.0f,  50.0f, 50.0f, 1.0f, 0.0f,
-        -50.0f,  50.0f, 50.0f, 1.0f, 0.0f,
-        -50.0f,  50.0f, -50.0f, 0.0f, 0.0f,
-        -50.0f, -1.0f, -50.0f, 0.0f, 1.0f,
-        
-        50.0f, -1.0f, -50.0f, 1.0f, 1.0f, 
-        50.0f, -1.0f, 50.0f, 0.0f, 1.0f,
-        50.0f,  50.0f, 50.0f,  0.0f, 0.0f,
-        50.0f,  50.0f, 50.0f,  0.0f, 0.0f,
-        50.0f,  50.0f, -50.0f, 1.0f, 0.0f,
-        50.0f, -1.0f, -50.0f, 1.0f, 1.0f, 
-    };
-}
+    void visitNode(size_t index, const mat4& parent, int depth) {
+        if (depth > 64) throw runtime_error("gltf: node hierarchy too deep");
+        const JsonValue& node = element("nodes", index);
+        mat4 local(1.0f);
+        if (const JsonValue* matrix = node.find("matrix")) {
+            for (int i = 0; i < 16 && i < (int)matrix->array.size(); ++i) {
+                local[i / 4][i % 4] = matrix->array[i].number;
+            }
+        } else {
+            const JsonValue* t = node.find("translation");
+            const JsonValue* r = node.find("rotation");
+            const JsonValue* s = node.find("scale");
+            if (t && t->array.size() == 3) {
+                local = translate(local, vec3(t->array[0].number, t->array[1].number, t->array[2].number));
+            }
+            if (r && r->array.size() == 4) {
+                float x = r->array[0].number, y = r->array[1].number, z = r->array[2].number, w = r->array[3].number;
+                mat4 rotation(1.0f);
+                rotation[0] = vec4(1 - 2 * (y * y + z * z), 2 * (x * y + z * w), 2 * (x * z - y * w), 0.0f);
+                rotation[1] = vec4(2 * (x * y - z * w), 1 - 2 * (x * x + z * z), 2 * (y * z + x * w), 0.0f);
+                rotation[2] = vec4(2 * (x * z + y * w), 2 * (y * z - x * w), 1 - 2 * (x * x + y * y), 0.0f);
+                local = local * rotation;
+            }
+            if (s && s->array.size() == 3) {
+                local = scale(local, vec3(s->array[0].number, s->array[1].number, s->array[2].number));
+            }
+        }
+        mat4 world = parent * local;
+        if (const JsonValue* mesh = node.find("mesh")) {
+            appendMesh(element("meshes", toIndex(mesh->number)), world);
+        }
+        if (const JsonValue* children = node.find("children")) {
+            for (const JsonValue& child : children->array) {
+                visitNode(toIndex(child.number), world, depth + 1);
+            }
+        }
+    }
 
-vector<float> generateCeilingVertices() {
-    return {
-        -50.0f, 50.0f, -50.0f, 0.0f, 0.0f,
-         50.0f, 50.0f, -50.0f, 1.0f, 0.0f,
-         50.0f, 50.0f,  50.0f, 1.0f, 1.0f,
-         50.0f, 50.0f,  50.0f, 1.0f, 1.0f,
-        -50.0f, 50.0f,  50.0f, 0.0f, 1.0f,
-        -50.0f, 50.0f, -50.0f, 0.0f, 0.0f,
+    struct AccessorView {
+        const unsigned char* data = nullptr;
+        size_t count = 0;
+        size_t stride = 0;
+        int componentType = 0;
+        int components = 0;
+        bool normalized = false;
+
+        float read(size_t index, int component) const {
+            const unsigned char* p = data + index * stride;
+            switch (componentType) {
+                case GL_FLOAT: { float v; memcpy(&v, p + component * 4, 4); return v; }
+                case GL_UNSIGNED_SHORT: { uint16_t v; memcpy(&v, p + component * 2, 2); return normalized ? v / 65535.0f : v; }
+                case GL_SHORT: { int16_t v; memcpy(&v, p + component * 2, 2); return normalized ? std::max(v / 32767.0f, -1.0f) : v; }
+                case GL_UNSIGNED_BYTE: { uint8_t v = p[component]; return normalized ? v / 255.0f : v; }
+                case GL_BYTE: { int8_t v = (int8_t)p[component]; return normalized ? std::max(v / 127.0f, -1.0f) : v; }
+                case GL_UNSIGNED_INT: { uint32_t v; memcpy(&v, p + component * 4, 4); return (float)v; }
+            }
+            return 0.0f;
+        }
+        uint32_t readIndex(size_t index) const {
+            const unsigned char* p = data + index * stride;
+            if (componentType == GL_UNSIGNED_BYTE) return p[0];
+            if (componentType == GL_UNSIGNED_SHORT) { uint16_t v; memcpy(&v, p, 2); return v; }
+            uint32_t v;
+            memcpy(&v, p, 4);
+            return v;
+        }
     };
-}
 
-GLuint loadTexture(const char* path) {
-    GLuint textureID;
-    glGenTextures(1, &textureID);
-    glBindTexture(GL_TEXTURE_2D, textureID); 
+    AccessorView accessor(size_t index) {
+        const JsonValue& acc = element("accessors", index);
+        AccessorView view;
+        view.count = toSize(acc.getNumber("count", 0), "accessor count");
+        view.componentType = (int)toSize(acc.getNumber("componentType", GL_FLOAT), "componentType");
+        const JsonValue* normalized = acc.find("normalized");
+        view.normalized = normalized && normalized->boolean;
+        const JsonValue* type = acc.find("type");
+        string typeName = type ? type->str : "SCALAR";
+        view.components = typeName == "VEC2" ? 2 : typeName == "VEC3" ? 3 : typeName == "VEC4" ? 4 : 1;
+        size_t componentSize;
+        switch (view.componentType) {
+            case GL_FLOAT: case GL_UNSIGNED_INT: componentSize = 4; break;
+            case GL_SHORT: case GL_UNSIGNED_SHORT: componentSize = 2; break;
+            case GL_BYTE: case GL_UNSIGNED_BYTE: componentSize = 1; break;
+            default: throw runtime_error("gltf: bad componentType");
+        }
+        const JsonValue* bufferViewIndex = acc.find("bufferView");
+        if (!bufferViewIndex) {
+            throw runtime_error("gltf: sparse or empty accessors are not supported");
+        }
+        const JsonValue& bufferView = element("bufferViews", toIndex(bufferViewIndex->number));
+        size_t bufferIndex = toIndex(bufferView.getNumber("buffer", 0));
+        if (bufferIndex >= buffers.size()) {
+            throw runtime_error("gltf: bad buffer reference");
+        }
+        const GltfBuffer& buffer = buffers[bufferIndex];
+        size_t offset = toSize(bufferView.getNumber("byteOffset", 0), "byteOffset") + toSize(acc.getNumber("byteOffset", 0), "byteOffset");
+        size_t elementSize = componentSize * view.components;
+        view.stride = toSize(bufferView.getNumber("byteStride", elementSize), "byteStride");
+        if (!buffer.data || offset > buffer.size) {
+            throw runtime_error("gltf: accessor out of buffer bounds");
+        }
+        size_t available = buffer.size - offset;
+        if (view.count > 0 && (elementSize > available
+                || (view.stride > 0 && view.count - 1 > (available - elementSize) / view.stride))) {
+            throw runtime_error("gltf: accessor out of buffer bounds");
+        }
+        view.data = buffer.data + offset;
+        return view;
+    }
 
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    void appendMesh(const JsonValue& mesh, const mat4& world) {
+        const JsonValue* primitives = mesh.find("primitives");
+        if (!primitives) return;
+        for (const JsonValue& primitive : primitives->array) {
+            if (primitive.getNumber("mode", GL_TRIANGLES) != GL_TRIANGLES) {
+                cerr << "gltf: skipping non-triangle primitive" << endl;
+                continue;
+            }
+            const JsonValue* attributes = primitive.find("attributes");
+            const JsonValue* position = attributes ? attributes->find("POSITION") : nullptr;
+            if (!position) continue;
+            AccessorView positions = accessor(toIndex(position->number));
+            if (positions.components != 3 || positions.componentType != GL_FLOAT) {
+                throw runtime_error("gltf: POSITION must be a float VEC3");
+            }
+            const JsonValue* texCoord = attributes->find("TEXCOORD_0");
+            AccessorView texCoords;
+            if (texCoord) {
+                texCoords = accessor(toIndex(texCoord->number));
+                if (texCoords.components != 2) {
+                    throw runtime_error("gltf: TEXCOORD_0 must be a VEC2");
+                }
+            }
+            const JsonValue* indicesIndex = primitive.find("indices");
+            AccessorView indices;
+            size_t cornerCount = positions.count;
+            if (indicesIndex) {
+                indices = accessor(toIndex(indicesIndex->number));
+                if (indices.components != 1 || (indices.componentType != GL_UNSIGNED_BYTE
+                        && indices.componentType != GL_UNSIGNED_SHORT && indices.componentType != GL_UNSIGNED_INT)) {
+                    throw runtime_error("gltf: indices must be unsigned scalars");
+                }
+                cornerCount = indices.count;
+            }
+            cornerCount -= cornerCount % 3;
 
-    int width, height, nrChannels;
-    unsigned char* data = stbi_load(path, &width, &height, &nrChannels, 0);
-    if (data) {
-        GLenum format;
-        if (nrChannels == 1) {
-            format = GL_RED;
-        } else if (nrChannels == 3) {
-            format = GL_RGB;
-        } else if (nrChannels == 4) {
-            format = GL_RGBA;
+            size_t base = result.vertices.size();
+            result.vertices.resize(base + cornerCount * 5);
+            float* out = result.vertices.data() + base;
+            atomic<bool> badIndex(false);
+            parallelFor(cornerCount, [&](size_t first, size_t last) {
+                for (size_t i = first; i < last; ++i) {
+                    size_t v = indicesIndex ? indices.readIndex(i) : i;
+                    if (v >= positions.count) {
+                        badIndex = true;
+                        v = 0;
+                    }
+                    vec4 p = world * vec4(positions.read(v, 0), positions.read(v, 1), positions.read(v, 2), 1.0f);
+                    float* dst = out + i * 5;
+                    dst[0] = p.x;
+                    dst[1] = p.y;
+                    dst[2] = p.z;
+                    dst[3] = texCoord && v < texCoords.count ? texCoords.read(v, 0) : 0.0f;
+                    dst[4] = texCoord && v < texCoords.count ? 1.0f - texCoords.read(v, 1) : 0.0f;
+                }
+            });
+            if (badIndex) {
+                throw runtime_error("gltf: index out of range");
+            }
         }
-
-        glTexImage2D(GL_TEXTURE_2D, 0, format, width, height, 0, format, GL_UNSIGNED_BYTE, data);
-        glGenerateMipmap(GL_TEXTURE_2D);
-    } else {
-        cerr << "error with download texture: " << path << endl;
-        cerr << "stbi_load err: " << stbi_failure_reason() << endl;
-        return 0;
     }
+};
 
-    stbi_image_free(data); 
-    return textureID;
+MeshData loadMesh(const char* path) {
+    MeshData mesh;
+    try {
+        string name(path);
+        string extension = name.substr(name.find_last_of('.') + 1);
+        transform(extension.begin(), extension.end(), extension.begin(), ::tolower);
+        if (extension == "obj") {
+            MappedFile file(path);
+            mesh = parseObj(file);
+        } else if (extension == "gltf" || extension == "glb") {
+            mesh = GltfLoader(path).load();
+        } else {
+            throw runtime_error("unsupported mesh format");
+        }
+        mesh.computeBounds();
+    } catch (const runtime_error& e) {
+        cerr << "error with load mesh: " << path << endl;
+        cerr << "mesh load err: " << e.what() << endl;
+        return MeshData();
+    }
+    return mesh;
 }
 
-vector<float> generatePyramidVertices() {
-    return {
-        -1.0f, 0.0f, -1.0f, 0.0f, 0.0f,
-         1.0f, 0.0f, -1.0f, 1.0f, 1.0f,
-         1.0f, 0.0f,  1.0f, 1.0f, 1.0f,
-         1.0f, 0.0f,  1.0f, 1.0f, 1.0f,
-        -1.0f, 0.0f,  1.0f, 1.0f, 1.0f,
-        -1.0f, 0.0f, -1.0f, 0.0f, 0.0f,
-        -1.0f, 0.0f, -1.0f, 0.0f, 0.0f,
-         1.0f, 0.0f, -1.0f, 1.0f, 0.0f,
-         0.0f, 3.0f, 0.0f, 0.5f, 1.0f,
-         1.0f, 0.0f, -1.0f, 1.0f, 0.0f,
-         1.0f, 0.0f,  1.0f, 1.0f, 1.0f,
-         0.0f, 3.0f, 0.0f, 0.5f, 1.0f,
-         1.0f, 0.0f,  1.0f, 1.0f, 1.0f,
-        -1.0f, 0.0f,  1.0f, 0.0f, 1.0f,
-         0.0f, 3.0f, 0.0f, 0.5f, 1.0f,
-        -1.0f, 0.0f,  1.0f, 0.0f, 1.0f,
-        -1.0f, 0.0f, -1.0f, 0.0f, 0.0f,
-         0.0f, 3.0f, 0.0f, 0.5f, 1.0f 
-    };
+PortalVisibility loadPortalGraph(const char* path) {
+    try {
+        MappedFile file(path);
+        PortalVisibility graph;
+        const char* p = file.getData();
+        const char* end = p + file.getSize();
+        while (p < end) {
+            const char* lineEnd = static_cast<const char*>(memchr(p, '\n', end - p));
+            if (!lineEnd) lineEnd = end;
+            p = skipSpaces(p, lineEnd);
+            if (lineEnd - p > 5 && strncmp(p, "cell ", 5) == 0) {
+                float v[6];
+                const char* q = p + 5;
+                for (float& value : v) q = parseFloat(q, lineEnd, value);
+                graph.addCell(vec3(v[0], v[1], v[2]), vec3(v[3], v[4], v[5]));
+            } else if (lineEnd - p > 7 && strncmp(p, "portal ", 7) == 0) {
+                int cellA, cellB;
+                float v[12];
+                const char* q = parseInt(skipSpaces(p + 7, lineEnd), lineEnd, cellA);
+                q = parseInt(skipSpaces(q, lineEnd), lineEnd, cellB);
+                for (float& value : v) q = parseFloat(q, lineEnd, value);
+                graph.addPortal(cellA, cellB, vec3(v[0], v[1], v[2]), vec3(v[3], v[4], v[5]), vec3(v[6], v[7], v[8]), vec3(v[9], v[10], v[11]));
+            } else if (p < lineEnd && *p != '#') {
+                throw runtime_error("unknown statement");
+            }
+            p = lineEnd + 1;
+        }
+        return graph;
+    } catch (const runtime_error& e) {
+        cerr << "error with load portals: " << path << endl;
+        cerr << "portal load err: " << e.what() << endl;
+        return staticPortalGraph();
+    }
 }
 
 void processInput(GLFWwindow *window) {
@@ -426,12 +5134,79 @@ void processInput(GLFWwindow *window) {
         sphereRotationAngle -= 1.0f;
 }
 
-int main() {
+int main(int argc, char** argv) {
     try {
+        const char* modelPath = nullptr;
+        bool bakeOnly = false;
+        bool deferred = false;
+        int ssaoDivisor = 0;
+        bool ssaoTemporal = false;
+        bool gpuTimings = false;
+        float frameBudget = -1.0f;
+        float renderScale = 1.0f;
+        bool temporalAA = false;
+        bool depthPrepass = false;
+        bool occlusionCulling = true;
+        bool debugDrawing = false;
+        int gpuCullingInstances = 0;
+        int allocationCheckFrames = -1;
+        const char* portalPath = nullptr;
+        for (int i = 1; i < argc; ++i) {
+            if (strcmp(argv[i], "--bake-lightmaps") == 0) {
+                bakeOnly = true;
+            } else if (strcmp(argv[i], "--deferred") == 0) {
+                deferred = true;
+            } else if (strcmp(argv[i], "--ssao") == 0 || strcmp(argv[i], "--ssao=half") == 0) {
+                ssaoDivisor = 2;
+            } else if (strcmp(argv[i], "--ssao=quarter") == 0) {
+                ssaoDivisor = 4;
+            } else if (strcmp(argv[i], "--ssao-temporal") == 0) {
+                ssaoTemporal = true;
+            } else if (strcmp(argv[i], "--gpu-timings") == 0) {
+                gpuTimings = true;
+            } else if (strcmp(argv[i], "--dynamic-resolution") == 0) {
+                frameBudget = 0.0f;
+            } else if (strncmp(argv[i], "--dynamic-resolution=", 21) == 0) {
+                frameBudget = atof(argv[i] + 21);
+            } else if (strcmp(argv[i], "--depth-prepass") == 0) {
+                depthPrepass = true;
+            } else if (strcmp(argv[i], "--check-allocations") == 0) {
+                allocationCheckFrames = 0;
+            } else if (strncmp(argv[i], "--check-allocations=", 20) == 0) {
+                allocationCheckFrames = std::max(1, atoi(argv[i] + 20));
+            } else if (strcmp(argv[i], "--debug-draw") == 0) {
+                debugDrawing = true;
+            } else if (strcmp(argv[i], "--no-occlusion-culling") == 0) {
+                occlusionCulling = false;
+            } else if (strcmp(argv[i], "--gpu-culling") == 0) {
+                gpuCullingInstances = 4096;
+            } else if (strncmp(argv[i], "--gpu-culling=", 14) == 0) {
+                gpuCullingInstances = std::max(0, atoi(argv[i] + 14));
+            } else if (strcmp(argv[i], "--no-shader-cache") == 0) {
+                Shader::cacheDirectory.clear();
+            } else if (strncmp(argv[i], "--portals=", 10) == 0) {
+                portalPath = argv[i] + 10;
+            } else if (strcmp(argv[i], "--taa") == 0) {
+                temporalAA = true;
+            } else if (strncmp(argv[i], "--render-scale=", 15) == 0) {
+                renderScale = std::clamp((float)atof(argv[i] + 15), 0.25f, 1.0f);
+            } else {
+                modelPath = argv[i];
+            }
+        }
+        if (ssaoTemporal && !ssaoDivisor) {
+            ssaoDivisor = 2;
+        }
+        deferred = deferred || ssaoDivisor > 0;
+        vector<BakeMesh> bakeScene = staticBakeScene();
+        if (bakeOnly) {
+            loadOrBakeLightmaps(bakeScene, "lightmaps.cache", true);
+            return 0;
+        }
         if (!glfwInit()) {
             throw runtime_error("GLFW error");
         }
-        glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 3);
+        glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, gpuCullingInstances > 0 ? 4 : 3);
         glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 3);
         glfwWindowHint(GLFW_OPENGL_PROFILE, GLFW_OPENGL_CORE_PROFILE);
         glfwWindowHint(GLFW_DECORATED, GLFW_FALSE);
@@ -439,6 +5214,11 @@ int main() {
         GLFWmonitor* monitor = glfwGetPrimaryMonitor();
         const GLFWvidmode* mode = glfwGetVideoMode(monitor);
         GLFWwindow* window = glfwCreateWindow(mode->width, mode->height, "3D-Scene", monitor, nullptr);
+        if (!window && gpuCullingInstances > 0) {
+            cerr << "OpenGL 4.3 context unavailable, falling back to 3.3" << endl;
+            glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 3);
+            window = glfwCreateWindow(mode->width, mode->height, "3D-Scene", monitor, nullptr);
+        }
 
         if (!window) {
             glfwTerminate();
@@ -455,40 +5235,252 @@ int main() {
         }
 
         float radius = 1.5f;
-        int sectorCount = 36;
-        int stackCount = 1000;
-        vector<float> sphereVertices;
-        Sphere sphere(radius, sectorCount, stackCount); 
+        LodShapeRenderer sphere(sphereLods.data(), sphereLods.size(), radius, VERTEX_PACKED_NORMAL);
+
+        ShaderLibrary shaderLibrary;
+        ShaderPermutations shaderPermutations(shaderLibrary);
+        Shader& shaderDepth = shaderPermutations.get(SHADER_DEPTH_ONLY);
+        bool bindless = BindlessTextureSet::isSupported();
+        uint32_t surfaceFeatures = SHADER_TEXTURED | SHADER_LIT | (bindless ? (uint32_t)SHADER_BINDLESS : 0u) | (deferred ? (uint32_t)SHADER_DEFERRED : 0u);
+        Shader& shaderTexture = shaderPermutations.get(surfaceFeatures);
+        Shader shaderDeferredLighting(shaderLibrary, {"fullscreen"}, {"deferred_header", "octahedral", "cluster_lights", "deferred_lighting"});
+        Shader& shaderLighting = deferred ? shaderDeferredLighting : shaderTexture;
+        DeferredRenderer deferredRenderer;
+        unique_ptr<Shader> shaderSSAO;
+        unique_ptr<ScreenSpaceAO> ssao;
+        if (ssaoDivisor) {
+            shaderSSAO.reset(new Shader(shaderLibrary, {"fullscreen"}, {"deferred_header", "octahedral", "ssao"}));
+            ssao.reset(new ScreenSpaceAO(ssaoDivisor, ssaoTemporal));
+        }
+        GpuTimer gpuTimer;
+        unique_ptr<DynamicResolution> dynamicResolution;
+        if (frameBudget >= 0.0f) {
+            if (frameBudget == 0.0f) {
+                frameBudget = 1000.0f / std::max(mode->refreshRate, 30);
+            }
+            dynamicResolution.reset(new DynamicResolution(frameBudget, std::min(0.5f, renderScale), renderScale));
+        } else if (temporalAA || renderScale < 1.0f) {
+            dynamicResolution.reset(new DynamicResolution(0.0f, renderScale, renderScale));
+        }
+        unique_ptr<Shader> shaderTAA;
+        unique_ptr<TemporalAA> taa;
+        if (temporalAA) {
+            shaderTAA.reset(new Shader(shaderLibrary, {"fullscreen"}, {"taa"}));
+            taa.reset(new TemporalAA());
+        }
+        mat4 previousViewProjection = mat4(1.0f);
+        mat4 previousSphereModel = mat4(1.0f);
+        double lastTimingReport = glfwGetTime();
+
+        TextureArray textureArray;
+        BindlessTextureSet bindlessTextures;
+        auto addTexture = [&](const char* path) {
+            return bindless ? bindlessTextures.add(loadTexture(path)) : textureArray.addImage(path);
+        };
+        int textureSphere = addTexture("texture/sphere.jpg");
+        int textureSquare = addTexture("texture/cube.jpg");
+        int texturePyramide = addTexture("texture/pyramid.jpg");
+        int floorTexture = addTexture("texture/second_floor.jpg"); 
+        int wallTexture = addTexture("texture/wall.jpg");
+        int topTexture = addTexture("texture/floor+ceiling.jpg");
+        if (!bindless) {
+            textureArray.build();
+        }
+        auto bindSurfaceTextures = [&](Shader& shader) {
+            shader.use();
+            if (bindless) {
+                bindlessTextures.upload(shader);
+            }
+        };
 
-        Shader shaderSolid(vertex_shader_source, fragment_shader_source_solid);
-        Shader shaderTexture(vertex_shader_source, fragment_shader_source_texture);
+        Shader* shaderInstanced = nullptr;
+        unique_ptr<Shader> shaderInstanceCull;
+        unique_ptr<GpuInstanceCuller> instanceCuller;
+        if (gpuCullingInstances > 0 && !GpuInstanceCuller::isSupported()) {
+            cerr << "GPU culling needs OpenGL 4.3, instances disabled" << endl;
+        } else if (gpuCullingInstances > 0) {
+            shaderInstanced = &shaderPermutations.get(surfaceFeatures | SHADER_INSTANCED);
+            shaderInstanceCull.reset(new Shader(shaderLibrary, {"instance_cull"}));
+            int side = (int)ceilf(sqrtf((float)gpuCullingInstances));
+            float spacing = 90.0f / side;
+            vector<mat4> instanceModels;
+            for (int i = 0; i < gpuCullingInstances; ++i) {
+                vec3 position(-45.0f + (i % side + 0.5f) * spacing, -0.6f, -45.0f + (i / side + 0.5f) * spacing);
+                instanceModels.push_back(translate(mat4(1.0f), position));
+            }
+            instanceCuller.reset(new GpuInstanceCuller(sphereLods.data(), sphereLods.size(), 0.4f, instanceModels));
+        }
+        auto initializeSurfaceUniforms = [&]() {
+            bindSurfaceTextures(shaderTexture);
+            if (shaderInstanced) {
+                bindSurfaceTextures(*shaderInstanced);
+                glUniform1i(glGetUniformLocation(shaderInstanced->getProgram(), "textureIndex"), textureSphere);
+                glUniform1i(glGetUniformLocation(shaderInstanced->getProgram(), "lightmapBase"), -1);
+            }
+        };
+        initializeSurfaceUniforms();
+        vector<Shader*> shaders = {&shaderDeferredLighting, shaderSSAO.get(), shaderTAA.get(), shaderInstanceCull.get()};
+        shaders.erase(remove(shaders.begin(), shaders.end(), nullptr), shaders.end());
 
-        GLuint transformLoc = glGetUniformLocation(shaderSolid.getProgram(), "transform");
+        RenderState sceneState;
+        RenderState shadowState;
+        shadowState.polygonOffsetFactor = 2.0f;
+        shadowState.polygonOffsetUnits = 4.0f;
+        RenderState prepassState;
+        prepassState.colorWrite = false;
+        RenderState prepassedState;
+        prepassedState.depthFunc = GL_LEQUAL;
+        prepassedState.depthWrite = false;
+        RenderState fullscreenState;
+        fullscreenState.depthTest = false;
+        vector<TextureSlot> surfaceSlots = bindless ? vector<TextureSlot>{} : vector<TextureSlot>{{"textureArray", 0}};
+        Pipeline surfacePipeline(shaderTexture, ATTRIBUTES_SURFACE | ATTRIBUTE_LIGHTMAP, sceneState, surfaceSlots);
+        Pipeline prepassedSurfacePipeline(shaderTexture, ATTRIBUTES_SURFACE | ATTRIBUTE_LIGHTMAP, prepassedState, surfaceSlots);
+        const Pipeline& scenePipeline = depthPrepass ? prepassedSurfacePipeline : surfacePipeline;
+        Pipeline shadowPipeline(shaderDepth, ATTRIBUTES_SURFACE, shadowState);
+        Pipeline prepassPipeline(shaderDepth, ATTRIBUTES_SURFACE, prepassState);
+        Pipeline deferredLightingPipeline(shaderDeferredLighting, 0, fullscreenState);
+        unique_ptr<Pipeline> ssaoPipeline, taaPipeline, instancedPipeline;
+        if (shaderSSAO) {
+            ssaoPipeline.reset(new Pipeline(*shaderSSAO, 0, fullscreenState));
+        }
+        if (shaderTAA) {
+            taaPipeline.reset(new Pipeline(*shaderTAA, 0, fullscreenState));
+        }
+        if (shaderInstanced) {
+            instancedPipeline.reset(new Pipeline(*shaderInstanced, ATTRIBUTES_SURFACE | ATTRIBUTE_LIGHTMAP | ATTRIBUTE_INSTANCE, sceneState, surfaceSlots));
+        }
+        unique_ptr<Shader> shaderDebug;
+        unique_ptr<Pipeline> debugPipeline;
+        unique_ptr<DebugDraw> debugDraw;
+        if (debugDrawing) {
+            shaderDebug.reset(new Shader(shaderLibrary, {"debug_vertex"}, {"debug_fragment"}));
+            shaders.push_back(shaderDebug.get());
+            debugPipeline.reset(new Pipeline(*shaderDebug, ATTRIBUTE_POSITION | ATTRIBUTE_COLOR, fullscreenState));
+            debugDraw.reset(new DebugDraw());
+        }
 
-        GLuint textureSphere = loadTexture("texture/sphere.jpg");
-        GLuint textureSquare = loadTexture("texture/cube.jpg");
-        GLuint texturePyramide = loadTexture("texture/pyramid.jpg");
-        GLuint floorTexture = loadTexture("texture/second_floor.jpg"); 
-        GLuint wallTexture = loadTexture("texture/wall.jpg");
-        GLuint topTexture = loadTexture("texture/floor+ceiling.jpg");
+        ShapeRenderer planeRenderer(planeMesh.view());
+        ShapeRenderer pyramidRenderer(pyramidMesh.view());
+        ShapeRenderer cubeRenderer(cubeMesh.view());
+        ShapeRenderer wallRenderer(wallMesh.view());
+        ShapeRenderer ceilingRenderer(ceilingMesh.view());
+        ShapeRenderer secondFloorRenderer(secondPlaneMesh.view());
+        planeRenderer.setLightmapLayers(planeMesh.view(), bakeScene[0].twoSided);
+        secondFloorRenderer.setLightmapLayers(secondPlaneMesh.view(), bakeScene[1].twoSided);
+        wallRenderer.setLightmapLayers(wallMesh.view(), bakeScene[2].twoSided);
+        ceilingRenderer.setLightmapLayers(ceilingMesh.view(), bakeScene[3].twoSided);
 
-        vector<float> planeVertices = generatePlaneVertices();
-        ShapeRenderer planeRenderer(planeVertices);
-        ShapeRenderer pyramidRenderer(generatePyramidVertices());
+        vec3 planeBoundsMin, planeBoundsMax, secondFloorBoundsMin, secondFloorBoundsMax, cubeBoundsMin, cubeBoundsMax;
+        vec3 pyramidBoundsMin, pyramidBoundsMax, wallBoundsMin, wallBoundsMax, ceilingBoundsMin, ceilingBoundsMax;
+        computeVertexBounds(planeMesh.view(), planeBoundsMin, planeBoundsMax);
+        computeVertexBounds(secondPlaneMesh.view(), secondFloorBoundsMin, secondFloorBoundsMax);
+        computeVertexBounds(cubeMesh.view(), cubeBoundsMin, cubeBoundsMax);
+        computeVertexBounds(pyramidMesh.view(), pyramidBoundsMin, pyramidBoundsMax);
+        computeVertexBounds(wallMesh.view(), wallBoundsMin, wallBoundsMax);
+        computeVertexBounds(ceilingMesh.view(), ceilingBoundsMin, ceilingBoundsMax);
+        RenderQueue renderQueue;
 
-        vector<float> cubeVertices = generateCubeVertices();
-        ShapeRenderer cubeRenderer(cubeVertices);
+        unique_ptr<LodShapeRenderer> importedRenderer;
+        mat4 importedModel = mat4(1.0f);
+        vec3 importedCenter = vec3(0.0f);
+        vec3 importedBoundsMin = vec3(0.0f), importedBoundsMax = vec3(0.0f);
+        float importedScale = 1.0f;
+        Lightmaps lightmaps(loadOrBakeLightmaps(bakeScene, "lightmaps.cache", false));
+        vector<int> lightmapBases;
+        int lightmapQuadCount = 0;
+        for (const BakeMesh& mesh : bakeScene) {
+            lightmapBases.push_back(mesh.lightmapped ? lightmapQuadCount : -1);
+            lightmapQuadCount += mesh.lightmapLayerCount();
+        }
 
-        vector<float> wallVertices = generateWallVertices();
-        ShapeRenderer wallRenderer(wallVertices);
+        if (modelPath) {
+            MeshData importedMesh = loadMesh(modelPath);
+            if (importedMesh.getVertexCount() > 0) {
+                importedRenderer.reset(new LodShapeRenderer(importedMesh.vertices, VERTEX_PACKED_NORMAL));
+                vec3 extent = importedMesh.boundsMax - importedMesh.boundsMin;
+                float fit = 4.0f / std::max(std::max(extent.x, extent.y), std::max(extent.z, 1e-6f));
+                vec3 center = (importedMesh.boundsMin + importedMesh.boundsMax) * 0.5f;
+                importedCenter = vec3(0.0f, 13.0f + extent.y * fit * 0.5f, -5.0f);
+                importedScale = fit;
+                importedBoundsMin = importedMesh.boundsMin;
+                importedBoundsMax = importedMesh.boundsMax;
+                importedModel = translate(mat4(1.0f), importedCenter) * scale(mat4(1.0f), vec3(fit)) * translate(mat4(1.0f), -center);
+            }
+        }
 
-        vector<float> ceilingVertices = generateCeilingVertices();
-        ShapeRenderer ceilingRenderer(ceilingVertices);
+        mat4 floorModel = translate(mat4(1.0f), vec3(0.0f, -1.0f, 0.0f));
+        mat4 cubeModel = translate(mat4(1.0f), vec3(5, 13.2, 0));
+        mat4 pyramidModel = translate(mat4(1.0f), vec3(-5.0f, 12.2f, 0.0f)) * rotate(mat4(1.0f), radians(180.0f), vec3(0, 1, 0));
+        vector<SceneObject> sceneObjects = {
+            {[&](int) { return planeRenderer.getGeometry(); },
+             floorModel, floorModel, planeBoundsMin, planeBoundsMax, topTexture, lightmapBases[0], 1.0f, true},
+            {[&](int) { return secondFloorRenderer.getGeometry(); },
+             floorModel, floorModel, secondFloorBoundsMin, secondFloorBoundsMax, floorTexture, lightmapBases[1], 1.0f, true},
+            {[&](int lod) { return sphere.getGeometry(lod); },
+             mat4(1.0f), mat4(1.0f), vec3(-radius), vec3(radius), textureSphere, -1, 1.0f, false,
+             [&](float pixelsPerUnit) { return sphere.selectLod(pixelsPerUnit); }},
+            {[&](int) { return cubeRenderer.getGeometry(); },
+             cubeModel, cubeModel, cubeBoundsMin, cubeBoundsMax, textureSquare, -1, 1.0f},
+            {[&](int) { return pyramidRenderer.getGeometry(); },
+             pyramidModel, pyramidModel, pyramidBoundsMin, pyramidBoundsMax, texturePyramide, -1, 1.0f},
+            {[&](int) { return wallRenderer.getGeometry(); },
+             mat4(1.0f), mat4(1.0f), wallBoundsMin, wallBoundsMax, wallTexture, lightmapBases[2], 1.0f, true},
+            {[&](int) { return ceilingRenderer.getGeometry(); },
+             mat4(1.0f), mat4(1.0f), ceilingBoundsMin, ceilingBoundsMax, topTexture, lightmapBases[3], 1.0f, true},
+        };
+        size_t sphereObject = 2;
+        OcclusionCuller occlusionCuller;
+        occlusionCuller.addOccluder(planeMesh.view(), floorModel);
+        occlusionCuller.addOccluder(secondPlaneMesh.view(), floorModel);
+        occlusionCuller.addOccluder(wallMesh.view(), mat4(1.0f));
+        PortalVisibility portalVisibility = portalPath ? loadPortalGraph(portalPath) : staticPortalGraph();
+        if (importedRenderer) {
+            sceneObjects.push_back({[&](int lod) { return importedRenderer->getGeometry(lod); },
+                                    importedModel, importedModel, importedBoundsMin, importedBoundsMax, textureSquare, -1, importedScale, false,
+                                    [&](float pixelsPerUnit) { return importedRenderer->selectLod(pixelsPerUnit); }});
+        }
 
-        vector<float> secondFloorVertices = generateSecondPlaneVertices();
-        ShapeRenderer secondFloorRenderer(secondFloorVertices);
+        ClusteredLighting clusteredLighting;
+        for (int x = 0; x < 8; ++x) {
+            for (int z = 0; z < 8; ++z) {
+                vec3 color = vec3(0.5f + 0.5f * (x % 2), 0.5f + 0.5f * (z % 2), 0.5f + 0.25f * ((x + z) % 3));
+                clusteredLighting.getLights().push_back({vec3(-43.75f + x * 12.5f, 45.0f, -43.75f + z * 12.5f), 18.0f, color * 0.6f});
+            }
+        }
+        for (int i = 0; i < 16; ++i) {
+            float angle = i * 2.0f * M_PI / 16;
+            clusteredLighting.getLights().push_back({vec3(8.0f * cosf(angle), 15.0f, 8.0f * sinf(angle)), 5.0f, vec3(1.0f, 0.8f, 0.5f)});
+        }
+        ShadowCascades shadowCascades;
+        shaderLighting.use();
+        clusteredLighting.bind(shaderLighting);
+        shaderTexture.use();
+        shadowCascades.bind(shaderTexture);
+        lightmaps.bind(shaderTexture, 0.0f);
 
+        FrameArena frameArena;
+        const int allocationWarmupFrames = 120;
+        int steadyFrames = 0;
         while (!glfwWindowShouldClose(window)) {
+            frameArena.reset();
+            size_t frameAllocations = heapAllocations.load(memory_order_relaxed);
+            gpuTimer.beginFrame(frameArena);
+            vector<string> changedPieces = shaderLibrary.poll();
+            for (const string& piece : changedPieces) {
+                for (Shader* shader : shaders) {
+                    if (shader->dependsOn(piece)) shader->reload();
+                }
+                shaderPermutations.reload(piece);
+            }
+            bool reloaded = shaderPermutations.finishReload();
+            for (Shader* shader : shaders) {
+                reloaded = shader->finishReload() || reloaded;
+            }
+            if (reloaded) {
+                initializeSurfaceUniforms();
+            }
+            bool steady = changedPieces.empty() && !reloaded;
             timeOfDay += (1.0f / 60.0f);
             if (timeOfDay > (dayDuration + nightDuration)) {
                 timeOfDay = 0.0f;
@@ -506,22 +5498,18 @@ int main() {
                 lightColor *= intensity; 
             }
 
-            glEnable(GL_DEPTH_TEST);
+            surfacePipeline.bind();
             processInput(window);
             glClearColor(0.0f, 0.0f, 0.0f, 0.0f); 
-            glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
-
-            mat4 model = mat4(1.0f);
-            glUniformMatrix4fv(glGetUniformLocation(shaderTexture.getProgram(), "transform"), 1, GL_FALSE, value_ptr(model));
-            glUniform3fv(glGetUniformLocation(shaderTexture.getProgram(), "lightColor"), 1, value_ptr(lightColor));
-            glUniform3fv(glGetUniformLocation(shaderTexture.getProgram(), "lightPos"), 1, value_ptr(lightPos));
-            planeRenderer.render(shaderTexture, floorTexture, planeVertices.size() / 5);
+            Pipeline::clear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+            if (!bindless) {
+                textureArray.bind();
+            }
 
-            mat4 transformMatrix = mat4(1.0f);
             int width, height;
             glfwGetFramebufferSize(window, &width, &height);
-            mat4 projection = perspective(radians(45.0f), (float)width / (float)height, 0.1f, 100.0f);
-            model = translate(transformMatrix, vec3(0, 0, 0));
+            const float nearPlane = 0.1f, farPlane = 100.0f;
+            mat4 projection = perspective(radians(45.0f), (float)width / (float)height, nearPlane, farPlane);
             mat4 view;
             vec3 front; 
             front.x = cos(radians(zalfa)) * cos(radians(alfa));
@@ -529,39 +5517,167 @@ int main() {
             front.z = sin(radians(zalfa)) * cos(radians(alfa));
             front = normalize(front);
             view = lookAt(cameraPos, cameraPos + front, vec3(0, 1, 0));
-            glUniformMatrix4fv(transformLoc, 1, GL_FALSE, value_ptr(projection * view * model));
 
-            mat4 floorModel = translate(mat4(1.0f), vec3(0.0f, -1.0f, 0.0f));
-            glUniformMatrix4fv(glGetUniformLocation(shaderTexture.getProgram(), "transform"), 1, GL_FALSE, value_ptr(projection * view * floorModel));
-            planeRenderer.render(shaderTexture, topTexture, planeVertices.size() / 5);
-
-            mat4 secondfloorModel =mat4(1.0f);
-            glUniformMatrix4fv(glGetUniformLocation(shaderTexture.getProgram(), "transform"), 1, GL_FALSE, value_ptr(projection * view * floorModel));
-            secondFloorRenderer.render(shaderTexture, floorTexture, planeVertices.size() / 5);
-            
             mat4 sphereModel = translate(mat4(1.0f), spherePosition) * rotate(mat4(1.0f), radians(sphereRotationAngle), vec3(0.0f, 1.0f, 0.0f));
-            glUniformMatrix4fv(glGetUniformLocation(shaderTexture.getProgram(), "transform"), 1, GL_FALSE, value_ptr(projection * view * sphereModel));
-            sphere.render(shaderTexture, textureSphere);
 
-            mat4 cubeModel = translate(mat4(1.0f), vec3(5, 13.2, 0)); 
-            glUniformMatrix4fv(glGetUniformLocation(shaderTexture.getProgram(), "transform"), 1, GL_FALSE, value_ptr(projection * view * cubeModel));
-            cubeRenderer.render(shaderTexture, textureSquare, cubeVertices.size() / 5);
+            auto drawShadowCasters = [&](Shader& shader, const mat4& lightMatrix, bool dynamicCasters) {
+                GLint transformLocation = glGetUniformLocation(shader.getProgram(), "transform");
+                glUniform2f(glGetUniformLocation(shader.getProgram(), "jitter"), 0.0f, 0.0f);
+                if (dynamicCasters) {
+                    glUniformMatrix4fv(transformLocation, 1, GL_FALSE, value_ptr(lightMatrix * sphereModel));
+                    sphere.render(shader, textureSphere);
+                    return;
+                }
+                glUniformMatrix4fv(transformLocation, 1, GL_FALSE, value_ptr(lightMatrix * floorModel));
+                secondFloorRenderer.render(shader, floorTexture);
+                glUniformMatrix4fv(transformLocation, 1, GL_FALSE, value_ptr(lightMatrix * cubeModel));
+                cubeRenderer.render(shader, textureSquare);
+                glUniformMatrix4fv(transformLocation, 1, GL_FALSE, value_ptr(lightMatrix * pyramidModel));
+                pyramidRenderer.render(shader, texturePyramide);
+                if (importedRenderer) {
+                    glUniformMatrix4fv(transformLocation, 1, GL_FALSE, value_ptr(lightMatrix * importedModel));
+                    importedRenderer->render(shader, textureSquare);
+                }
+            };
+            gpuTimer.begin("shadows");
+            shadowCascades.update(shadowPipeline, lightPos, cameraPos, front, radians(45.0f), (float)width / (float)height, nearPlane, farPlane, drawShadowCasters);
+            gpuTimer.end();
+            int renderWidth = width, renderHeight = height;
+            if (dynamicResolution) {
+                dynamicResolution->update(gpuTimer.getMilliseconds("frame"));
+                dynamicResolution->begin(width, height);
+                renderWidth = dynamicResolution->getWidth();
+                renderHeight = dynamicResolution->getHeight();
+            } else {
+                glViewport(0, 0, width, height);
+            }
+
+            clusteredLighting.update(view, radians(45.0f), renderWidth, renderHeight, nearPlane, farPlane);
+            gpuTimer.begin("scene");
+            if (deferred) {
+                deferredRenderer.beginGeometry(renderWidth, renderHeight);
+            }
+            shaderTexture.use();
+            if (!deferred) {
+                clusteredLighting.bind(shaderTexture);
+            }
+            shadowCascades.bind(shaderTexture);
+            lightmaps.bind(shaderTexture, timeOfDay / (dayDuration + nightDuration));
+            glUniform3fv(glGetUniformLocation(shaderTexture.getProgram(), "viewPos"), 1, value_ptr(cameraPos));
+            glUniform3fv(glGetUniformLocation(shaderTexture.getProgram(), "lightColor"), 1, value_ptr(lightColor));
+            glUniform3fv(glGetUniformLocation(shaderTexture.getProgram(), "lightPos"), 1, value_ptr(lightPos));
+            vec2 jitter = taa ? taa->nextJitter(renderWidth, renderHeight) : vec2(0.0f);
+            glUniform2fv(glGetUniformLocation(shaderTexture.getProgram(), "jitter"), 1, value_ptr(jitter));
+
+            sceneObjects[sphereObject].model = sphereModel;
+            sceneObjects[sphereObject].previousModel = previousSphereModel;
+            portalVisibility.update(projection * view, cameraPos);
+            if (occlusionCulling) {
+                occlusionCuller.render(projection * view);
+                if (instanceCuller) {
+                    instanceCuller->updateHiZ(occlusionCuller, frameArena);
+                }
+            }
+            selectLods(sceneObjects, cameraPos, radians(45.0f), renderHeight);
+            renderQueue.record(sceneObjects, scenePipeline, projection * view, previousViewProjection,
+                               cameraPos, frameArena,
+                               occlusionCulling ? &occlusionCuller : nullptr, &portalVisibility);
+
+            if (depthPrepass) {
+                prepassPipeline.bind();
+                glUniform2fv(glGetUniformLocation(shaderDepth.getProgram(), "jitter"), 1, value_ptr(jitter));
+                renderQueue.replay(&prepassPipeline);
+            }
+            renderQueue.replay();
+            if (instanceCuller) {
+                instanceCuller->cull(*shaderInstanceCull, projection * view, cameraPos, radians(45.0f), renderHeight, occlusionCulling);
+                instancedPipeline->bind();
+                if (!deferred) {
+                    clusteredLighting.bind(*shaderInstanced);
+                }
+                shadowCascades.bind(*shaderInstanced);
+                lightmaps.bind(*shaderInstanced, timeOfDay / (dayDuration + nightDuration));
+                glUniform3fv(glGetUniformLocation(shaderInstanced->getProgram(), "viewPos"), 1, value_ptr(cameraPos));
+                glUniform3fv(glGetUniformLocation(shaderInstanced->getProgram(), "lightColor"), 1, value_ptr(lightColor));
+                glUniform3fv(glGetUniformLocation(shaderInstanced->getProgram(), "lightPos"), 1, value_ptr(lightPos));
+                glUniform2fv(glGetUniformLocation(shaderInstanced->getProgram(), "jitter"), 1, value_ptr(jitter));
+                instanceCuller->draw(*shaderInstanced, projection * view, previousViewProjection);
+            }
 
-            mat4 pyramidModel = translate(mat4(1.0f), vec3(-5.0f, 12.2f, 0.0f)) * rotate(mat4(1.0f), radians(180.0f), vec3(0, 1, 0));
-            glUniformMatrix4fv(glGetUniformLocation(shaderTexture.getProgram(), "transform"), 1, GL_FALSE, value_ptr(projection * view * pyramidModel));
-            pyramidRenderer.render(shaderTexture, texturePyramide, 18);
+            gpuTimer.end();
 
-            mat4 wallModel = mat4(1.0f);
-            glUniformMatrix4fv(glGetUniformLocation(shaderTexture.getProgram(), "transform"), 1, GL_FALSE, value_ptr(projection * view * wallModel));
-            wallRenderer.render(shaderTexture, wallTexture, wallVertices.size() / 5);
-            
-            mat4 ceilingModel = mat4(1.0f);
-            glUniformMatrix4fv(glGetUniformLocation(shaderTexture.getProgram(), "transform"), 1, GL_FALSE, value_ptr(projection * view * ceilingModel));
-            ceilingRenderer.render(shaderTexture, topTexture, ceilingVertices.size() / 5);
+            if (deferred) {
+                if (ssao) {
+                    gpuTimer.begin("ssao");
+                    ssao->compute(*ssaoPipeline, deferredRenderer.getDepthTexture(), deferredRenderer.getNormalTexture(),
+                                  renderWidth, renderHeight, deferredRenderer.getUvScale(), projection * view, nearPlane, farPlane);
+                    gpuTimer.end();
+                }
+                gpuTimer.begin("lighting");
+                shaderDeferredLighting.use();
+                clusteredLighting.bind(shaderDeferredLighting);
+                glUniform3fv(glGetUniformLocation(shaderDeferredLighting.getProgram(), "lightColor"), 1, value_ptr(lightColor));
+                if (ssao) {
+                    ssao->bind(shaderDeferredLighting);
+                }
+                deferredRenderer.resolve(deferredLightingPipeline, projection * view,
+                                         dynamicResolution ? dynamicResolution->getFramebuffer() : 0);
+                gpuTimer.end();
+            }
+            if (taa) {
+                gpuTimer.begin("taa");
+                taa->resolve(*taaPipeline, dynamicResolution->getColorTexture(),
+                             deferred ? deferredRenderer.getVelocityTexture() : dynamicResolution->getVelocityTexture(),
+                             renderWidth, renderHeight, dynamicResolution->getUvScale(), width, height);
+                taa->present();
+                gpuTimer.end();
+            } else if (dynamicResolution) {
+                dynamicResolution->present();
+            }
+            if (debugDraw) {
+                for (const SceneObject& object : sceneObjects) {
+                    vec3 worldMin, worldMax;
+                    transformBounds(object.model, object.boundsMin, object.boundsMax, worldMin, worldMax);
+                    debugDraw->box(worldMin, worldMax, object.occluder ? vec3(0.2f, 0.4f, 1.0f) : vec3(0.2f, 1.0f, 0.2f));
+                }
+                for (const PointLight& light : clusteredLighting.getLights()) {
+                    debugDraw->light(light.position, light.radius, light.color);
+                }
+                for (int i = 0; i < shadowCascades.getCascadeCount(); ++i) {
+                    debugDraw->frustum(shadowCascades.getCascadeMatrix(i), vec3(1.0f, 0.6f, 0.1f));
+                }
+                glBindFramebuffer(GL_FRAMEBUFFER, 0);
+                glViewport(0, 0, width, height);
+                debugDraw->draw(*debugPipeline, projection * view);
+            }
+            previousViewProjection = projection * view;
+            previousSphereModel = sphereModel;
+            gpuTimer.endFrame();
+            if (gpuTimings && glfwGetTime() - lastTimingReport > 2.0) {
+                char timings[512];
+                cout << gpuTimer.report(timings, sizeof(timings));
+                if (dynamicResolution) {
+                    cout << " | scale " << dynamicResolution->getScale();
+                }
+                cout << endl;
+                lastTimingReport = glfwGetTime();
+            }
 
             glfwSwapBuffers(window);
+            gpuResources().endFrame();
             glfwPollEvents();
+            if (allocationCheckFrames >= 0 && steady && ++steadyFrames > allocationWarmupFrames) {
+                size_t allocations = heapAllocations.load(memory_order_relaxed) - frameAllocations;
+                if (allocations > 0) {
+                    throw runtime_error(to_string(allocations) + " heap allocations in steady-state frame " + to_string(steadyFrames));
+                }
+                if (allocationCheckFrames > 0 && steadyFrames - allocationWarmupFrames >= allocationCheckFrames) {
+                    cout << "no heap allocations in " << allocationCheckFrames << " steady-state frames" << endl;
+                    glfwSetWindowShouldClose(window, GLFW_TRUE);
+                }
+            }
         }
+        gpuResources().shutdown();
         glfwDestroyWindow(window);
         glfwTerminate();
     } catch (const runtime_error& e) {
@@ -0,0 +1,27 @@
+uniform usamplerBuffer clusterTable;
+uniform usamplerBuffer clusterLightIndices;
+uniform samplerBuffer clusterLightData;
+uniform ivec3 clusterOffsets;
+uniform ivec3 clusterDims;
+uniform vec2 clusterTileSize;
+uniform float clusterNear;
+uniform float clusterFar;
+uniform float clusterSliceScale;
+uniform float clusterSliceBias;
+vec3 clusterLighting(vec3 worldPos, vec3 normal, vec3 fragCoord) {
+    float depth = clusterNear * clusterFar / (clusterFar - fragCoord.z * (clusterFar - clusterNear));
+    int slice = clamp(int(log(depth) * clusterSliceScale + clusterSliceBias), 0, clusterDims.z - 1);
+    ivec2 tile = clamp(ivec2(fragCoord.xy / clusterTileSize), ivec2(0), clusterDims.xy - 1);
+    uvec2 range = texelFetch(clusterTable, clusterOffsets.x + (slice * clusterDims.y + tile.y) * clusterDims.x + tile.x).xy;
+    vec3 lighting = vec3(0.0);
+    for (uint i = 0u; i < range.y; ++i) {
+        int light = int(texelFetch(clusterLightIndices, clusterOffsets.y + int(range.x + i)).x);
+        vec4 positionRadius = texelFetch(clusterLightData, clusterOffsets.z + light * 2);
+        vec3 color = texelFetch(clusterLightData, clusterOffsets.z + light * 2 + 1).rgb;
+        vec3 toLight = positionRadius.xyz - worldPos;
+        float distance = length(toLight);
+        float falloff = clamp(1.0 - distance / positionRadius.w, 0.0, 1.0);
+        lighting += color * falloff * falloff * max(dot(normal, toLight / max(distance, 1e-4)), 0.0);
+    }
+    return lighting;
+}
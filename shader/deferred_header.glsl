@@ -0,0 +1 @@
+#version 330 core
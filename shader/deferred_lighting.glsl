@@ -0,0 +1,45 @@
+out vec4 fragColor;
+uniform sampler2D gAlbedo;
+uniform sampler2D gNormal;
+uniform sampler2D gLighting;
+uniform sampler2D gDepth;
+uniform mat4 inverseViewProjection;
+uniform vec2 screenSize;
+uniform vec3 lightColor;
+uniform sampler2D ssaoTexture;
+uniform int ssaoEnabled;
+uniform int ssaoDivisor;
+float upsampleOcclusion(vec2 fragCoord, float viewDepth) {
+    vec2 lowCoord = fragCoord / float(ssaoDivisor) - 0.5;
+    ivec2 base = ivec2(floor(lowCoord));
+    vec2 f = lowCoord - vec2(base);
+    ivec2 maxCoord = textureSize(ssaoTexture, 0) - 1;
+    float occlusion = 0.0, weightSum = 0.0;
+    for (int i = 0; i < 4; ++i) {
+        ivec2 offset = ivec2(i & 1, i >> 1);
+        vec2 aoDepth = texelFetch(ssaoTexture, clamp(base + offset, ivec2(0), maxCoord), 0).rg;
+        float bilinear = (offset.x == 1 ? f.x : 1.0 - f.x) * (offset.y == 1 ? f.y : 1.0 - f.y);
+        float weight = (bilinear + 1e-3) / (1e-3 + abs(aoDepth.g - viewDepth) / viewDepth);
+        occlusion += aoDepth.r * weight;
+        weightSum += weight;
+    }
+    return occlusion / weightSum;
+}
+void main() {
+    ivec2 pixel = ivec2(gl_FragCoord.xy);
+    float depth = texelFetch(gDepth, pixel, 0).r;
+    vec3 lighting = texelFetch(gLighting, pixel, 0).rgb;
+    if (depth >= 1.0) {
+        fragColor = vec4(lighting, 1.0);
+        return;
+    }
+    vec4 albedo = texelFetch(gAlbedo, pixel, 0);
+    vec3 normal = octDecode(texelFetch(gNormal, pixel, 0).rg);
+    vec4 world = inverseViewProjection * vec4(vec3(gl_FragCoord.xy / screenSize, depth) * 2.0 - 1.0, 1.0);
+    vec3 worldPos = world.xyz / world.w;
+    float viewDepth = clusterNear * clusterFar / (clusterFar - depth * (clusterFar - clusterNear));
+    float occlusion = ssaoEnabled != 0 ? upsampleOcclusion(gl_FragCoord.xy, viewDepth) : 1.0;
+    lighting += albedo.rgb * lightColor * albedo.a * occlusion;
+    lighting += albedo.rgb * clusterLighting(worldPos, normal, vec3(gl_FragCoord.xy, depth));
+    fragColor = vec4(lighting, 1.0);
+}
@@ -0,0 +1,79 @@
+#version 430 core
+layout(local_size_x = 64) in;
+struct Instance {
+    mat4 model;
+    vec4 boundsMin;
+    vec4 boundsMax;
+};
+struct DrawCommand {
+    uint count;
+    uint instanceCount;
+    uint firstIndex;
+    int baseVertex;
+    uint baseInstance;
+};
+layout(std430, binding = 0) readonly buffer Instances {
+    Instance instances[];
+};
+layout(std430, binding = 1) buffer Commands {
+    DrawCommand commands[];
+};
+layout(std430, binding = 2) writeonly buffer Visible {
+    uint visible[];
+};
+uniform uint instanceCount;
+uniform vec4 frustumPlanes[6];
+uniform mat4 viewProjection;
+uniform vec3 cameraPos;
+uniform float pixelsPerUnitScale;
+uniform float lodErrors[8];
+uniform int lodCount;
+uniform sampler2D hiZ;
+uniform bool hiZEnabled;
+bool insideFrustum(vec3 boundsMin, vec3 boundsMax) {
+    for (int i = 0; i < 6; ++i) {
+        vec3 positive = mix(boundsMin, boundsMax, greaterThanEqual(frustumPlanes[i].xyz, vec3(0.0)));
+        if (dot(frustumPlanes[i].xyz, positive) + frustumPlanes[i].w < 0.0) return false;
+    }
+    return true;
+}
+bool occluded(vec3 boundsMin, vec3 boundsMax) {
+    vec2 screenMin = vec2(1.0), screenMax = vec2(0.0);
+    float nearest = 1.0;
+    for (int c = 0; c < 8; ++c) {
+        vec3 corner = mix(boundsMin, boundsMax, bvec3((c & 1) != 0, (c & 2) != 0, (c & 4) != 0));
+        vec4 clip = viewProjection * vec4(corner, 1.0);
+        if (clip.z < -clip.w || clip.w <= 1e-5) return false;
+        vec3 screen = clip.xyz / clip.w * 0.5 + 0.5;
+        screenMin = min(screenMin, screen.xy);
+        screenMax = max(screenMax, screen.xy);
+        nearest = min(nearest, screen.z);
+    }
+    ivec2 size = textureSize(hiZ, 0);
+    ivec2 first = clamp(ivec2(screenMin * vec2(size)), ivec2(0), size - 1);
+    ivec2 last = clamp(ivec2(screenMax * vec2(size)), ivec2(0), size - 1);
+    int level = min(findMSB(max(last.x - first.x, last.y - first.y)) + 1, textureQueryLevels(hiZ) - 1);
+    ivec2 levelLast = textureSize(hiZ, level) - 1;
+    first = min(first >> level, levelLast);
+    last = min(last >> level, levelLast);
+    for (int y = first.y; y <= last.y; ++y) {
+        for (int x = first.x; x <= last.x; ++x) {
+            if (nearest < texelFetch(hiZ, ivec2(x, y), level).r) return false;
+        }
+    }
+    return true;
+}
+void main() {
+    uint id = gl_GlobalInvocationID.x;
+    if (id >= instanceCount) return;
+    vec3 boundsMin = instances[id].boundsMin.xyz;
+    vec3 boundsMax = instances[id].boundsMax.xyz;
+    if (!insideFrustum(boundsMin, boundsMax)) return;
+    if (hiZEnabled && occluded(boundsMin, boundsMax)) return;
+    float distance = max(length((boundsMin + boundsMax) * 0.5 - cameraPos), 0.1);
+    float pixelsPerUnit = pixelsPerUnitScale / distance;
+    int lod = 0;
+    while (lod + 1 < lodCount && lodErrors[lod + 1] * pixelsPerUnit <= 1.0) ++lod;
+    uint slot = atomicAdd(commands[lod].instanceCount, 1u);
+    visible[commands[lod].baseInstance + slot] = id;
+}
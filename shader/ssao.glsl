@@ -0,0 +1,64 @@
+out vec2 aoDepth;
+uniform sampler2D gDepth;
+uniform sampler2D gNormal;
+uniform sampler2D ssaoHistory;
+uniform int ssaoDivisor;
+uniform vec2 screenSize;
+uniform vec2 depthUvScale;
+uniform float nearPlane;
+uniform float farPlane;
+uniform mat4 viewProjection;
+uniform mat4 inverseViewProjection;
+uniform mat4 previousViewProjection;
+uniform vec3 kernel[12];
+uniform float radius;
+uniform int frameIndex;
+uniform int historyValid;
+float linearDepth(float depth) {
+    return nearPlane * farPlane / (farPlane - depth * (farPlane - nearPlane));
+}
+void main() {
+    ivec2 lowPixel = ivec2(gl_FragCoord.xy);
+    ivec2 pixel = min(lowPixel * ssaoDivisor + ssaoDivisor / 2, ivec2(screenSize) - 1);
+    float depth = texelFetch(gDepth, pixel, 0).r;
+    if (depth >= 1.0) {
+        aoDepth = vec2(1.0, farPlane);
+        return;
+    }
+    vec2 uv = (vec2(pixel) + 0.5) / screenSize;
+    vec4 world = inverseViewProjection * vec4(vec3(uv, depth) * 2.0 - 1.0, 1.0);
+    vec3 position = world.xyz / world.w;
+    vec3 normal = octDecode(texelFetch(gNormal, pixel, 0).rg);
+    float viewDepth = linearDepth(depth);
+
+    vec2 noiseCoord = vec2(lowPixel) + float(frameIndex % 16) * 5.588238;
+    float angle = 6.2831853 * fract(52.9829189 * fract(dot(noiseCoord, vec2(0.06711056, 0.00583715))));
+    vec3 tangent = normalize(abs(normal.x) > 0.5 ? cross(normal, vec3(0.0, 1.0, 0.0)) : cross(normal, vec3(1.0, 0.0, 0.0)));
+    vec3 bitangent = cross(normal, tangent);
+    vec3 rotatedTangent = tangent * cos(angle) + bitangent * sin(angle);
+    vec3 rotatedBitangent = cross(normal, rotatedTangent);
+
+    float occlusion = 0.0;
+    for (int i = 0; i < 12; ++i) {
+        vec3 samplePos = position + (rotatedTangent * kernel[i].x + rotatedBitangent * kernel[i].y + normal * kernel[i].z) * radius;
+        vec4 clip = viewProjection * vec4(samplePos, 1.0);
+        vec2 sampleUv = clip.xy / clip.w * 0.5 + 0.5;
+        if (any(lessThan(sampleUv, vec2(0.0))) || any(greaterThan(sampleUv, vec2(1.0)))) continue;
+        float sceneDepth = linearDepth(texture(gDepth, sampleUv * depthUvScale).r);
+        float range = smoothstep(0.0, 1.0, radius / max(abs(viewDepth - sceneDepth), 1e-4));
+        occlusion += (sceneDepth < clip.w - 0.05 ? 1.0 : 0.0) * range;
+    }
+    float ao = 1.0 - occlusion / 12.0;
+
+    if (historyValid != 0) {
+        vec4 previous = previousViewProjection * vec4(position, 1.0);
+        vec2 previousUv = previous.xy / previous.w * 0.5 + 0.5;
+        if (all(greaterThan(previousUv, vec2(0.0))) && all(lessThan(previousUv, vec2(1.0)))) {
+            vec2 history = texture(ssaoHistory, previousUv).rg;
+            if (abs(history.g - previous.w) < 0.05 * previous.w) {
+                ao = mix(history.r, ao, 0.15);
+            }
+        }
+    }
+    aoDepth = vec2(ao, viewDepth);
+}
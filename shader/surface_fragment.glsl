@@ -0,0 +1,116 @@
+in vec2 TexCoord;
+in vec3 Normal;
+in vec3 WorldPos;
+in vec4 CurrentClip;
+in vec4 PreviousClip;
+#if defined(TEXTURED) && defined(BINDLESS)
+layout(std140) uniform TextureHandles {
+    uvec4 textureHandles[256];
+};
+uniform int textureIndex;
+vec4 surfaceAlbedo() {
+    uvec4 entry = textureHandles[textureIndex / 2];
+    sampler2D textureSampler = sampler2D((textureIndex & 1) == 0 ? entry.xy : entry.zw);
+    return texture(textureSampler, TexCoord);
+}
+#elif defined(TEXTURED)
+uniform sampler2DArray textureArray;
+uniform int textureIndex;
+vec4 surfaceAlbedo() {
+    return texture(textureArray, vec3(TexCoord, textureIndex));
+}
+#else
+vec4 surfaceAlbedo() {
+    return vec4(1.0);
+}
+#endif
+vec2 screenVelocity() {
+    return (CurrentClip.xy / CurrentClip.w - PreviousClip.xy / PreviousClip.w) * 0.5;
+}
+#ifdef LIT
+flat in ivec2 LightmapLayers;
+uniform vec3 lightColor;
+uniform vec3 lightPos;
+uniform vec3 viewPos;
+uniform sampler2DArrayShadow shadowMap;
+uniform mat4 shadowMatrices[4];
+uniform int shadowCascadeCount;
+uniform float shadowSplits[4];
+uniform vec3 shadowViewForward;
+uniform sampler2DArray lightmaps;
+uniform int lightmapBase;
+uniform int lightmapQuadCount;
+uniform ivec2 lightmapKeyframes;
+uniform float lightmapBlend;
+float sunShadow(vec3 normal) {
+    float depth = dot(WorldPos - viewPos, shadowViewForward);
+    for (int i = 0; i < shadowCascadeCount; ++i) {
+        if (depth > shadowSplits[i]) continue;
+        vec4 coord = shadowMatrices[i] * vec4(WorldPos + normal * 0.02 * float(i + 1), 1.0);
+        if (all(greaterThan(coord.xyz, vec3(0.0))) && all(lessThan(coord.xyz, vec3(1.0)))) {
+            return texture(shadowMap, vec4(coord.xy, float(i), coord.z));
+        }
+    }
+    return 1.0;
+}
+vec3 surfaceNormal() {
+    vec3 normal = normalize(Normal);
+    if (dot(normal, viewPos - WorldPos) < 0.0) normal = -normal;
+    return normal;
+}
+vec2 sunTerms(vec3 normal) {
+    if (lightmapBase >= 0) {
+        int layer = lightmapBase + (gl_FrontFacing ? LightmapLayers.x : LightmapLayers.y);
+        vec2 bakedA = texture(lightmaps, vec3(TexCoord, float(layer + lightmapKeyframes.x * lightmapQuadCount))).rg;
+        vec2 bakedB = texture(lightmaps, vec3(TexCoord, float(layer + lightmapKeyframes.y * lightmapQuadCount))).rg;
+        vec2 baked = mix(bakedA, bakedB, lightmapBlend);
+        float sun = baked.g;
+        if (sun > 0.0) sun *= sunShadow(normal);
+        return vec2(baked.r, 0.4 * sun);
+    }
+    float sun = max(dot(normal, normalize(lightPos)), 0.0);
+    if (sun > 0.0) sun *= sunShadow(normal);
+    return vec2(0.6, 0.4 * sun);
+}
+#endif
+#if defined(DEPTH_ONLY)
+void main() {
+}
+#elif defined(LIT) && defined(DEFERRED)
+layout(location = 0) out vec4 gAlbedo;
+layout(location = 1) out vec2 gNormal;
+layout(location = 2) out vec3 gLighting;
+layout(location = 3) out vec2 gVelocity;
+vec2 octEncode(vec3 n) {
+    n /= abs(n.x) + abs(n.y) + abs(n.z);
+    if (n.z < 0.0) n.xy = (1.0 - abs(n.yx)) * vec2(n.x >= 0.0 ? 1.0 : -1.0, n.y >= 0.0 ? 1.0 : -1.0);
+    return n.xy;
+}
+void main() {
+    vec4 texColor = surfaceAlbedo();
+    vec3 normal = surfaceNormal();
+    vec2 terms = sunTerms(normal);
+    gAlbedo = vec4(texColor.rgb, terms.x);
+    gNormal = octEncode(normal);
+    gLighting = texColor.rgb * lightColor * terms.y;
+    gVelocity = screenVelocity();
+}
+#elif defined(LIT)
+layout(location = 0) out vec4 fragColor;
+layout(location = 1) out vec2 fragVelocity;
+void main() {
+    vec4 texColor = surfaceAlbedo();
+    vec3 normal = surfaceNormal();
+    vec2 terms = sunTerms(normal);
+    vec3 lighting = lightColor * (terms.x + terms.y) + clusterLighting(WorldPos, normal, gl_FragCoord.xyz);
+    fragColor = vec4(texColor.rgb * lighting, texColor.a);
+    fragVelocity = screenVelocity();
+}
+#else
+layout(location = 0) out vec4 fragColor;
+layout(location = 1) out vec2 fragVelocity;
+void main() {
+    fragColor = surfaceAlbedo();
+    fragVelocity = screenVelocity();
+}
+#endif
@@ -0,0 +1,54 @@
+layout(location = 0) in vec3 aPos;
+layout(location = 1) in vec2 aTexCoord;
+layout(location = 2) in vec2 aNormalOct;
+#ifdef LIT
+layout(location = 5) in vec2 aLightmapLayers;
+flat out ivec2 LightmapLayers;
+#endif
+#ifdef INSTANCED
+layout(location = 3) in uint aInstance;
+struct Instance {
+    mat4 model;
+    vec4 boundsMin;
+    vec4 boundsMax;
+};
+layout(std430, binding = 0) readonly buffer Instances {
+    Instance instances[];
+};
+uniform mat4 viewProjection;
+uniform mat4 previousViewProjection;
+#else
+uniform mat4 transform;
+uniform mat4 previousTransform;
+uniform mat4 model;
+#endif
+out vec2 TexCoord;
+out vec3 Normal;
+out vec3 WorldPos;
+out vec4 CurrentClip;
+out vec4 PreviousClip;
+invariant gl_Position;
+uniform vec2 jitter;
+uniform vec3 positionScale;
+uniform vec3 positionOffset;
+void main() {
+    vec4 position = vec4(aPos * positionScale + positionOffset, 1.0);
+#ifdef INSTANCED
+    mat4 model = instances[aInstance].model;
+    vec4 world = model * position;
+    gl_Position = viewProjection * world;
+    PreviousClip = previousViewProjection * world;
+#else
+    vec4 world = model * position;
+    gl_Position = transform * position;
+    PreviousClip = previousTransform * position;
+#endif
+    CurrentClip = gl_Position;
+    gl_Position.xy += jitter * gl_Position.w;
+    TexCoord = aTexCoord;
+    Normal = mat3(model) * octDecode(aNormalOct);
+    WorldPos = vec3(world);
+#ifdef LIT
+    LightmapLayers = ivec2(aLightmapLayers);
+#endif
+}
@@ -0,0 +1,33 @@
+#version 330 core
+out vec4 fragColor;
+uniform sampler2D currentColor;
+uniform sampler2D velocityTexture;
+uniform sampler2D historyColor;
+uniform vec2 renderSize;
+uniform vec2 inputUvScale;
+uniform vec2 outputSize;
+uniform vec2 jitter;
+uniform int historyValid;
+void main() {
+    vec2 uv = gl_FragCoord.xy / outputSize;
+    vec2 currentUv = uv + jitter * 0.5;
+    vec3 current = texture(currentColor, currentUv * inputUvScale).rgb;
+    ivec2 center = clamp(ivec2(currentUv * renderSize), ivec2(0), ivec2(renderSize) - 1);
+    vec3 minimum = current, maximum = current;
+    for (int y = -1; y <= 1; ++y) {
+        for (int x = -1; x <= 1; ++x) {
+            vec3 neighbor = texelFetch(currentColor, clamp(center + ivec2(x, y), ivec2(0), ivec2(renderSize) - 1), 0).rgb;
+            minimum = min(minimum, neighbor);
+            maximum = max(maximum, neighbor);
+        }
+    }
+    vec2 velocity = texelFetch(velocityTexture, center, 0).rg;
+    vec2 previousUv = uv - velocity;
+    float currentWeight = 1.0;
+    vec3 history = current;
+    if (historyValid != 0 && all(greaterThan(previousUv, vec2(0.0))) && all(lessThan(previousUv, vec2(1.0)))) {
+        history = clamp(texture(historyColor, previousUv).rgb, minimum, maximum);
+        currentWeight = 0.1;
+    }
+    fragColor = vec4(mix(history, current, currentWeight), 1.0);
+}